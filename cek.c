@@ -0,0 +1,458 @@
+#include "crisp.h"
+
+// This file contains an alternative evaluator, used when a vm's heap_stack
+// is set.
+// It follows the same rules as eval in crisp.c, but instead of recursing on
+// the C stack whenever a subexpression must be evaluated, it pushes a frame
+// describing the pending work onto a growable stack on the heap. This is a
+// CEK machine: the control (c), the environment (env), and the continuation
+// (the frame stack). Recursion depth is then limited only by memory.
+
+// Evaluated arguments are accumulated on a separate value stack, so a
+// NATIVE_FN_V can be applied directly to a slice of it.
+
+// Native functions which call eval themselves, and pure macro expansion,
+// still nest on the C stack, but only for the duration of that call.
+
+// Since its whole state is on the heap, a machine can also stop partway
+// and be resumed later. Green threads (see green.c) run on machines with
+// a budget of steps, and stop when it runs out or when a channel operation
+// would block.
+
+typedef enum {
+    // The head of a list has been evaluated; decide how to apply it
+    K_HEAD,
+    // Evaluating arguments onto the value stack, to apply fn afterwards
+    K_ARGS,
+    // Evaluating elements of a list which isn't an application
+    K_LIST,
+    // The car of a pair has been evaluated; evaluate the cdr next
+    K_CONS_CAR,
+    // The cdr of a pair has been evaluated; the pair can be built
+    K_CONS_CDR,
+    // The predicate of an if has been evaluated
+    K_IF,
+    // The referent of a with has been evaluated
+    K_WITH,
+    // The function passed to apply has been evaluated
+    K_APPLY_FN,
+    // The arguments passed to apply have been evaluated
+    K_APPLY_ARGS,
+} frame_kind;
+
+typedef struct {
+    frame_kind kind;
+    // Code still to be evaluated for this frame
+    cell code;
+    cell env;
+    // A function or a value saved for later
+    cell data;
+    // Index of this frame's first value on the value stack
+    size_t base;
+    // Whether the last value came from the tail of an improper list
+    bool improper;
+} frame;
+
+typedef enum {
+    // Evaluate c in env
+    R_EVAL,
+    // Apply the top frame's function again, since it would have blocked
+    R_APPLY,
+} resume_point;
+
+struct machine {
+    frame* frames;
+    size_t depth;
+    size_t max_depth;
+    cell* values;
+    size_t num_values;
+    size_t max_values;
+    // Where and what to evaluate when a stopped machine is resumed
+    resume_point resume;
+    cell c;
+    cell env;
+};
+
+static frame* push_frame(machine* m, frame_kind kind, cell code, cell env) {
+    if (m->depth == m->max_depth)
+        m->frames = GC_REALLOC(m->frames, (m->max_depth *= 2) * sizeof(frame));
+    frame* f = &m->frames[m->depth++];
+    f->kind = kind;
+    f->code = code;
+    f->env = env;
+    f->data = NIL;
+    f->base = m->num_values;
+    f->improper = false;
+    return f;
+}
+
+static void push_value(machine* m, cell v) {
+    if (m->num_values == m->max_values)
+        m->values = GC_REALLOC(m->values, (m->max_values *= 2) * sizeof(cell));
+    m->values[m->num_values++] = v;
+}
+
+// Pop the values belonging to a frame into a compact list
+static cell pop_values(machine* m, frame* f) {
+    cell tail = NIL;
+    size_t i = m->num_values;
+    if (f->improper && i > f->base) tail = m->values[--i];
+    size_t n = i - f->base;
+    cell rv = make_list(n, tail), l = rv;
+    for (i = f->base; i < f->base + n; i++, l = cdr(l)) SET_CAR(l, m->values[i]);
+    m->num_values = f->base;
+    return rv;
+}
+
+// Prepare a machine to evaluate c in env once it's run
+static void init_machine(machine* m, cell c, cell env) {
+    m->depth = 0;
+    m->max_depth = 32;
+    m->frames = GC_MALLOC(m->max_depth * sizeof(frame));
+    m->num_values = 0;
+    m->max_values = 32;
+    m->values = GC_MALLOC(m->max_values * sizeof(cell));
+    m->resume = R_EVAL;
+    m->c = c;
+    m->env = env;
+}
+
+// Symbols which aren't bound locally are looked up in the globals through
+// a cache, kept per vm and cleared by any def, rather than by walking every
+// global binding
+#define GLOBAL_CACHE_SIZE 1024
+
+typedef struct {
+    cell name;
+    uint64_t epoch;
+    cell binding;
+} global_t;
+
+// Find the binding of the symbol name in env, as assoc would
+static cell lookup(cell name, cell env) {
+    cell globals = current_vm->global_env;
+    for (; IS_PAIR(env) && env != globals; env = cdr(env)) {
+        if (!IS_PAIR(car(env))) return NIL;
+        if (caar(env) == name) return car(env);
+    }
+    if (env != globals) return NIL;
+    global_t* global_cache = current_vm->global_cache;
+    if (!global_cache)
+        global_cache = current_vm->global_cache =
+            malloc_or_die(GLOBAL_CACHE_SIZE * sizeof(global_t));
+    global_t* e = &global_cache[((uint64_t) PTR(name) >> 4) % GLOBAL_CACHE_SIZE];
+    if (e->name != name || e->epoch != current_vm->def_epoch) {
+        e->name = name;
+        e->epoch = current_vm->def_epoch;
+        e->binding = assoc(name, globals);
+    }
+    return e->binding;
+}
+
+// The value of the symbol c in env, as eval would find it
+static cell resolve(cell c, cell env) {
+    cell resolved_symbol = lookup(c, env);
+    if (resolved_symbol) return cdr(resolved_symbol);
+    cell ffi_sym = find_ffi_sym(SYM_STR(c), env);
+    return ffi_sym ? ffi_sym : c;
+}
+
+// The environment of a lambda applied to the top frame's values, binding
+// its parameters as bind_args would, without building a list of arguments
+static cell bind_values(machine* m, frame* f, fn_t* l) {
+    cell* values = m->values + f->base;
+    size_t argc = m->num_values - f->base, n = 0, i;
+    cell params = l->args, p;
+    // () . rest binds rest to every argument
+    if (!car(params) && TYPE(cdr(params)) == SYMBOL)
+        params = cdr(params);
+    else
+        for (; IS_PAIR(params) && n < argc; params = cdr(params)) n++;
+    // A terminal symbol in the parameters takes the remaining arguments
+    bool rest = params && !IS_PAIR(params);
+    cell env = make_list(n + rest, l->env), e = env;
+    for (i = 0, p = l->args; i < n; i++, p = cdr(p), e = cdr(e))
+        SET_CAR(e, cons(car(p), values[i]));
+    if (rest) {
+        cell remaining = make_list(argc - n, NIL), r = remaining;
+        for (; i < argc; i++, r = cdr(r)) SET_CAR(r, values[i]);
+        SET_CAR(e, cons(params, remaining));
+    }
+    m->num_values = f->base;
+    return env;
+}
+
+machine* machine_new(cell c, cell env) {
+    machine* m = malloc_or_die(sizeof(machine));
+    init_machine(m, c, env);
+    return m;
+}
+
+// Run m until it's finished, when *result is its value. If steps is set, each
+// evaluation uses one of them, and m stops once none are left or an
+// application of a native function would block. Returns true if finished
+bool machine_run(machine* m, int64_t* steps, cell* result) {
+    cell c = m->c;
+    cell env = m->env;
+    frame* f;
+    cell v, first;
+
+    if (m->resume == R_APPLY) goto next_value;
+
+    eval:
+    if (steps && --*steps < 0) {
+        m->resume = R_EVAL;
+        m->c = c;
+        m->env = env;
+        return false;
+    }
+    // Evaluate c in env, then deliver the result in v to the top frame
+    if (IS_PAIR(c)) {
+        DPRINTF("\x1b[0m" "Evalling %s in %s\n" "\x1b[0m", print_cell(c), print_env(env));
+        TRACE(TRACE_EVAL, c);
+        // () x y -> () 1 2
+        if (!car(c)) {
+            f = push_frame(m, K_LIST, cdr(c), env);
+            goto next_value;
+        }
+        // (x) -> eval x -> 1
+        if (!cdr(c)) {
+            c = car(c);
+            goto eval;
+        }
+        // A symbol at the head is looked up in place rather than through a
+        // frame, still using a step
+        if (TYPE(car(c)) == SYMBOL && (!steps || *steps > 0)) {
+            if (steps) --*steps;
+            first = resolve(car(c), env);
+            c = cdr(c);
+            goto head;
+        }
+        push_frame(m, K_HEAD, cdr(c), env);
+        c = car(c);
+        goto eval;
+    }
+    v = TYPE(c) == SYMBOL ? resolve(c, env) : c;
+
+    ret:
+    if (!m->depth) {
+        *result = v;
+        return true;
+    }
+    f = &m->frames[m->depth - 1];
+    switch (f->kind) {
+        case K_HEAD:
+            first = v;
+            c = f->code;
+            env = f->env;
+            m->depth--;
+            goto head;
+        case K_ARGS:
+        case K_LIST:
+            push_value(m, v);
+            goto next_value;
+        case K_CONS_CAR:
+            // Evaluate the rest of the list as the cdr
+            f->kind = K_CONS_CDR;
+            f->data = v;
+            c = f->code;
+            env = f->env;
+            goto eval;
+        case K_CONS_CDR:
+            v = cons(f->data, v);
+            m->depth--;
+            goto ret;
+        case K_IF: {
+            // The same rules as if_fn
+            cell args = f->code;
+            env = f->env;
+            m->depth--;
+            // Return nil if there was no "then" branch
+            if (!IS_PAIR(cdr(args))) {
+                v = NIL;
+                goto ret;
+            }
+            if (v) {
+                c = cdar(args);
+                goto eval;
+            }
+            // The predicate was false but no "else" branch was provided
+            if (!IS_PAIR(cddr(args))) {
+                v = NIL;
+                goto ret;
+            }
+            c = cdddr(args) ? cddr(args) : cddar(args);
+            goto eval;
+        }
+        case K_WITH: {
+            // The same rules as with
+            cell args = f->code;
+            env = f->env;
+            m->depth--;
+            // with x 2 ->
+            if (!IS_PAIR(cddr(args))) {
+                v = NIL;
+                goto ret;
+            }
+            cell var_name = car(args);
+            // with 4 x ->
+            if (TYPE(var_name) != SYMBOL) var_name = eval(var_name, env);
+            env = cons(cons(var_name, v), env);
+            c = cddr(args);
+            goto eval;
+        }
+        case K_APPLY_FN:
+            // The same rules as apply_fn
+            // apply f . x ->
+            if (!IS_CALLABLE(v) || !IS_PAIR(cdr(f->code))) {
+                m->depth--;
+                v = NIL;
+                goto ret;
+            }
+            f->kind = K_APPLY_ARGS;
+            f->data = v;
+            c = cdar(f->code);
+            env = f->env;
+            goto eval;
+        case K_APPLY_ARGS: {
+            cell fn = f->data;
+            env = f->env;
+            m->depth--;
+            c = IS_PAIR(v) ? v : LIST1(v);
+            if (apply(fn, &c, &env)) goto eval;
+            v = c;
+            goto ret;
+        }
+    }
+
+    head:
+    // The head of a list evaluated to first, and c is the rest of the list
+    // (x y) -> 1 2
+    if (!c) {
+        v = first;
+        goto ret;
+    }
+    // x . y -> 1 . (eval y) -> 1 . 2
+    if (!IS_PAIR(c)) {
+        push_frame(m, K_CONS_CDR, NIL, env)->data = first;
+        goto eval;
+    }
+    // cons x y -> 1 . (eval y) -> 1 . 2
+    if (TYPE(first) == CONS) {
+        push_frame(m, K_CONS_CAR, cdr(c), env);
+        c = car(c);
+        goto eval;
+    }
+    if (TYPE(first) == FFI_SYM) first = CAST(first, FFI_FN);
+    // x y -> 1 2
+    if (!IS_CALLABLE(first)) {
+        f = push_frame(m, K_LIST, c, env);
+        f->data = first;
+        goto next_value;
+    }
+    switch (TYPE(first)) {
+        // These types expect their arguments to be evaluated first
+        case NATIVE_FN_V:
+        case NATIVE_FN:
+        case FN:
+        case FFI_FN:
+            f = push_frame(m, K_ARGS, c, env);
+            f->data = first;
+            goto next_value;
+        case NATIVE_FN_TCO:
+            // The control flow builtins evaluate subexpressions,
+            // so the machine implements them itself
+            if (FN_PTR(first) == (void*) if_fn) {
+                push_frame(m, K_IF, c, env);
+                c = car(c);
+                goto eval;
+            }
+            if (FN_PTR(first) == (void*) with) {
+                // with x ->
+                if (!IS_PAIR(cdr(c))) {
+                    v = NIL;
+                    goto ret;
+                }
+                push_frame(m, K_WITH, c, env);
+                c = cdar(c);
+                goto eval;
+            }
+            if (FN_PTR(first) == (void*) apply_fn) {
+                push_frame(m, K_APPLY_FN, c, env);
+                c = car(c);
+                goto eval;
+            }
+        default:
+            break;
+    }
+    if (apply(first, &c, &env)) goto eval;
+    v = c;
+    goto ret;
+
+    next_value:
+    // Evaluate the next element of the top frame's code, or finish the frame
+    f = &m->frames[m->depth - 1];
+    if (IS_PAIR(f->code)) {
+        c = car(f->code);
+        env = f->env;
+        f->code = cdr(f->code);
+        goto eval;
+    }
+    if (f->code) {
+        // The terminal element of an improper list
+        c = f->code;
+        env = f->env;
+        f->code = NIL;
+        f->improper = true;
+        goto eval;
+    }
+    m->depth--;
+    if (f->kind == K_LIST) {
+        v = cons(f->data, pop_values(m, f));
+        goto ret;
+    }
+    cell fn = f->data;
+    env = f->env;
+    // A green thread must use up steps as it goes
+    if (steps && TYPE(fn) == NATIVE_FN_V && current_vm->compiled) {
+        cell version = interpreted_version(fn);
+        if (version) fn = version;
+    }
+    if (TYPE(fn) == NATIVE_FN_V) {
+        int argc = (int) (m->num_values - f->base);
+        if (steps && green_blocks(fn, argc, m->values + f->base)) {
+            // Keep the frame and its values to apply fn again once resumed
+            m->depth++;
+            m->resume = R_APPLY;
+            return false;
+        }
+        v = FN_V_PTR(fn)(argc, m->values + f->base);
+        m->num_values = f->base;
+        goto ret;
+    }
+    if (TYPE(fn) == FN && !f->improper && !current_vm->jit_enabled) {
+        TRACE(TRACE_APPLY, fn);
+        env = bind_values(m, f, (fn_t*) PTR(fn));
+        c = ((fn_t*) PTR(fn))->body;
+        goto eval;
+    }
+    c = pop_values(m, f);
+    if (apply(fn, &c, &env)) goto eval;
+    v = c;
+    goto ret;
+}
+
+cell eval_heap(cell c, cell env) {
+    // Natives may still re-enter the evaluator, so keep the same guard as eval
+    uint64_t depth = current_vm->stack_base - (void*) &c;
+    if (depth > 0x200000) {
+        puts("Stack overflowed");
+        exit(-1);
+    }
+
+    machine m;
+    init_machine(&m, c, env);
+    cell v;
+    machine_run(&m, NULL, &v);
+    return v;
+}
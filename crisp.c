@@ -2,10 +2,13 @@
 
 // This file contains definitions for the core of crisp
 
-bool debug = false;
-cell global_env = NIL;
-void* stack_base = NULL;
-cell sym_list = NIL;
+__thread crisp_vm* current_vm = NULL;
+
+// Symbols are shared by every vm. Lookups walk the list without locking,
+// since it only grows at its head and a new head is fully built before
+// it's published
+static cell sym_list = NIL;
+static pthread_mutex_t sym_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void* malloc_or_die(size_t size) {
     void* rv = GC_MALLOC(size);
@@ -13,16 +16,19 @@ void* malloc_or_die(size_t size) {
         puts("malloc failed");
         exit(-1);
     }
+    current_vm->allocated += size;
     return rv;
 }
 
 cell typeof_fn(cell args, cell env) {
     if(!args) return NIL;
+    if (IS_FLOAT(car(args))) return make_int(F64 >> 48);
+    if (IS_COMPACT(car(args))) return make_int(PAIR >> 48);
     return make_int(TYPE(car(args)) >> 48);
 }
 
 cell make_int(int64_t x) {
-    if(x <= 0x7fffffff && x >= -0x80000000) {
+    if (x <= INT32_MAX && x >= INT32_MIN) {
         return CAST(x, S32);
     }
     cell rv = (cell) malloc_or_die(8);
@@ -30,6 +36,32 @@ cell make_int(int64_t x) {
     return CAST(rv, S64);
 }
 
+// Floats with exponents from -510 to 512 are stored in the cell. Their bits
+// are rotated left so the sign is lowest, then the exponent is rebased to
+// fit in the 10 bits below FLOAT_BIT. Zero is stored with an exponent of 0,
+// which no other float in a cell has. Any other float is boxed.
+cell make_float(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, 8);
+    uint64_t r = bits << 1 | bits >> 63;
+    uint64_t exponent = r >> 53;
+    if (exponent > 512 && exponent < 1536) return (r - (512ULL << 53)) | FLOAT_BIT;
+    if (!(r >> 1)) return r | FLOAT_BIT;
+    double* rv = malloc_or_die(8);
+    *rv = x;
+    return CAST(rv, F64);
+}
+
+double float_val(cell c) {
+    if (TYPE(c) == F64) return *(double*) PTR(c);
+    uint64_t r = c & ~FLOAT_BIT;
+    if (r >> 53) r += 512ULL << 53;
+    uint64_t bits = r >> 1 | r << 63;
+    double x;
+    memcpy(&x, &bits, 8);
+    return x;
+}
+
 cell cons(cell car, cell cdr) {
     cell c = (cell) malloc_or_die(16);
     ((pair*) c)->car = car;
@@ -37,6 +69,24 @@ cell cons(cell car, cell cdr) {
     return CAST(c, PAIR);
 }
 
+// Make a list of n nils ending in tail, for the caller to fill in with
+// SET_CAR. It's stored compactly, in runs of up to COMPACT_RUN elements
+// taking a cell each plus one for the cdr of the run, so it needs about
+// half the memory of pairs and its elements are adjacent when walked.
+// Only the cars may be changed: the cdrs of compact pairs aren't stored
+cell make_list(size_t n, cell tail) {
+    // Runs are built from the end of the list, so each ends in the next
+    while (n) {
+        size_t len = n % COMPACT_RUN ? n % COMPACT_RUN : COMPACT_RUN;
+        cell* cells = malloc_or_die((len + 1) * sizeof(cell));
+        memset(cells, 0, len * sizeof(cell));
+        cells[len] = tail;
+        tail = len > 1 ? CAST(cells, COMPACT + ((len - 1) << 48)) : CAST(cells, PAIR);
+        n -= len;
+    }
+    return tail;
+}
+
 cell make_fn(cell args, cell body, cell env) {
     DPRINTF("\x1b[33m" "Making lambda %s = %s in %s\n" "\x1b[0m",
             print_cell(args), print_cell(body), print_env(env));
@@ -44,11 +94,112 @@ cell make_fn(cell args, cell body, cell env) {
     ((fn_t*) c)->args = args;
     ((fn_t*) c)->body = body;
     ((fn_t*) c)->env = env;
+    ((fn_t*) c)->calls = 0;
+    ((fn_t*) c)->jit = NULL;
+    ((fn_t*) c)->sites = NULL;
     return CAST(c, FN);
 }
 
+// Is sym one of the formal parameters in params?
+static bool is_param(cell sym, cell params) {
+    for (; IS_PAIR(params); params = cdr(params))
+        if (car(params) == sym) return true;
+    return params == sym;
+}
+
+// Collect the symbols referenced anywhere in code which aren't formal
+// parameters. Quoted code is included since it may later be evaluated
+// in the closure's environment
+static cell free_symbols(cell code, cell params, cell syms) {
+    for (; IS_PAIR(code); code = cdr(code))
+        syms = free_symbols(car(code), params, syms);
+    if (TYPE(code) == SYMBOL && !is_param(code, params)) syms = cons(code, syms);
+    return syms;
+}
+
+// The free symbols of a lambda depend only on its code, so they are
+// cached by the cell holding the lambda's parameters and body, in an open
+// addressed table. Each slot also records the last capture which found
+// its symbol bound, so shadowed bindings are recognised without a search
+#define FREE_SYMBOL_CACHE_SIZE 1024
+
+typedef struct {
+    cell code;
+    uint64_t mask;
+    cell* syms;
+    uint64_t* captured;
+    uint64_t captures;
+} free_symbols_t;
+
+// The slot holding name, or the empty slot where it would go
+static uint64_t symbol_slot(free_symbols_t* e, cell name) {
+    uint64_t i = ((uint64_t) PTR(name) >> 4) * 0x9e3779b97f4a7c15ULL >> 32;
+    for (i &= e->mask; e->syms[i] && e->syms[i] != name; i = (i + 1) & e->mask);
+    return i;
+}
+
+// A symbol like lib.fn also references lib, which find_ffi_sym looks up in
+// the environment, so lib is added too
+static void add_free_symbol(free_symbols_t* e, cell name) {
+    e->syms[symbol_slot(e, name)] = name;
+    char* s = SYM_STR(name);
+    char* dot = strrchr(s, '.');
+    if (!dot) return;
+    char prefix[dot - s + 1];
+    memcpy(prefix, s, dot - s);
+    prefix[dot - s] = '\0';
+    cell lib = sym(prefix);
+    e->syms[symbol_slot(e, lib)] = lib;
+}
+
+static free_symbols_t* free_symbols_cached(cell code) {
+    free_symbols_t* free_symbol_cache = current_vm->free_symbol_cache;
+    if (!free_symbol_cache)
+        free_symbol_cache = current_vm->free_symbol_cache =
+            malloc_or_die(FREE_SYMBOL_CACHE_SIZE * sizeof(free_symbols_t));
+    free_symbols_t* e = &free_symbol_cache[((uint64_t) PTR(code) >> 4) % FREE_SYMBOL_CACHE_SIZE];
+    if (e->code == code) return e;
+    cell params = car(code);
+    cell syms = free_symbols(cdr(code), IS_PAIR(params) ? params : LIST1(params), NIL), l;
+    // Each symbol and its prefix take at most two slots, leaving at least
+    // half the table empty
+    uint64_t n = 0, size = 4;
+    for (l = syms; l; l = cdr(l)) n++;
+    while (size < 4 * n) size *= 2;
+    e->mask = size - 1;
+    e->syms = malloc_or_die(size * sizeof(cell));
+    e->captured = malloc_or_die(size * sizeof(uint64_t));
+    e->captures = 0;
+    for (l = syms; l; l = cdr(l)) add_free_symbol(e, car(l));
+    e->code = code;
+    return e;
+}
+
+// Build the environment a closure over code needs: only the local bindings
+// it can reference, followed by the globals. Shadowed bindings are dropped,
+// so a closure no longer keeps every enclosing binding alive
+static cell capture(cell code, cell env) {
+    free_symbols_t* e = free_symbols_cached(code);
+    uint64_t this_capture = ++e->captures;
+    cell captured = NIL;
+    cell* tail = &captured;
+    for (; IS_PAIR(env) && env != current_vm->global_env; env = cdr(env)) {
+        cell binding = car(env);
+        if (!IS_PAIR(binding) || TYPE(car(binding)) != SYMBOL) continue;
+        uint64_t i = symbol_slot(e, car(binding));
+        // Unreferenced, or shadowed by a binding already captured
+        if (!e->syms[i] || e->captured[i] == this_capture) continue;
+        e->captured[i] = this_capture;
+        *tail = LIST1(binding);
+        tail = &((pair*) PTR(*tail))->cdr;
+    }
+    *tail = env;
+    return captured;
+}
+
 cell lambda(cell args, cell env) {
     if (!args) return NIL;
+    env = capture(args, env);
     cell body = cdr(args);
     args = car(args);
     if (!IS_PAIR(args)) args = LIST1(args);
@@ -62,6 +213,14 @@ cell macro(cell args, cell env) {
     return CAST(lambda(args, env), MACRO);
 }
 
+// A pure macro's body computes an expansion rather than a value. The
+// expansion is computed in the environment where the macro was defined,
+// so it depends only on the unevaluated arguments, and is then evaluated
+// in place of the call. This lets each call site be expanded only once
+cell pure_macro(cell args, cell env) {
+    return CAST(lambda(args, env), PURE_MACRO);
+}
+
 // Look up symbol in list
 cell sym_dedupe(cell list, char* symbol) {
     if (!IS_PAIR(list)) return NIL;
@@ -72,21 +231,203 @@ cell sym_dedupe(cell list, char* symbol) {
 // Create a new symbol from the passed string
 // If the symbol already exists, return the already created one
 cell sym(char* symbol) {
-    cell interned = sym_dedupe(sym_list, symbol);
+    cell interned = sym_dedupe(__atomic_load_n(&sym_list, __ATOMIC_ACQUIRE), symbol);
     if (interned) return interned;
-    sym_list = cons(CAST(strdup(symbol), SYMBOL), sym_list);
-    return car(sym_list);
+    pthread_mutex_lock(&sym_lock);
+    // Another thread may have added it meanwhile
+    interned = sym_dedupe(sym_list, symbol);
+    if (!interned) {
+        interned = CAST(strdup(symbol), SYMBOL);
+        __atomic_store_n(&sym_list, cons(interned, sym_list), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sym_lock);
+    return interned;
+}
+
+// Create a symbol from n bytes at s without interning it. Data read from
+// files and sockets is returned as text, since interning walks every symbol
+// and keeps each one forever. Text is equal only to itself, and deep-equal
+// to symbols with the same name
+// The last two words of its allocation hold n and n ^ TEXT_CHECK, so text_len
+// can find the length of data holding NULs
+#define TEXT_CHECK 0x74657874ULL
+cell text(const char* s, size_t n) {
+    char* t = GC_MALLOC_ATOMIC(n + 1 + 2 * sizeof(size_t));
+    if (!t) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    memcpy(t, s, n);
+    t[n] = '\0';
+#ifndef FUZZ
+    size_t length[2] = {n, n ^ TEXT_CHECK};
+    memcpy(t + GC_size(t) - sizeof(length), length, sizeof(length));
+#endif
+    return CAST(t, SYMBOL);
+}
+
+// The length in bytes of a symbol, or of text, which may hold NULs
+size_t text_len(cell c) {
+    char* s = SYM_STR(c);
+#ifndef FUZZ
+    if (GC_base(s) == s) {
+        size_t length[2];
+        memcpy(length, s + GC_size(s) - sizeof(length), sizeof(length));
+        if (length[0] < GC_size(s) && length[1] == (length[0] ^ TEXT_CHECK) && !s[length[0]])
+            return length[0];
+    }
+#endif
+    return strlen(s);
+}
+
+// Whether a number has an integer value, which is stored in i. Floats with
+// integer values compare and hash like the integers, so 2 and 2.0 are equal
+static bool as_int(cell c, int64_t* i) {
+    if (IS_INT(c)) {
+        *i = INT_VAL(c);
+        return true;
+    }
+    double x = FLOAT_VAL(c);
+    if (!(x >= -0x1p63 && x < 0x1p63)) return false;
+    *i = (int64_t) x;
+    return *i == x;
+}
+
+// Order two numbers by value. NaN is after every other number, and equal
+// to itself, so that sorting and hashing by value works
+static int compare_numbers(cell a, cell b) {
+    int64_t i, j;
+    if (as_int(a, &i) && as_int(b, &j)) return i < j ? -1 : i > j;
+    double x = NUM_VAL(a), y = NUM_VAL(b);
+    if (x < y) return -1;
+    if (x > y) return 1;
+    return (x != x) - (y != y);
 }
 
 cell equal(cell left, cell right) {
     if (left == right) {
         return left;
     }
-    if (IS_INT(left) && IS_INT(right) && INT_VAL(left) == INT_VAL(right))
+    if (IS_NUMBER(left) && IS_NUMBER(right) && !compare_numbers(left, right))
         return left;
     return NIL;
 }
 
+// deep_equal, deep_hash and compare walk structures with an explicit stack
+// of cells rather than recursing, so deeply nested lists are fine. They
+// agree with each other: symbols are compared by name, numbers by value,
+// and other atoms by identity.
+
+typedef struct {
+    cell* items;
+    size_t len;
+    size_t size;
+    cell local[64];
+} walk_stack;
+
+static void walk_init(walk_stack* s) {
+    s->items = s->local;
+    s->len = 0;
+    s->size = sizeof(s->local) / sizeof(cell);
+}
+
+static void walk_push(walk_stack* s, cell c) {
+    if (s->len == s->size) {
+        cell* items = malloc_or_die(2 * s->size * sizeof(cell));
+        memcpy(items, s->items, s->len * sizeof(cell));
+        s->items = items;
+        s->size *= 2;
+    }
+    s->items[s->len++] = c;
+}
+
+// Rank atoms of different kinds: nil, numbers, symbols, pairs, then the rest
+static int kind(cell c) {
+    if (!c) return 0;
+    if (IS_NUMBER(c)) return 1;
+    if (TYPE(c) == SYMBOL) return 2;
+    if (IS_PAIR(c)) return 3;
+    return 4;
+}
+
+// Order two cells which aren't both pairs
+static int compare_atoms(cell a, cell b) {
+    int ka = kind(a), kb = kind(b);
+    if (ka != kb) return ka < kb ? -1 : 1;
+    if (ka == 1) return compare_numbers(a, b);
+    if (ka == 2) {
+        int c = strcmp(SYM_STR(a), SYM_STR(b));
+        return c < 0 ? -1 : c > 0;
+    }
+    return a < b ? -1 : a > b;
+}
+
+int compare(cell a, cell b) {
+    walk_stack s;
+    walk_init(&s);
+    int rv = 0;
+    while (1) {
+        // Compare the cars now and come back for the cdrs
+        while (a != b && IS_PAIR(a) && IS_PAIR(b)) {
+            walk_push(&s, cdr(a));
+            walk_push(&s, cdr(b));
+            a = car(a);
+            b = car(b);
+        }
+        if (a != b && (rv = compare_atoms(a, b))) break;
+        if (!s.len) break;
+        b = s.items[--s.len];
+        a = s.items[--s.len];
+    }
+    return rv;
+}
+
+bool deep_equal(cell a, cell b) {
+    return compare(a, b) == 0;
+}
+
+uint64_t deep_hash(cell c) {
+    walk_stack s;
+    walk_init(&s);
+    // FNV-1a over the cells in prefix order, which determines the structure
+    uint64_t h = 14695981039346656037ULL;
+    while (1) {
+        uint64_t x;
+        if (IS_PAIR(c)) {
+            walk_push(&s, cdr(c));
+            c = car(c);
+            x = 0x9e3779b97f4a7c15ULL;
+        } else {
+            int64_t i;
+            if (IS_NUMBER(c) && as_int(c, &i)) {
+                x = i;
+            } else if (IS_FLOAT(c)) {
+                double f = FLOAT_VAL(c);
+                // Every NaN is equal, whatever its bits
+                if (f != f) f = 0.0 / 0.0;
+                memcpy(&x, &f, 8);
+            } else if (TYPE(c) == SYMBOL) {
+                // djb2, like hash in std
+                char* str = SYM_STR(c);
+                x = 5381;
+                while (*str) x = ((x << 5) + x) + *(str++);
+            } else {
+                x = c;
+            }
+            if (!s.len) {
+                h = (h ^ x) * 1099511628211ULL;
+                break;
+            }
+            c = s.items[--s.len];
+        }
+        h = (h ^ x) * 1099511628211ULL;
+    }
+    // Mix the high bits down, since maps use the low bits
+    h ^= h >> 32;
+    h *= 0xd6e8feb86659fd93ULL;
+    return h ^ (h >> 32);
+}
+
 // Builtin functions
 
 // The contract for these functions is that the argument
@@ -97,18 +438,22 @@ cell equal(cell left, cell right) {
 // interpreter must create the wrapping cell for these
 // functions using hold_args = true.
 
-cell car_fn(cell args, cell env) {
+// Functions of type NATIVE_FN_V instead receive their evaluated
+// arguments as a vector. If the argument list was improper, its
+// terminal element is passed as the last argument.
+
+cell car_fn(int argc, cell* argv) {
     // car 4 ->
     // car (a b) -> a
-    if (!args || !IS_PAIR(car(args))) return NIL;
-    return caar(args);
+    if (!argc || !IS_PAIR(argv[0])) return NIL;
+    return car(argv[0]);
 }
 
-cell cdr_fn(cell args, cell env) {
+cell cdr_fn(int argc, cell* argv) {
     // cdr 4 ->
     // cdr (a b) -> b
-    if (!args || !IS_PAIR(car(args))) return NIL;
-    return cadr(args);
+    if (!argc || !IS_PAIR(argv[0])) return NIL;
+    return cdr(argv[0]);
 }
 
 cell cons_fn(cell args, cell env) {
@@ -124,7 +469,7 @@ cell cons_fn(cell args, cell env) {
 // Check for pointer equality among args
 // If one argument is not equal, returns NIL
 // Otherwise returns the first argument
-cell same(cell args, cell env) {
+cell same(int argc, cell* argv) {
     // same ->
     // same 2 -> 2
 
@@ -133,17 +478,17 @@ cell same(cell args, cell env) {
 
     // For any x:
     // (lambda y same y y) x -> x
-    if (!args) return NIL;
-    cell first = car(args);
-    cell rest = cdr(args);
-    if (!rest || (IS_PAIR(rest) && (first == same(rest, NIL)))) return first;
-    return NIL;
+    if (!argc) return NIL;
+    int i;
+    for (i = 1; i < argc; i++)
+        if (argv[i] != argv[0]) return NIL;
+    return argv[0];
 }
 
 // Check for value equality among args, or equality of symbols
 // If one argument is not equal, returns NIL
 // Otherwise returns the first argument
-cell equal_fn(cell args, cell env) {
+cell equal_fn(int argc, cell* argv) {
     // equal ->
     // equal 1 -> 1
     // equal 2 1 ->
@@ -153,22 +498,49 @@ cell equal_fn(cell args, cell env) {
 
     // For any x:
     // equal x -> x
-    if (!args) return NIL;
-    cell left = car(args);
-    if (!cdr(args)) return left;
-    if (!IS_PAIR(cdr(args))) return NIL;
-    cell right = equal_fn(cdr(args), NIL);
-    if (!right) return NIL;
-    if (equal(left, right)) return left;
-    return NIL;
+    if (!argc) return NIL;
+    int i;
+    for (i = 1; i < argc; i++)
+        if (!equal(argv[i - 1], argv[i])) return NIL;
+    return argv[0];
+}
+
+// Check for structural equality among args
+// Returns true, or NIL if one argument is not equal
+cell deep_equal_fn(int argc, cell* argv) {
+    // deep-equal (a (b c)) (a (b c)) -> true
+    // deep-equal () () -> true
+    // deep-equal (a b) (a c) ->
+    static cell true_sym;
+    if (!true_sym) true_sym = sym("true");
+    int i;
+    for (i = 1; i < argc; i++)
+        if (!deep_equal(argv[i - 1], argv[i])) return NIL;
+    return true_sym;
+}
+
+cell deep_hash_fn(int argc, cell* argv) {
+    // deep-hash (a (b c)) -> the same integer for any structure deep-equal to it
+    return make_int(argc ? deep_hash(argv[0]) : deep_hash(NIL));
+}
+
+cell compare_fn(int argc, cell* argv) {
+    // compare 1 2 -> -1
+    // compare (a 2) (a 1) -> 1
+    // compare b b -> 0
+    // nil < integers < symbols < pairs < anything else, and pairs are
+    // ordered by their cars, then by their cdrs
+    if (argc < 2) return NIL;
+    return make_int(compare(argv[0], argv[1]));
 }
 
 cell concat(cell first, cell rest) {
-    if (!first) return rest;
-    if (IS_PAIR(first))
-        return cons(car(first), concat(cdr(first), rest));
-    else
-        return cons(first, rest);
+    size_t n = 0;
+    cell c;
+    for (c = first; IS_PAIR(c); c = cdr(c)) n++;
+    cell rv = make_list(n, c ? cons(c, rest) : rest);
+    for (c = rv; IS_PAIR(first); first = cdr(first), c = cdr(c)) SET_CAR(c, car(first));
+    return rv;
 }
 
 // zip yields a list containing pairs of corresponding elements from
@@ -178,19 +550,88 @@ cell zip(cell a, cell b) {
     // zip (a b) (c d) -> (a . c) (b . d)
     // zip (a b) (c d e) -> (a . c) (b . d)
     // zip (a . b) (c d e) -> (a . c) (b . (d e))
-    if (!a) return NIL;
-    if (!IS_PAIR(a)) return LIST1(cons(a, b));
-    if (!IS_PAIR(b)) return NIL;
-    return cons(cons(car(a), car(b)), zip(cdr(a), cdr(b)));
+    size_t n = 0;
+    cell x, y;
+    for (x = a, y = b; IS_PAIR(x) && IS_PAIR(y); x = cdr(x), y = cdr(y)) n++;
+    cell rv = make_list(n, x && !IS_PAIR(x) ? LIST1(cons(x, y)) : NIL), c;
+    for (c = rv; n--; a = cdr(a), b = cdr(b), c = cdr(c)) SET_CAR(c, cons(car(a), car(b)));
+    return rv;
 }
 
 // assoc yields the pair in dict whose car is equal to key
 // We need to distinguish between the cases where dict[key]
 // is nil and when key is not in dict
 cell assoc(cell key, cell dict) {
-    if (!IS_PAIR(dict) || !IS_PAIR(car(dict))) return NIL;
-    if (equal(key, caar(dict))) return car(dict);
-    return assoc(key, cdr(dict));
+    for (; IS_PAIR(dict) && IS_PAIR(car(dict)); dict = cdr(dict))
+        if (equal(key, caar(dict))) return car(dict);
+    return NIL;
+}
+
+// The interpreted version of a function compiled by crispc, or nil if fn
+// wasn't compiled, or its module wasn't imported into this vm
+cell interpreted_version(cell fn) {
+    cell v;
+    for (v = current_vm->compiled; v; v = cdr(v))
+        if (caar(v) == fn) return cdr(car(v));
+    return NIL;
+}
+
+// Pair the formal parameters of a lambda or macro with its arguments
+cell bind_args(fn_t* l, cell args) {
+    // If our arguments of the form () . rest, we just
+    // set up the single argument
+    if (!car(l->args) && TYPE(cdr(l->args)) == SYMBOL)
+        return LIST1(cons(cdr(l->args), args));
+    return zip(l->args, args);
+}
+
+// Compute the expansion of a pure macro applied to unevaluated args
+static cell expand(cell fn, cell args) {
+    fn_t* l = (fn_t*) PTR(fn);
+    return eval(l->body, concat(bind_args(l, args), l->env));
+}
+
+// Expansions are cached by call site and macro. Code is never mutated, so
+// a call site cell always expands the same way. The cache holds references
+// to its keys, so a cached call site is never collected and reused
+#define EXPANSION_CACHE_SIZE 4096
+
+typedef struct {
+    cell site;
+    cell macro;
+    cell expansion;
+} expansion_t;
+
+static cell expand_cached(cell fn, cell args) {
+    expansion_t* expansion_cache = current_vm->expansion_cache;
+    if (!expansion_cache)
+        expansion_cache = current_vm->expansion_cache =
+            malloc_or_die(EXPANSION_CACHE_SIZE * sizeof(expansion_t));
+    uint64_t h = ((uint64_t) PTR(args) >> 4) ^ ((uint64_t) PTR(fn) >> 4) * 31;
+    expansion_t* e = &expansion_cache[h % EXPANSION_CACHE_SIZE];
+    if (e->site == args && e->macro == fn) return e->expansion;
+    cell expansion = expand(fn, args);
+    e->site = args;
+    e->macro = fn;
+    e->expansion = expansion;
+    return expansion;
+}
+
+// Repeatedly expand a form while its head is a pure macro, so do expands
+// to void and then to and
+cell macroexpand(cell args, cell env) {
+    // macroexpand '(do a b) -> and (a (b)) ()
+    // macroexpand '(sum 1 2) -> sum 1 2
+    if (!args) return NIL;
+    cell form = car(args);
+    while (IS_PAIR(form)) {
+        cell fn = eval(car(form), env);
+        if (TYPE(fn) != PURE_MACRO) break;
+        cell rest = cdr(form);
+        if (!IS_PAIR(rest)) rest = LIST1(rest);
+        form = expand(fn, rest);
+    }
+    return form;
 }
 
 // apply a callable to a list of args in a given environment
@@ -199,20 +640,18 @@ cell assoc(cell key, cell dict) {
 // to continue executing.
 bool apply(cell fn, cell* args, cell* env) {
     DPRINTF("\x1b[32m" "Applying %s\n      to %s\n" "\x1b[0m", print_cell(fn), print_cell(*args));
+    TRACE(TRACE_APPLY, fn);
     switch ((uint64_t) TYPE(fn)) {
         case FN:
         case MACRO: {
             // For lambdas and macros we simply "slide" the evaluation
             // sideways into the body of the lambda, adding some new
             // definitions to the environment
+            // Hot lambdas may run as native code instead
+            if (current_vm->jit_enabled && TYPE(fn) == FN && jit_ready(fn, *args))
+                return jit_apply(fn, args, env);
             fn_t* l = (fn_t*) PTR(fn);
-            cell new_env;
-            // If our arguments of the form () . rest, we just
-            // set up the single argument
-            if (!car(l->args) && TYPE(cdr(l->args)) == SYMBOL)
-                new_env = LIST1(cons(cdr(l->args), *args));
-            else
-                new_env = zip(l->args, *args);
+            cell new_env = bind_args(l, *args);
             *env = concat(new_env, TYPE(fn) == MACRO ? *env : l->env);
             // we haven't finished evaluating, so signal that we should continue
             // in the loop
@@ -220,6 +659,9 @@ bool apply(cell fn, cell* args, cell* env) {
             // Update the evaluation context and environment
             TC_SLIDE(l->body);
         }
+        case PURE_MACRO:
+            // Slide into the expansion, leaving the caller's environment as is
+            TC_SLIDE(expand_cached(fn, *args));
         case NATIVE_FN_TCO:
             // The function we are calling can itself potentially invoke a
             // tail call, so just passb in a pointer to the evaluation context
@@ -229,6 +671,8 @@ bool apply(cell fn, cell* args, cell* env) {
             // We can't make any assumptions about the native function, so
             // evaluate it normally in a new stack frame
             TC_RETURN(FN_PTR(fn)(*args, *env));
+        case NATIVE_FN_V:
+            TC_RETURN(apply_native_v(fn, *args));
         case CONS:
             // TODO: TCO modulo cons does not work when (apply cons (a b))
             // is evaluated. Fixing this would muddy the already confusing
@@ -293,18 +737,61 @@ cell evalmap(cell args, cell env) {
 
     // explicitly evaluate in argument order
     // .. important for FFI functions
-    cell first = eval(car(args), env);
+    // The results are filled into a compact list of the right length
+    size_t n = 0;
+    cell c;
+    for (c = args; IS_PAIR(c); c = cdr(c)) n++;
+    cell rv = make_list(n, NIL), last = rv;
+    for (c = rv; IS_PAIR(args); args = cdr(args), c = cdr(c)) {
+        SET_CAR(c, eval(car(args), env));
+        last = c;
+    }
+    // The last element is an ordinary pair, so its cdr can be filled in
+    if (args) ((pair*) PTR(last))->cdr = eval(args, env);
+    return rv;
+}
 
-    if (IS_PAIR(cdr(args)))
-        return cons(first, evalmap(cdr(args), env));
-    else
-        return cons(first, eval(cdr(args), env));
+// Count the arguments a NATIVE_FN_V would receive from an argument list
+static int count_args(cell args) {
+    int argc = 0;
+    for (; IS_PAIR(args); args = cdr(args)) argc++;
+    return args ? argc + 1 : argc;
+}
+
+// Up to this many arguments are passed to a NATIVE_FN_V in a vector on the
+// stack, and longer argument lists, as from apply, in one on the heap
+#define MAX_STACK_ARGS 64
+
+// Apply a NATIVE_FN_V to an already evaluated argument list
+cell apply_native_v(cell fn, cell args) {
+    int argc = count_args(args);
+    cell stack_argv[MAX_STACK_ARGS];
+    cell* argv = argc <= MAX_STACK_ARGS ? stack_argv : malloc_or_die(argc * sizeof(cell));
+    int i;
+    for (i = 0; IS_PAIR(args); args = cdr(args)) argv[i++] = car(args);
+    if (args) argv[i] = args;
+    return FN_V_PTR(fn)(argc, argv);
+}
+
+// Evaluate an argument list directly into a vector on the stack and apply
+// a NATIVE_FN_V to it, so no intermediate argument list is allocated
+static cell eval_native_v(cell fn, cell args, cell env) {
+    int argc = count_args(args);
+    cell stack_argv[MAX_STACK_ARGS];
+    cell* argv = argc <= MAX_STACK_ARGS ? stack_argv : malloc_or_die(argc * sizeof(cell));
+    int i;
+    for (i = 0; IS_PAIR(args); args = cdr(args)) argv[i++] = eval(car(args), env);
+    if (args) argv[i] = eval(args, env);
+    return FN_V_PTR(fn)(argc, argv);
 }
 
 cell eval(cell c, cell env) {
+    // Optionally keep pending work on the heap rather than the C stack
+    if (current_vm->heap_stack) return eval_heap(c, env);
+
     // Hack to limit recursion depth
     // It is otherwise trivial to crash the interpeter with infinite recursion
-    uint64_t depth = stack_base - (void*) &c;
+    uint64_t depth = current_vm->stack_base - (void*) &c;
 //    printf("Depth %d\n", depth);
     if (depth > 0x200000) {
         puts("Stack overflowed");
@@ -354,6 +841,7 @@ cell eval(cell c, cell env) {
     while (1) {
         if IS_PAIR(c) {
             DPRINTF("\x1b[0m" "Evalling %s in %s\n" "\x1b[0m", print_cell(c), print_env(env));
+            TRACE(TRACE_EVAL, c);
             // () x y -> () 1 2
             if (!car(c)) {
                 // evalmap rather than slide because we don't want to apply
@@ -392,6 +880,10 @@ cell eval(cell c, cell env) {
             // sum x y -> sum (eval x) (eval y) -> apply sum (1 2) -> 3
             if (IS_CALLABLE(first)) {
                 cell fn = first;
+                if (TYPE(fn) == NATIVE_FN_V) {
+                    new_cons = eval_native_v(fn, c, env);
+                    goto eval_return;
+                }
                 switch (TYPE(fn)) {
                     // These types expect their arguments to be evaluated first
                     case NATIVE_FN:
@@ -453,6 +945,7 @@ cell eval(cell c, cell env) {
         else {
             // Slide sideways into a new execution context
             DPRINTF("\x1b[34m" "TC slide\n" "\x1b[0m", NULL);
+            TRACE(TRACE_SLIDE, c);
         }
 
         continue;
@@ -472,8 +965,10 @@ cell def(cell args, cell env) {
     cell var_name = eval(car(args), env);
     if (TYPE(var_name) != SYMBOL) var_name = car(args);
     DPRINTF("\x1b[31m" "Defining %s -> %s\n" "\x1b[0m", print_cell(var_name), print_cell(referent));
-    cell old_defs = ((pair*) PTR(global_env))->cdr;
-    ((pair*) PTR(global_env))->cdr = cons(cons(var_name, referent), old_defs);
+    TRACE(TRACE_DEF, var_name);
+    cell old_defs = ((pair*) PTR(current_vm->global_env))->cdr;
+    ((pair*) PTR(current_vm->global_env))->cdr = cons(cons(var_name, referent), old_defs);
+    current_vm->def_epoch++;
     return NIL;
 }
 
@@ -1,5 +1,7 @@
 #define _GNU_SOURCE
 
+// Threads which evaluate crisp must be known to the collector
+#define GC_THREADS
 #include <gc.h>
 #include <dlfcn.h>
 #include <stdio.h>
@@ -7,9 +9,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <pthread.h>
 
-typedef unsigned long long int uintptr_t;
-typedef unsigned long long int uint64_t;
 typedef uintptr_t cell;
 
 // The top 16 bits of the 64 bit address space are unused
@@ -21,8 +23,9 @@ typedef uintptr_t cell;
 #define INT_VAL(c) (TYPE(c) == S64 ? (*((int64_t*)PTR(c))) : (int64_t)(int32_t)PTR(c))
 #define FFI_FN_PTR(c) ((int64_t(*)())PTR(c))
 #define FN_PTR(c) ((cell(*)())PTR(c))
+#define FN_V_PTR(c) ((cell(*)(int, cell*))PTR(c))
 #define car(c) ((cell)(((pair* )(PTR(c)))->car))
-#define cdr(c) ((cell)(((pair* )(PTR(c)))->cdr))
+#define SET_CAR(c, x) (((pair*) PTR(c))->car = (x))
 #define caar(c) car(car(c))
 #define cadr(c) cdr(car(c))
 #define cdar(c) car(cdr(c))
@@ -33,16 +36,29 @@ typedef uintptr_t cell;
 #define LIST2(a, b) cons((a), cons((b), NIL))
 #define IS_CALLABLE(c) (TYPE(c) == FN || \
                         TYPE(c) == MACRO || \
+                        TYPE(c) == PURE_MACRO || \
                         TYPE(c) == CONS || \
                         TYPE(c) == FFI_FN || \
                         TYPE(c) == NATIVE_FN || \
                         TYPE(c) == NATIVE_FN_TCO || \
+                        TYPE(c) == NATIVE_FN_V || \
                         TYPE(c) == NATIVE_MACRO)
 
 #define IS_INT(c) (TYPE(c) == S64 || TYPE(c) == S32)
-#define IS_PAIR(c) (TYPE(c) == PAIR)
+#define IS_PAIR(c) (TYPE(c) == PAIR || IS_COMPACT(c))
 
-#define DPRINTF(fmt, ...) do { if (debug) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+// Most floats are stored in the cell itself, marked by its top bit, which
+// is never set in the type code of a pointer. Their TYPE varies with their
+// value, so use IS_FLOAT rather than comparing types. See make_float
+#define FLOAT_BIT (1ULL << 63)
+#define IS_FLOAT(c) (((c) & FLOAT_BIT) || TYPE(c) == F64)
+#define FLOAT_VAL(c) float_val(c)
+#define IS_NUMBER(c) (IS_INT(c) || IS_FLOAT(c))
+#define NUM_VAL(c) (IS_INT(c) ? (double) INT_VAL(c) : FLOAT_VAL(c))
+
+#define DPRINTF(fmt, ...) do { if (current_vm->debug) fprintf(stderr, fmt, __VA_ARGS__); } while (0)
+
+#define TRACE(kind, c) do { if (__builtin_expect(tracing, 0)) trace_record((kind), (c)); } while (0)
 
 #define TC_RETURN(val) do {*args = val; return false;} while(0)
 #define TC_SLIDE(val) do {*args = val; return true;} while(0)
@@ -61,19 +77,81 @@ typedef uintptr_t cell;
 #define NATIVE_FN_TCO (11LL << 48)
 #define MACRO         (12LL << 48)
 #define CONS          (13LL << 48)
-#define BUILTIN_TYPE_COUNT ((CONS >> 48) + 1)
+#define NATIVE_FN_V   (14LL << 48)
+#define PURE_MACRO    (15LL << 48)
+#define CHANNEL       (16LL << 48)
+// A float too large, too small, infinite or NaN to be stored in a cell
+#define F64           (17LL << 48)
+#define BUILTIN_TYPE_COUNT ((F64 >> 48) + 1)
+// Lists may also be stored compactly, as the cars of a run of elements in
+// consecutive cells followed by the cdr of the run, which make_list builds.
+// An element before the last of its run has COMPACT in its type plus the
+// number of elements after it in the run, so its cdr is the next cell. The
+// last is an ordinary pair, since its cdr is the cell after its car. Type
+// codes from COMPACT up are all compact pairs, so modules get lower ones
+#define COMPACT (0x4000LL << 48)
+#define COMPACT_RUN 0x4000
+#define IS_COMPACT(c) (((cell) (c) >> 62) == 1)
 
 typedef struct {
     cell car;
     cell cdr;
 } pair;
 
+static inline cell cdr(cell c) {
+    if (IS_COMPACT(c)) {
+        // The next element is the next cell, and ends the run if it's last
+        if (TYPE(c) == COMPACT + (1LL << 48)) return CAST((cell) PTR(c) + 8, PAIR);
+        return c + 8 - (1LL << 48);
+    }
+    return ((pair*) PTR(c))->cdr;
+}
+
 typedef struct {
     cell args;
     cell body;
     cell env;
+    // Used by the JIT: how many times this function has been applied,
+    // its compiled code, and its inline caches for symbol lookups
+    uint64_t calls;
+    void* jit;
+    cell* sites;
 } fn_t;
 
+// Trace events, as recorded in memory and written by trace-dump
+typedef enum {
+    TRACE_EVAL,
+    TRACE_APPLY,
+    TRACE_SLIDE,
+    TRACE_DEF,
+    TRACE_GC,
+    TRACE_FFI,
+} trace_kind;
+
+typedef struct {
+    // Nanoseconds since tracing first started
+    uint64_t time;
+    cell c;
+    uint32_t kind;
+    uint32_t thread;
+} trace_event;
+
+// "CRISPTRC" read as a little endian integer
+#define TRACE_MAGIC 0x4352545053495243ULL
+#define TRACE_VERSION 1
+
+typedef struct {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t count;
+    uint64_t symbols;
+} trace_header;
+
+typedef struct {
+    cell c;
+    uint64_t len;
+} trace_symbol;
+
 typedef struct {
     size_t len;
     size_t max_len;
@@ -82,9 +160,76 @@ typedef struct {
     int parens;
 } logical_line;
 
-extern bool debug;
-extern cell global_env;
-extern void* stack_base;
+// The state of one interpreter. Each thread evaluates in its current_vm,
+// so a process can host many isolated interpreters on many threads.
+// Symbols and the type codes of modules are shared by every vm, since
+// modules keep them in static variables
+typedef struct {
+    cell global_env;
+    // The top of the C stack when evaluation began, to limit recursion
+    void* stack_base;
+    // Incremented by every def, so cached lookups of globals can be invalidated
+    uint64_t def_epoch;
+    bool debug;
+    // Evaluate with pending work on the heap, see cek.c
+    bool heap_stack;
+    bool jit_enabled;
+    // Names of the modules imported so far
+    cell imported;
+    // Caches of lambdas' free symbols and of macro expansions, see crisp.c
+    void* free_symbol_cache;
+    void* expansion_cache;
+    // Lookups of globals by the heap evaluator, see cek.c
+    void* global_cache;
+    // Compiled code, intrinsics, and the applications of intrinsics which
+    // missed their fast paths, see jit.c
+    cell jit_compiled;
+    cell jit_intrinsics;
+    uint64_t jit_slow_paths;
+    // Bytes allocated by malloc_or_die, to account for green threads
+    uint64_t allocated;
+    // Green threads and their scheduler, see green.c
+    struct scheduler* green;
+    // Functions compiled by crispc paired with their interpreted versions,
+    // which green threads and fallbacks apply instead, see crispc.h
+    cell compiled;
+} crisp_vm;
+
+// An evaluation on the heap which can be stopped and resumed, see cek.c
+typedef struct machine machine;
+
+// A crisp callable looked up once, to be called many times from C. The
+// collector keeps handles and their callables alive until crisp_release
+typedef struct {
+    crisp_vm* vm;
+    cell name;
+    cell fn;
+    // The vm's def_epoch when fn was looked up, so redefinitions are seen
+    uint64_t epoch;
+} crisp_handle;
+
+// Arguments to crisp_call. Strings become text, which isn't interned
+typedef enum {
+    CRISP_INT,
+    CRISP_STR,
+    CRISP_CELL,
+} crisp_arg_type;
+
+typedef struct {
+    crisp_arg_type type;
+    union {
+        int64_t i;
+        const char* s;
+        cell c;
+    };
+} crisp_arg;
+
+#define CRISP_ARG_INT(x) ((crisp_arg) {CRISP_INT, {.i = (x)}})
+#define CRISP_ARG_STR(x) ((crisp_arg) {CRISP_STR, {.s = (x)}})
+#define CRISP_ARG_CELL(x) ((crisp_arg) {CRISP_CELL, {.c = (x)}})
+
+extern __thread crisp_vm* current_vm;
+extern bool tracing;
 void* malloc_or_die(size_t size);
 
 void reset_logical_line(logical_line* line);
@@ -93,31 +238,84 @@ bool logical_line_ingest(logical_line* line, char c);
 bool apply_fn(cell* args, cell* env);
 bool apply(cell fn, cell* args, cell* env);
 cell apply_ffi_function(int64_t (* fn)(), cell args);
+cell apply_native_v(cell fn, cell args);
 cell assoc(cell key, cell dict);
-cell car_fn(cell args, cell env);
-cell cdr_fn(cell args, cell env);
+cell bind_args(fn_t* l, cell args);
+cell car_fn(int argc, cell* argv);
+cell cdr_fn(int argc, cell* argv);
+cell chan_fn(int argc, cell* argv);
+int compare(cell a, cell b);
+cell compare_fn(int argc, cell* argv);
 cell concat(cell first, cell rest);
 cell cons(cell car, cell cdr);
+cell crisp_call(crisp_handle* h, int argc, crisp_arg* argv);
+crisp_handle* crisp_prepare(crisp_vm* vm, const char* name);
+void crisp_release(crisp_handle* h);
+cell crisp_vm_eval(crisp_vm* vm, const char* src);
+void crisp_vm_free(crisp_vm* vm);
+crisp_vm* crisp_vm_new(void);
 cell cons_fn(cell args, cell env);
+bool deep_equal(cell a, cell b);
+cell deep_equal_fn(int argc, cell* argv);
+uint64_t deep_hash(cell c);
+cell deep_hash_fn(int argc, cell* argv);
 cell def(cell args, cell env);
 cell dlopen_fn(cell args, cell env);
 cell dlsym_fn(cell args, cell env);
-cell equal_fn(cell args, cell env);
+cell equal_fn(int argc, cell* argv);
 cell eval(cell c, cell env);
+cell eval_heap(cell c, cell env);
 cell evalmap(cell args, cell env);
 cell find_ffi_sym(char* sym_name, cell env);
+double float_val(cell c);
+cell go_fn(int argc, cell* argv);
+bool green_blocks(cell fn, int argc, cell* argv);
+bool green_running(void);
+cell hashcons(cell c);
+cell hashcons_count(int argc, cell* argv);
+cell hashcons_fn(int argc, cell* argv);
 bool if_fn(cell* args, cell* env);
 cell import(cell args, cell env);
+cell interpreted_version(cell fn);
+bool jit_apply(cell fn, cell* args, cell* env);
+bool jit_apply_v(cell fn, cell* argv, cell* args, cell* env);
+void jit_free(crisp_vm* vm);
+cell jit_intrinsic(cell args, cell env);
+cell jit_stats(int argc, cell* argv);
+bool jit_ready(cell fn, cell args);
+bool jit_ready_v(cell fn, int argc);
+cell join_fn(int argc, cell* argv);
+cell make_fn(cell args, cell body, cell env);
+cell make_list(size_t n, cell tail);
 cell lambda(cell args, cell env);
 cell macro(cell args, cell env);
+cell macroexpand(cell args, cell env);
+machine* machine_new(cell c, cell env);
+bool machine_run(machine* m, int64_t* steps, cell* result);
+cell make_float(double x);
 cell make_int(int64_t x);
 cell typeof_fn(cell args, cell env);
 cell parse(char** s);
+cell pure_macro(cell args, cell env);
 cell quote(cell args, cell env);
-cell same(cell args, cell env);
+cell recv_fn(int argc, cell* argv);
+cell run_threads_fn(int argc, cell* argv);
+cell same(int argc, cell* argv);
+cell send_fn(int argc, cell* argv);
 cell str(cell args, cell env);
 cell sym(char* symbol);
+cell text(const char* s, size_t n);
+size_t text_len(cell c);
+cell thread_priority_fn(int argc, cell* argv);
+cell thread_stats_fn(int argc, cell* argv);
+bool trace_dump(const char* path);
+cell trace_dump_fn(int argc, cell* argv);
+void trace_record(trace_kind kind, cell c);
+void trace_start(void);
+cell trace_start_fn(int argc, cell* argv);
+cell trace_stop_fn(int argc, cell* argv);
 bool with(cell* args, cell* env);
+cell yield_fn(int argc, cell* argv);
 cell zip(cell args, cell env);
 char* print_cell(cell c);
 char* print_env(cell c);
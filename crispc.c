@@ -0,0 +1,461 @@
+#include "crisp.h"
+#include <math.h>
+#include <stdarg.h>
+
+// crispc compiles the definitions in a module's script to C, so they run
+// as native functions rather than being interpreted:
+//     crispc std.crisp out/std.crisp out/std.crispc.c
+//
+// Definitions of the forms
+//     def name lambda params body
+//     defrec1 name param body
+//     defrec2 name (a b) body
+//     defrec name params body
+// with symbols for parameters become NATIVE_FN_V functions in the C file,
+// and are replaced in the output script by
+//     def name (native-fn-v this.crispc_name_define) (lambda params body)
+// which still makes the interpreted function where it was defined, with
+// rec, rec1 or rec2 for a defrec, but defines name as the compiled one.
+// Every other line is copied through, so the module is built from the two
+// outputs exactly as it would have been from the original script.
+//
+// Within a body, symbols, quote, if, with and cons are compiled directly,
+// and self calls in tail position of a defrec become jumps, including
+// those under cons, as eval's TCO modulo cons does. Other applications
+// call natives and lambdas directly when their arguments would have been
+// evaluated. Anything else, such as macros, lambda and the TCO natives, is
+// evaluated by eval in an environment built from the locals, so compiled
+// code behaves as the interpreted code did. A call with a different number
+// of arguments, or on a vm evaluating on the heap, applies the interpreted
+// definition instead. See crispc.h for the support the C code uses.
+
+// Generated code is built up in strings, which are never freed since
+// crispc runs only briefly
+static char* format(const char* fmt, ...) {
+    va_list ap;
+    char* s;
+    va_start(ap, fmt);
+    if (vasprintf(&s, fmt, ap) < 0) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    va_end(ap);
+    return s;
+}
+
+// The cells the generated code needs are built once, into k
+static cell* constants;
+static int num_constants;
+
+// Global symbols are looked up through caches in g
+static cell* globals;
+static int num_globals;
+
+static int add_cell(cell** cells, int* n, cell c) {
+    int i;
+    for (i = 0; i < *n; i++)
+        if ((*cells)[i] == c) return i;
+    if (!(*n & (*n - 1))) *cells = GC_REALLOC(*cells, (*n ? 2 * *n : 1) * sizeof(cell));
+    (*cells)[*n] = c;
+    return (*n)++;
+}
+
+static char* constant(cell c) {
+    if (!c) return "NIL";
+    return format("k[%d]", add_cell(&constants, &num_constants, c));
+}
+
+static char* global(cell name) {
+    int site = add_cell(&globals, &num_globals, name);
+    return format("crispc_global(&g[%d], %s)", site, constant(name));
+}
+
+// Escape a symbol's name for a C string literal
+static char* escape(char* s) {
+    char* rv = malloc(4 * strlen(s) + 1);
+    char* out = rv;
+    for (; *s; s++) {
+        if (isalnum(*s) || (ispunct(*s) && *s != '"' && *s != '\\' && *s != '?'))
+            *out++ = *s;
+        else
+            out += sprintf(out, "\\%03o", (unsigned char) *s);
+    }
+    *out = '\0';
+    return rv;
+}
+
+// A C expression building a copy of c
+static char* datum(cell c) {
+    if (!c) return "NIL";
+    if (IS_FLOAT(c)) {
+        double x = FLOAT_VAL(c);
+        if (isnan(x)) return "make_float(NAN)";
+        if (isinf(x)) return x > 0 ? "make_float(INFINITY)" : "make_float(-INFINITY)";
+        return format("make_float(%a)", x);
+    }
+    if (IS_INT(c)) {
+        if (INT_VAL(c) == INT64_MIN) return "make_int(INT64_MIN)";
+        return format("make_int(%lldLL)", (long long) INT_VAL(c));
+    }
+    if (TYPE(c) == SYMBOL) return format("sym(\"%s\")", escape(SYM_STR(c)));
+    if (IS_PAIR(c)) {
+        int n = 0;
+        cell l;
+        char* elements = "";
+        for (l = c; IS_PAIR(l); l = cdr(l), n++)
+            elements = format("%s, %s", elements, datum(car(l)));
+        return format("crispc_list(%d, %s%s)", n, datum(l), elements);
+    }
+    fprintf(stderr, "crispc: can't compile %s\n", print_cell(c));
+    exit(-1);
+}
+
+// A local variable: a parameter, a with binding, or the function itself
+// within a defrec
+typedef struct local {
+    cell name;
+    // A C expression for its value
+    char* value;
+    bool self;
+    struct local* next;
+} local;
+
+// The function being compiled
+typedef struct {
+    char* name;
+    int params;
+    // Fresh C variables are numbered
+    int temps;
+    // Whether a self call jumps back to the start of the body
+    bool loops;
+} function;
+
+static function* fn;
+
+static local* find(local* l, cell name) {
+    for (; l; l = l->next)
+        if (l->name == name) return l;
+    return NULL;
+}
+
+static char* temp(char* prefix) {
+    return format("%s%d", prefix, fn->temps++);
+}
+
+static int list_length(cell l) {
+    int n = 0;
+    for (; IS_PAIR(l); l = cdr(l)) n++;
+    return l ? -1 : n;
+}
+
+// Is head a symbol naming the builtin name, rather than a local?
+static bool builtin(cell head, local* l, char* name) {
+    return TYPE(head) == SYMBOL && head == sym(name) && !find(l, head);
+}
+
+// The environment eval would see: the locals, innermost first, in front of
+// the globals
+static char* environment(local* l) {
+    if (!l) return "current_vm->global_env";
+    return format("cons(cons(%s, %s), %s)", constant(l->name), l->value, environment(l->next));
+}
+
+// Evaluate code with eval instead
+static char* interpreted(cell code, local* l) {
+    return format("eval(%s, %s)", constant(code), environment(l));
+}
+
+// Statements evaluating each element of args into the array argv
+static char* arguments(cell args, char* argv, local* l);
+
+static char* expr(cell c, local* l) {
+    if (!IS_PAIR(c)) {
+        if (TYPE(c) != SYMBOL) return constant(c);
+        local* v = find(l, c);
+        return v ? v->value : global(c);
+    }
+    // () x y -> () 1 2
+    if (!car(c)) return interpreted(c, l);
+    // (x) -> x
+    if (!cdr(c)) return expr(car(c), l);
+    cell head = car(c), args = cdr(c);
+    // x . y -> 1 . 2
+    if (!IS_PAIR(args)) return interpreted(c, l);
+
+    if (builtin(head, l, "quote")) return constant(car(args));
+
+    if (builtin(head, l, "if")) {
+        char* predicate = expr(car(args), l);
+        if (!IS_PAIR(cdr(args))) return format("((void) %s, NIL)", predicate);
+        return format("(%s ? %s : %s)", predicate, expr(cdar(args), l),
+                      IS_PAIR(cddr(args)) ? expr(cddr(args), l) : "NIL");
+    }
+
+    if (builtin(head, l, "with")) {
+        if (!IS_PAIR(cdr(args))) return "NIL";
+        char* referent = expr(cdar(args), l);
+        if (!IS_PAIR(cddr(args))) return format("((void) %s, NIL)", referent);
+        // with 4 x -> the name is evaluated too
+        if (TYPE(car(args)) != SYMBOL) return interpreted(c, l);
+        local bound = {car(args), temp("w"), false, l};
+        return format("({ cell %s = %s; %s; })", bound.value, referent, expr(cddr(args), &bound));
+    }
+
+    if (builtin(head, l, "cons")) {
+        if (!cdr(args)) return format("cons(%s, NIL)", expr(car(args), l));
+        if (!IS_PAIR(cdr(args))) return interpreted(c, l);
+        char* first = temp("t");
+        return format("({ cell %s = %s; cons(%s, %s); })", first, expr(car(args), l),
+                      first, expr(cdr(args), l));
+    }
+
+    int argc = list_length(args);
+    if (argc < 0) return interpreted(c, l);
+    char* argv = temp("v");
+    local* v = TYPE(head) == SYMBOL ? find(l, head) : NULL;
+    if (v && v->self)
+        return format("({ cell %s[%d]; %s%s(%d, %s); })", argv, argc,
+                      arguments(args, argv, l), fn->name, argc, argv);
+
+    // Natives and lambdas which take evaluated arguments are applied to
+    // them here, and anything else is left to eval
+    char* f = temp("f");
+    char* r = temp("r");
+    return format("({ cell %s = %s, %s; "
+                  "if (crispc_strict(%s)) { cell %s[%d]; %s%s = crispc_apply_v(%s, %d, %s); } "
+                  "else %s = crispc_apply_code(%s, %s, %s); %s; })",
+                  f, expr(head, l), r,
+                  f, argv, argc, arguments(args, argv, l), r, f, argc, argv,
+                  r, f, constant(args), environment(l), r);
+}
+
+static char* arguments(cell args, char* argv, local* l) {
+    char* s = "";
+    int i;
+    // Assigned in turn, since the order of an initializer's evaluation
+    // is unspecified
+    for (i = 0; IS_PAIR(args); args = cdr(args), i++)
+        s = format("%s%s[%d] = %s; ", s, argv, i, expr(car(args), l));
+    return s;
+}
+
+static char* indent(int depth) {
+    return format("%*s", 4 * depth, "");
+}
+
+static char* result(char* value, int depth) {
+    return format("%s*hole = %s;\n%sreturn rv;\n", indent(depth), value, indent(depth));
+}
+
+// Statements evaluating c in tail position and returning its value. The
+// value is stored through hole, which follows the pairs made by cons in
+// tail position, so the pair at the head of the result is returned
+static char* tail(cell c, local* l, int depth) {
+    if (!IS_PAIR(c) || !car(c) || !IS_PAIR(cdr(c))) {
+        if (IS_PAIR(c) && car(c) && !cdr(c)) return tail(car(c), l, depth);
+        return result(expr(c, l), depth);
+    }
+    cell head = car(c), args = cdr(c);
+    char* in = indent(depth);
+
+    if (builtin(head, l, "if") && IS_PAIR(cdr(args))) {
+        return format("%sif (%s) {\n%s%s} else {\n%s%s}\n", in,
+                      expr(car(args), l), tail(cdar(args), l, depth + 1), in,
+                      IS_PAIR(cddr(args)) ? tail(cddr(args), l, depth + 1) : result("NIL", depth + 1), in);
+    }
+
+    if (builtin(head, l, "with") && IS_PAIR(cdr(args)) && IS_PAIR(cddr(args)) &&
+            TYPE(car(args)) == SYMBOL) {
+        local bound = {car(args), temp("w"), false, l};
+        char* referent = expr(cdar(args), l);
+        return format("%scell %s = %s;\n%s", in, bound.value, referent, tail(cddr(args), &bound, depth));
+    }
+
+    if (builtin(head, l, "cons") && IS_PAIR(cdr(args))) {
+        return format("%s*hole = cons(%s, NIL);\n%shole = &((pair*) PTR(*hole))->cdr;\n%s",
+                      in, expr(car(args), l), in, tail(cdr(args), l, depth));
+    }
+
+    local* v = TYPE(head) == SYMBOL ? find(l, head) : NULL;
+    if (v && v->self && list_length(args) == fn->params) {
+        // The arguments are all evaluated before any parameter changes
+        char* s = "";
+        char* assign = "";
+        int i;
+        for (i = 0; IS_PAIR(args); args = cdr(args), i++) {
+            char* t = temp("t");
+            s = format("%s%scell %s = %s;\n", s, in, t, expr(car(args), l));
+            assign = format("%s%sa%d = %s;\n", assign, in, i, t);
+        }
+        fn->loops = true;
+        return format("%s%s%sgoto start;\n", s, assign, in);
+    }
+
+    return result(expr(c, l), depth);
+}
+
+// The compiled functions, in order
+static FILE* code;
+static int num_functions;
+static char** names;
+
+// A C identifier for the function defined as name
+static char* c_name(cell name) {
+    char* s = format("crispc_");
+    char* i;
+    for (i = SYM_STR(name); *i; i++) {
+        if (isalnum(*i)) s = format("%s%c", s, *i);
+        else if (*i == '-') s = format("%s_", s);
+        else s = format("%s_%02x", s, (unsigned char) *i);
+    }
+    // Redefinitions get a number
+    char* unique = s;
+    int n, version = 1;
+    for (n = 0; n < num_functions; n++) {
+        if (strcmp(names[n], unique) && strcmp(format("%s_define", names[n]), unique)) continue;
+        unique = format("%s_%d", s, ++version);
+        n = -1;
+    }
+    return unique;
+}
+
+static char* skip_token(char* s) {
+    while (isspace(*s)) s++;
+    while (*s && !isspace(*s) && *s != '(' && *s != ')') s++;
+    return s;
+}
+
+// Compile expr if it's a definition crispc handles, returning the line
+// which replaces it in the script, or NULL to leave it as it is
+static char* compile(cell expr, char* line) {
+    cell form = car(expr);
+    if (TYPE(form) != SYMBOL || !IS_PAIR(cdr(expr)) || TYPE(cdar(expr)) != SYMBOL) return NULL;
+    cell name = cdar(expr);
+    cell params, body;
+    char* macro = NULL;
+    if (form == sym("def")) {
+        cell value = cddr(expr);
+        if (!IS_PAIR(value) || car(value) != sym("lambda") || !IS_PAIR(cdr(value))) return NULL;
+        params = cdar(value);
+        body = cddr(value);
+    } else if (form == sym("defrec1") || form == sym("defrec2") || form == sym("defrec")) {
+        if (!IS_PAIR(cddr(expr))) return NULL;
+        params = cddar(expr);
+        body = cdddr(expr);
+        macro = form == sym("defrec") ? "rec" : form == sym("defrec1") ? "rec1" : "rec2";
+        if (form == sym("defrec1") && TYPE(params) != SYMBOL) return NULL;
+        if (form == sym("defrec2") && list_length(params) != 2) return NULL;
+    } else {
+        return NULL;
+    }
+    if (TYPE(params) == SYMBOL) params = LIST1(params);
+    int n = list_length(params);
+    if (n < 1) return NULL;
+    cell p;
+    for (p = params; p; p = cdr(p))
+        if (TYPE(car(p)) != SYMBOL) return NULL;
+
+    function f = {c_name(name), n, 0, false};
+    fn = &f;
+
+    // Within a defrec the function refers to itself, behind its parameters
+    local* locals = NULL;
+    if (macro) {
+        locals = malloc(sizeof(local));
+        *locals = (local) {name, format("CAST(%s, NATIVE_FN_V)", f.name), true, NULL};
+    }
+    // The first parameter is innermost, as bind_args would leave it
+    char* bind = "";
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        int j;
+        for (j = 0, p = params; j < i; j++) p = cdr(p);
+        local* l = malloc(sizeof(local));
+        *l = (local) {car(p), format("a%d", i), false, locals};
+        locals = l;
+    }
+    for (i = 0; i < n; i++) bind = format("%s    cell a%d = argv[%d];\n", bind, i, i);
+
+    char* statements = tail(body, locals, 1);
+
+    // Note the definition it came from
+    size_t len = strlen(line);
+    fprintf(code, "\n// %.*s%s\n", (int) (len > 72 ? 69 : len), line, len > 72 ? "..." : "");
+    fprintf(code, "cell %s(int argc, cell* argv) {\n", f.name);
+    fprintf(code, "    pthread_once(&once, init);\n");
+    fprintf(code, "    if (crispc_interpreted(argc, %d))\n", n);
+    fprintf(code, "        return crispc_interpret(CAST(%s, NATIVE_FN_V), argc, argv);\n", f.name);
+    fprintf(code, "    crispc_check_stack();\n");
+    fprintf(code, "%s", bind);
+    fprintf(code, "    cell rv, *hole = &rv;\n");
+    if (f.loops) fprintf(code, "start:;\n");
+    fprintf(code, "%s}\n", statements);
+
+    // Called as the script defines it, with its interpreted version
+    fprintf(code, "\ncell %s_define(int argc, cell* argv) {\n", f.name);
+    fprintf(code, "    return crispc_define(argc ? argv[0] : NIL, CAST(%s, NATIVE_FN_V));\n}\n", f.name);
+
+    names = realloc(names, (num_functions + 1) * sizeof(char*));
+    names[num_functions++] = f.name;
+
+    // def name lambda ... -> (lambda ...)
+    // defrec name ... -> (rec name ...)
+    char* value = skip_token(line);
+    if (!macro) value = skip_token(value);
+    while (isspace(*value)) value++;
+    return format("def %s (native-fn-v this.%s_define) (%s%s%s)", SYM_STR(name), f.name,
+                  macro ? macro : "", macro ? " " : "", value);
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fputs("usage: crispc module.crisp out.crisp out.c\n", stderr);
+        return 1;
+    }
+    current_vm = crisp_vm_new();
+    current_vm->stack_base = &argc;
+
+    FILE* in = fopen(argv[1], "r");
+    FILE* script = fopen(argv[2], "w");
+    FILE* out = fopen(argv[3], "w");
+    if (!in || !script || !out) {
+        perror("crispc");
+        return 1;
+    }
+    char* buf;
+    size_t size;
+    code = open_memstream(&buf, &size);
+
+    char* module = strrchr(argv[1], '/') ? strrchr(argv[1], '/') + 1 : argv[1];
+    fprintf(script, "; compiled from %s by crispc\n", module);
+
+    logical_line ll;
+    reset_logical_line(&ll);
+    int c;
+    do {
+        c = fgetc(in);
+        if (!logical_line_ingest(&ll, c == EOF ? '\0' : c)) continue;
+        char* line = strdup(ll.str);
+        cell expr = parse(&ll.str);
+        char* compiled = expr ? compile(expr, line) : NULL;
+        if (expr) fprintf(script, "%s\n", compiled ? compiled : line);
+        reset_logical_line(&ll);
+    } while (c != EOF);
+    fclose(code);
+
+    fprintf(out, "// Compiled from %s by crispc. Don't edit; edit the script\n\n", module);
+    fprintf(out, "#include <crispc.h>\n#include <math.h>\n\n");
+    fprintf(out, "static cell k[%d];\n", num_constants + 1);
+    fprintf(out, "static __thread crispc_site g[%d];\n", num_globals + 1);
+    fprintf(out, "static pthread_once_t once = PTHREAD_ONCE_INIT;\n\n");
+    fprintf(out, "static void init(void) {\n");
+    int i;
+    for (i = 0; i < num_constants; i++)
+        fprintf(out, "    k[%d] = %s;\n", i, datum(constants[i]));
+    fprintf(out, "}\n%s", buf);
+
+    fclose(in);
+    fclose(script);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include <crisp.h>
+#include <stdarg.h>
+
+// Support for the C which crispc generates from a module's definitions.
+// Each compiled function is a NATIVE_FN_V. Globals are looked up through
+// per-thread caches which are refreshed when anything is defined, and the
+// forms crispc can't compile are handed to eval in an environment built
+// from the function's locals, so their behaviour is unchanged.
+
+// A cached lookup of a global symbol
+typedef struct {
+    crisp_vm* vm;
+    uint64_t epoch;
+    cell value;
+} crispc_site;
+
+// Look up a global, evaluating the symbol as eval would if anything has
+// been defined since the last lookup
+static inline cell crispc_global(crispc_site* site, cell name) {
+    if (site->vm != current_vm || site->epoch != current_vm->def_epoch) {
+        site->value = eval(name, current_vm->global_env);
+        site->vm = current_vm;
+        site->epoch = current_vm->def_epoch;
+    }
+    return site->value;
+}
+
+// Build a list of n elements from the arguments following tail
+static inline cell crispc_list(int n, cell tail, ...) {
+    va_list ap;
+    va_start(ap, tail);
+    cell rv = make_list(n, tail), l;
+    for (l = rv; n--; l = cdr(l)) SET_CAR(l, va_arg(ap, cell));
+    va_end(ap);
+    return rv;
+}
+
+// Is fn applied to evaluated arguments? Anything else is handed its
+// argument code and environment, as eval would
+static inline bool crispc_strict(cell fn) {
+    return TYPE(fn) == NATIVE_FN_V ||
+           TYPE(fn) == FN ||
+           TYPE(fn) == FFI_FN ||
+           !IS_CALLABLE(fn);
+}
+
+// Apply a strict fn to a vector of evaluated arguments
+static inline cell crispc_apply_v(cell fn, int argc, cell* argv) {
+    if (TYPE(fn) == NATIVE_FN_V) return FN_V_PTR(fn)(argc, argv);
+    cell args = make_list(argc, NIL), l;
+    int i;
+    for (i = 0, l = args; i < argc; i++, l = cdr(l)) SET_CAR(l, argv[i]);
+    // x y -> 1 2
+    if (!IS_CALLABLE(fn) && TYPE(fn) != FFI_SYM) return cons(fn, args);
+    if (TYPE(fn) == FFI_SYM) fn = CAST(fn, FFI_FN);
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+// Finish evaluating a list whose head evaluated to fn, as eval would
+static inline cell crispc_apply_code(cell fn, cell args, cell env) {
+    // cons x y -> 1 . (eval y)
+    if (TYPE(fn) == CONS) {
+        cell first = eval(car(args), env);
+        return cons(first, eval(cdr(args), env));
+    }
+    if (TYPE(fn) == FFI_SYM) fn = CAST(fn, FFI_FN);
+    if (!IS_CALLABLE(fn)) return cons(fn, evalmap(args, env));
+    switch (TYPE(fn)) {
+        case NATIVE_FN:
+        case NATIVE_FN_V:
+        case FN:
+        case FFI_FN:
+            args = evalmap(args, env);
+        default:
+            break;
+    }
+    if (!IS_PAIR(args)) args = LIST1(args);
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+static inline void crispc_check_stack(void) {
+    char here;
+    if ((uint64_t) (current_vm->stack_base - (void*) &here) > 0x200000) {
+        puts("Stack overflowed");
+        exit(-1);
+    }
+}
+
+// Compiled code assumes if, with, cons and quote are the builtins
+static inline bool crispc_builtins_intact(void) {
+    static __thread crisp_vm* vm;
+    static __thread uint64_t epoch;
+    static __thread bool intact;
+    if (vm == current_vm && epoch == current_vm->def_epoch) return intact;
+    cell env = current_vm->global_env;
+    intact = eval(sym("if"), env) == CAST(if_fn, NATIVE_FN_TCO) &&
+             eval(sym("with"), env) == CAST(with, NATIVE_FN_TCO) &&
+             eval(sym("cons"), env) == CAST(NIL, CONS) &&
+             eval(sym("quote"), env) == CAST(quote, NATIVE_MACRO);
+    vm = current_vm;
+    epoch = current_vm->def_epoch;
+    return intact;
+}
+
+// Should a call be left to the interpreted version of the function? That
+// handles other numbers of arguments, evaluation on the heap, and green
+// threads, which the compiled version would run to the end without yielding
+static inline bool crispc_interpreted(int argc, int params) {
+    return argc != params || current_vm->heap_stack || green_running() || !crispc_builtins_intact();
+}
+
+// Record the interpreted version of a function in the vm, made where the
+// script originally defined it, and return what the script should define.
+// A vm evaluating on the heap keeps the interpreted version, whose recursion
+// doesn't deepen the C stack. Green threads look the interpreted version up
+// too, so their machines can stop partway through it
+static inline cell crispc_define(cell interpreted, cell compiled) {
+    current_vm->compiled = cons(cons(compiled, interpreted), current_vm->compiled);
+    return current_vm->heap_stack ? interpreted : compiled;
+}
+
+// Apply the interpreted version of compiled in the current vm
+static inline cell crispc_interpret(cell compiled, int argc, cell* argv) {
+    return crispc_apply_v(interpreted_version(compiled), argc, argv);
+}
@@ -16,7 +16,8 @@ cell find_ffi_sym(char* sym_name, cell env) {
         dot = cur + 1;
         cur = strstr(dot, ".");
     } while (cur);
-    if (!dot) return NIL;
+    // Without a library name there's nothing to look up
+    if (dot == sym_name + 1) return NIL;
 
     size_t libname_len = dot - sym_name - 1;
     char* libname = strncpy(malloc_or_die(libname_len + 1), sym_name, libname_len);
@@ -52,9 +53,29 @@ cell dlopen_fn(cell args, cell env) {
     return (cell) handle | FFI_LIBRARY;
 }
 
+// Apply an FFI_FN whose arguments are all floats, like those in libm.
+// Doubles are passed in their own registers, so the function is called as
+// taking six and returning a double, and ignores any it doesn't take
+static cell apply_ffi_float_function(int64_t (* fn)(), cell args) {
+    double float_args[6] = {0};
+    int i;
+    for (i = 0; IS_PAIR(args) && i < 6; args = cdr(args), i++)
+        float_args[i] = FLOAT_VAL(car(args));
+    double (* float_fn)(double, double, double, double, double, double) = (void*) fn;
+    return make_float(float_fn(float_args[0], float_args[1], float_args[2],
+                               float_args[3], float_args[4], float_args[5]));
+}
+
 // Apply an FFI_FN to up to 5 arguments
 // Symbols are passed as strings, ints are passed as longs
+// If every argument is a float, they are passed as doubles and a double is
+// returned; otherwise floats are passed as NULL and an int is returned
 cell apply_ffi_function(int64_t (* fn)(), cell args) {
+    TRACE(TRACE_FFI, CAST(fn, FFI_FN));
+    cell rest;
+    for (rest = args; IS_PAIR(rest) && IS_FLOAT(car(rest)); rest = cdr(rest));
+    if (IS_PAIR(args) && !rest) return apply_ffi_float_function(fn, args);
+
     // Hardcode cases for up to 5 args
     void* ffi_args[6];
     int i = 0;
@@ -89,13 +110,9 @@ cell apply_ffi_function(int64_t (* fn)(), cell args) {
     }
 }
 
-void* try_load(char* filename, bool* already_loaded) {
-    *already_loaded = (bool) dlopen(filename, RTLD_LAZY | RTLD_NOLOAD);
-    if (*already_loaded) {
-        DPRINTF("Already loaded %s\n", filename);
-        return NULL;
-    }
-
+void* try_load(char* filename) {
+    // A module loaded by another vm is already open, and dlopen returns
+    // the same handle
     void* handle = dlopen(filename, RTLD_LAZY);
     if (handle) {
         DPRINTF("Loaded from %s: %p\n", filename, handle);
@@ -112,43 +129,65 @@ cell native_fn(cell args, cell env) {
     return CAST(car(args), NATIVE_FN);
 }
 
+cell native_fn_v(cell args, cell env) {
+    if (!args) return NIL;
+    return CAST(car(args), NATIVE_FN_V);
+}
+
 cell native_macro(cell args, cell env) {
     if (!args) return NIL;
     return CAST(car(args), NATIVE_MACRO);
 }
 
+// Type codes are shared by every vm, since a module's code is loaded once
+// per process. A type registered by an earlier vm keeps its code
 cell register_type(cell args, cell env) {
     static short type_count = BUILTIN_TYPE_COUNT;
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
     if(!args || TYPE(car(args)) != FFI_SYM) return NIL;
     uint64_t* typecode = PTR(car(args));
     if(!typecode) return NIL;
-    DPRINTF("Assigning typecode %d\n", type_count);
-    *typecode = (uint64_t) type_count++ << 48;
+    pthread_mutex_lock(&lock);
+    if (!*typecode) {
+        // Codes from COMPACT up are compact pairs
+        if (type_count == COMPACT >> 48) {
+            puts("Too many types registered");
+            exit(-1);
+        }
+        DPRINTF("Assigning typecode %d\n", type_count);
+        *typecode = (uint64_t) type_count++ << 48;
+    }
+    pthread_mutex_unlock(&lock);
     return make_int((int64_t) *typecode);
 }
 
 cell import(cell args, cell env) {
     if (!args || TYPE(car(args)) != SYMBOL) return NIL;
-    char* lib_name = SYM_STR(car(args));
+    // Each module is imported once per vm
+    cell imported;
+    for (imported = current_vm->imported; imported; imported = cdr(imported))
+        if (car(imported) == car(args)) return NIL;
+
+    char* lib_name = strdup(SYM_STR(car(args)));
     char* lib_filename = NULL;
     void* handle;
     char* module_path = getenv("CRISP_MODULE_PATH");
-    bool already_loaded = false;
     if (!module_path) module_path = "./modules";
     module_path = realpath(module_path, NULL);
     asprintf(&lib_filename, "%s/%s/lib%s.crisp.so", module_path, lib_name, lib_name);
-    handle = try_load(lib_filename, &already_loaded);
-    if (!already_loaded && !handle) {
+    handle = try_load(lib_filename);
+    if (!handle) {
         asprintf(&lib_filename, "%s/lib%s.crisp.so", module_path, lib_name);
-        handle = try_load(lib_filename, &already_loaded);
+        handle = try_load(lib_filename);
     }
-    if (!already_loaded && !handle) {
+    if (!handle) {
         asprintf(&lib_filename, "lib%s.crisp.so", lib_name);
-        handle = try_load(lib_filename, &already_loaded);
+        handle = try_load(lib_filename);
     }
     free(lib_filename);
     free(module_path);
     if (!handle) return NIL;
+    current_vm->imported = cons(car(args), current_vm->imported);
 
     char* i;
 
@@ -163,16 +202,19 @@ cell import(cell args, cell env) {
     asprintf(&sym_name, "_binary_%s_crisp_end", lib_name);
     char* script_end = dlsym(handle, sym_name);
     free(sym_name);
+    free(lib_name);
 
     if (!script || !script_end) return NIL;
 
     cell this_lib = (cell) handle | FFI_LIBRARY;
     cell mapping_this_lib = cons(sym("this"), this_lib);
     cell mapping_native_fn = cons(sym("native-fn"), CAST(native_fn, NATIVE_FN));
+    cell mapping_native_fn_v = cons(sym("native-fn-v"), CAST(native_fn_v, NATIVE_FN));
     cell mapping_native_macro = cons(sym("native-macro"), CAST(native_macro, NATIVE_FN));
     cell new_env = cons(mapping_this_lib, env);
     new_env = cons(cons(sym("register-type"), CAST(register_type, NATIVE_FN)), new_env);
-    new_env = cons(mapping_native_fn, cons(mapping_native_macro, new_env));
+    new_env = cons(cons(sym("jit-intrinsic"), CAST(jit_intrinsic, NATIVE_FN)), new_env);
+    new_env = cons(mapping_native_fn, cons(mapping_native_fn_v, cons(mapping_native_macro, new_env)));
 
     logical_line ll;
     reset_logical_line(&ll);
@@ -0,0 +1,313 @@
+#include "crisp.h"
+
+// This file implements green threads: many evaluations multiplexed on one
+// OS thread by a cooperative scheduler. Each thread evaluates on its own
+// machine (see cek.c), so its state lives on the heap and it can be stopped
+// between any two steps of evaluation.
+//
+// The scheduler is round robin. A thread runs for GREEN_QUANTUM steps times
+// its priority, or until it yields or blocks on a channel or a join, and
+// then goes to the back of the queue. Functions called from native code,
+// and lambdas compiled by the JIT, run on the C stack and can't be stopped,
+// so a thread is only preempted once they return.
+//
+// Threads only run when something waits for them. The main program, or a
+// thread inside a native call, runs other threads in place whenever it
+// yields or would otherwise block:
+//     def c (chan ())
+//     go (lambda (n) send c (product n n)) 12
+//     recv c -> 144
+
+#define GREEN_QUANTUM 1000
+
+typedef enum {
+    GREEN_READY,
+    GREEN_RUNNING,
+    GREEN_BLOCKED,
+    GREEN_DONE,
+} green_state;
+
+typedef struct green_thread {
+    int64_t id;
+    green_state state;
+    machine* m;
+    cell result;
+    int64_t priority;
+    // Steps left in the current slice, and the size of the slice
+    int64_t steps_left;
+    int64_t slice;
+    // Totals for accounting
+    uint64_t steps;
+    uint64_t allocated;
+    // The next thread in the run queue or in the same wait list
+    struct green_thread* next;
+    // Threads waiting to join this one
+    struct green_thread* joiners;
+} green_thread;
+
+typedef struct {
+    // A ring buffer of values
+    cell* items;
+    size_t head;
+    size_t len;
+    size_t size;
+    // The most values held before send blocks, or 0 for no bound
+    size_t capacity;
+    // Threads waiting for the channel to change
+    green_thread* waiters;
+} channel;
+
+typedef struct scheduler {
+    green_thread** threads;
+    size_t num_threads;
+    size_t max_threads;
+    green_thread* ready;
+    green_thread* ready_tail;
+    // The thread being run, or NULL in the main program
+    green_thread* current;
+    // current_vm->allocated when the current thread last changed
+    uint64_t allocated;
+} scheduler;
+
+static scheduler* get_scheduler(void) {
+    if (!current_vm->green) {
+        scheduler* s = malloc_or_die(sizeof(scheduler));
+        s->max_threads = 16;
+        s->threads = malloc_or_die(s->max_threads * sizeof(green_thread*));
+        current_vm->green = s;
+    }
+    return current_vm->green;
+}
+
+static void make_ready(scheduler* s, green_thread* t) {
+    t->state = GREEN_READY;
+    t->next = NULL;
+    if (s->ready_tail) s->ready_tail->next = t;
+    else s->ready = t;
+    s->ready_tail = t;
+}
+
+static void wait_on(green_thread** list, green_thread* t) {
+    t->state = GREEN_BLOCKED;
+    t->next = *list;
+    *list = t;
+}
+
+// Wake every thread in a wait list. Each retries what it was waiting for,
+// and waits again if it still can't proceed
+static void wake(scheduler* s, green_thread** list) {
+    green_thread* t = *list;
+    *list = NULL;
+    while (t) {
+        green_thread* next = t->next;
+        make_ready(s, t);
+        t = next;
+    }
+}
+
+// Charge allocations since the last switch to the thread which made them
+static void switch_to(scheduler* s, green_thread* t) {
+    if (s->current) s->current->allocated += current_vm->allocated - s->allocated;
+    s->allocated = current_vm->allocated;
+    s->current = t;
+}
+
+// Run the thread at the front of the queue for one slice
+// Returns false if no thread is ready
+static bool run_one(scheduler* s) {
+    green_thread* t = s->ready;
+    if (!t) return false;
+    s->ready = t->next;
+    if (!s->ready) s->ready_tail = NULL;
+
+    green_thread* outer = s->current;
+    switch_to(s, t);
+    t->state = GREEN_RUNNING;
+    t->slice = t->steps_left = GREEN_QUANTUM * t->priority;
+    cell result;
+    bool finished = machine_run(t->m, &t->steps_left, &result);
+    t->steps += t->slice - (t->steps_left > 0 ? t->steps_left : 0);
+    switch_to(s, outer);
+
+    if (finished) {
+        t->state = GREEN_DONE;
+        t->result = result;
+        t->m = NULL;
+        wake(s, &t->joiners);
+    } else if (t->state == GREEN_RUNNING) {
+        make_ready(s, t);
+    }
+    return true;
+}
+
+static green_thread* find_thread(cell id) {
+    scheduler* s = get_scheduler();
+    if (!IS_INT(id) || INT_VAL(id) < 0 || INT_VAL(id) >= (int64_t) s->num_threads) return NULL;
+    return s->threads[INT_VAL(id)];
+}
+
+static bool would_block_recv(channel* ch) {
+    return !ch->len;
+}
+
+static bool would_block_send(channel* ch) {
+    return ch->capacity && ch->len == ch->capacity;
+}
+
+// Called by a green thread's machine before applying a native function
+// directly. If fn is a channel operation or a join which can't proceed yet,
+// the thread waits and the application is retried once it's woken
+bool green_blocks(cell fn, int argc, cell* argv) {
+    green_thread* t = get_scheduler()->current;
+    if (!argc) return false;
+    if (FN_PTR(fn) == (void*) recv_fn && TYPE(argv[0]) == CHANNEL) {
+        channel* ch = PTR(argv[0]);
+        if (!would_block_recv(ch)) return false;
+        wait_on(&ch->waiters, t);
+        return true;
+    }
+    if (FN_PTR(fn) == (void*) send_fn && TYPE(argv[0]) == CHANNEL) {
+        channel* ch = PTR(argv[0]);
+        if (!would_block_send(ch)) return false;
+        wait_on(&ch->waiters, t);
+        return true;
+    }
+    if (FN_PTR(fn) == (void*) join_fn) {
+        green_thread* target = find_thread(argv[0]);
+        if (!target || target->state == GREEN_DONE || target == t) return false;
+        wait_on(&target->joiners, t);
+        return true;
+    }
+    return false;
+}
+
+// Is a green thread running, rather than the main program?
+bool green_running(void) {
+    return current_vm->green && current_vm->green->current;
+}
+
+cell go_fn(int argc, cell* argv) {
+    // go f 1 2 -> 0, the id of a new thread evaluating f 1 2
+    if (!argc || !IS_CALLABLE(argv[0])) return NIL;
+    scheduler* s = get_scheduler();
+    cell args = NIL;
+    int i;
+    for (i = argc - 1; i > 0; i--) args = cons(argv[i], args);
+    // apply f '(1 2), since the arguments are already evaluated
+    cell c = cons(CAST(apply_fn, NATIVE_FN_TCO), LIST2(argv[0], LIST2(CAST(quote, NATIVE_MACRO), args)));
+
+    green_thread* t = malloc_or_die(sizeof(green_thread));
+    t->id = s->num_threads;
+    t->m = machine_new(c, current_vm->global_env);
+    t->priority = 1;
+    if (s->num_threads == s->max_threads) {
+        green_thread** threads = malloc_or_die(2 * s->max_threads * sizeof(green_thread*));
+        memcpy(threads, s->threads, s->num_threads * sizeof(green_thread*));
+        s->threads = threads;
+        s->max_threads *= 2;
+    }
+    s->threads[s->num_threads++] = t;
+    make_ready(s, t);
+    return make_int(t->id);
+}
+
+cell yield_fn(int argc, cell* argv) {
+    // yield () -> nil, letting other threads run
+    scheduler* s = get_scheduler();
+    if (s->current) {
+        // End the slice at the machine's next step
+        s->current->steps += s->current->slice - s->current->steps_left;
+        s->current->slice = s->current->steps_left = 0;
+        return NIL;
+    }
+    // The main program gives each ready thread a slice
+    size_t n = 0;
+    green_thread* t;
+    for (t = s->ready; t; t = t->next) n++;
+    while (n-- && run_one(s));
+    return NIL;
+}
+
+cell chan_fn(int argc, cell* argv) {
+    // chan () -> CHANNEL<...>, holding any number of values
+    // chan 1 -> a channel holding at most one value, so send waits for recv
+    channel* ch = malloc_or_die(sizeof(channel));
+    ch->capacity = argc && IS_INT(argv[0]) && INT_VAL(argv[0]) > 0 ? INT_VAL(argv[0]) : 0;
+    ch->size = ch->capacity ? ch->capacity : 8;
+    ch->items = malloc_or_die(ch->size * sizeof(cell));
+    return CAST(ch, CHANNEL);
+}
+
+cell send_fn(int argc, cell* argv) {
+    // send c 5 -> 5, once c has room for it
+    if (argc < 2 || TYPE(argv[0]) != CHANNEL) return NIL;
+    channel* ch = PTR(argv[0]);
+    scheduler* s = get_scheduler();
+    while (would_block_send(ch))
+        if (!run_one(s)) return NIL;
+    if (ch->len == ch->size) {
+        cell* items = malloc_or_die(2 * ch->size * sizeof(cell));
+        size_t i;
+        for (i = 0; i < ch->len; i++) items[i] = ch->items[(ch->head + i) % ch->size];
+        ch->items = items;
+        ch->head = 0;
+        ch->size *= 2;
+    }
+    ch->items[(ch->head + ch->len++) % ch->size] = argv[1];
+    wake(s, &ch->waiters);
+    return argv[1];
+}
+
+cell recv_fn(int argc, cell* argv) {
+    // recv c -> the oldest value sent to c, once there is one
+    // Returns nil if every other thread has finished or is waiting
+    if (!argc || TYPE(argv[0]) != CHANNEL) return NIL;
+    channel* ch = PTR(argv[0]);
+    scheduler* s = get_scheduler();
+    while (would_block_recv(ch))
+        if (!run_one(s)) return NIL;
+    cell v = ch->items[ch->head];
+    ch->items[ch->head] = NIL;
+    ch->head = (ch->head + 1) % ch->size;
+    ch->len--;
+    wake(s, &ch->waiters);
+    return v;
+}
+
+cell join_fn(int argc, cell* argv) {
+    // join (go sum 1 2) -> 3, once the thread has finished
+    green_thread* t = argc ? find_thread(argv[0]) : NULL;
+    if (!t) return NIL;
+    scheduler* s = get_scheduler();
+    while (t->state != GREEN_DONE)
+        if (t == s->current || !run_one(s)) return NIL;
+    return t->result;
+}
+
+cell run_threads_fn(int argc, cell* argv) {
+    // run-threads () -> 0, once every thread has finished or is waiting
+    // The result is the number of threads left waiting
+    scheduler* s = get_scheduler();
+    while (run_one(s));
+    int64_t waiting = 0;
+    size_t i;
+    for (i = 0; i < s->num_threads; i++)
+        waiting += s->threads[i]->state == GREEN_BLOCKED;
+    return make_int(waiting);
+}
+
+cell thread_priority_fn(int argc, cell* argv) {
+    // thread-priority 0 4 -> 4, giving thread 0 slices four times as long
+    green_thread* t = argc ? find_thread(argv[0]) : NULL;
+    if (!t || argc < 2 || !IS_INT(argv[1]) || INT_VAL(argv[1]) < 1) return NIL;
+    t->priority = INT_VAL(argv[1]);
+    return argv[1];
+}
+
+cell thread_stats_fn(int argc, cell* argv) {
+    // thread-stats 0 -> (done 1042 8192), its state, steps and bytes allocated
+    green_thread* t = argc ? find_thread(argv[0]) : NULL;
+    if (!t) return NIL;
+    static char* states[] = {"ready", "running", "blocked", "done"};
+    return cons(sym(states[t->state]), LIST2(make_int(t->steps), make_int(t->allocated)));
+}
@@ -0,0 +1,170 @@
+#include "crisp.h"
+
+// This file implements hashcons, which returns a canonical copy of a
+// structure: every pair in it is replaced by the one pair in a table with
+// the same car and cdr, so structures which are deep-equal after hash-consing
+// are the same cell, and repeated substructure is stored only once.
+//
+// Pairs in the table are always allocated here rather than adopted from the
+// argument. The interpreter fills in the cdrs of pairs it has just allocated
+// (for TCO modulo cons, and in builtins like concat), and map.c updates its
+// trees in place while building them, so only pairs nothing else has seen
+// can be relied on never to change.
+//
+// The table holds its pairs weakly. Each entry hides its pointer from the
+// collector and registers it as a disappearing link, so the collector clears
+// it when nothing else refers to the pair; cleared entries are unlinked
+// as they are found.
+
+typedef struct entry {
+    // GC_HIDE_POINTER of the pair's cell
+    uintptr_t hidden;
+    uint64_t hash;
+    struct entry* next;
+} entry;
+
+// The table is shared by every vm, so it's locked while in use
+static entry** buckets;
+static size_t num_buckets;
+static size_t num_entries;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Atoms are compared like equal does: integers by value, anything else by
+// identity. Floats are compared by their bits rather than by value, since
+// replacing 2.0 with 2 or -0.0 with 0.0 would change the structure. The car
+// and cdr of a pair in the table are themselves canonical.
+static inline bool same_atom(cell a, cell b) {
+    if (a == b) return true;
+    if (IS_INT(a) && IS_INT(b)) return INT_VAL(a) == INT_VAL(b);
+    if (TYPE(a) == F64 && TYPE(b) == F64)
+        return !memcmp(PTR(a), PTR(b), sizeof(double));
+    return false;
+}
+
+static inline uint64_t atom_hash(cell c) {
+    uint64_t x = IS_INT(c) ? (uint64_t) INT_VAL(c) : c;
+    if (TYPE(c) == F64) memcpy(&x, PTR(c), sizeof(double));
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    return x ^ (x >> 33);
+}
+
+static inline uint64_t pair_hash(cell a, cell d) {
+    return atom_hash(a) * 31 + atom_hash(d);
+}
+
+static void grow(void) {
+    size_t size = num_buckets ? num_buckets * 2 : 1024;
+    entry** new_buckets = malloc_or_die(size * sizeof(entry*));
+    memset(new_buckets, 0, size * sizeof(entry*));
+    size_t i;
+    for (i = 0; i < num_buckets; i++) {
+        entry* e = buckets[i];
+        while (e) {
+            entry* next = e->next;
+            e->next = new_buckets[e->hash & (size - 1)];
+            new_buckets[e->hash & (size - 1)] = e;
+            e = next;
+        }
+    }
+    buckets = new_buckets;
+    num_buckets = size;
+}
+
+// Find the pair in the table with this car and cdr, adding one if needed
+static cell intern(cell a, cell d) {
+    if (!num_buckets) grow();
+    uint64_t hash = pair_hash(a, d);
+    entry** link = &buckets[hash & (num_buckets - 1)];
+    while (*link) {
+        entry* e = *link;
+        if (!e->hidden) {
+            // The pair was collected
+            *link = e->next;
+            num_entries--;
+            continue;
+        }
+        cell p = (cell) GC_REVEAL_POINTER(e->hidden);
+        if (e->hash == hash && same_atom(car(p), a) && same_atom(cdr(p), d)) return p;
+        link = &e->next;
+    }
+    cell p = cons(a, d);
+    entry* e = malloc_or_die(sizeof(entry));
+    e->hidden = GC_HIDE_POINTER(p);
+    e->hash = hash;
+#ifndef FUZZ
+    GC_general_register_disappearing_link((void**) &e->hidden, PTR(p));
+#endif
+    e->next = buckets[hash & (num_buckets - 1)];
+    buckets[hash & (num_buckets - 1)] = e;
+    if (++num_entries > num_buckets) grow();
+    return p;
+}
+
+// Whether p is already the canonical pair for its contents
+static bool is_canonical(cell p) {
+    if (!num_buckets) return false;
+    uint64_t hash = pair_hash(car(p), cdr(p));
+    entry* e;
+    for (e = buckets[hash & (num_buckets - 1)]; e; e = e->next)
+        if (e->hidden && (cell) GC_REVEAL_POINTER(e->hidden) == p) return true;
+    return false;
+}
+
+typedef struct {
+    cell c;
+    // Set once the car and cdr of c are on the result stack
+    bool children_done;
+} todo;
+
+static cell hashcons_locked(cell c) {
+    // Walk the structure without recursing, since lists may be long:
+    // visit a pair, then its car and cdr, then build it from their results
+    size_t max_todo = 64, max_results = 64;
+    size_t num_todo = 0, num_results = 0;
+    todo* stack = malloc_or_die(max_todo * sizeof(todo));
+    cell* results = malloc_or_die(max_results * sizeof(cell));
+    stack[num_todo++] = (todo) {c, false};
+    while (num_todo) {
+        todo t = stack[--num_todo];
+        if (num_todo + 3 > max_todo)
+            stack = GC_REALLOC(stack, (max_todo *= 2) * sizeof(todo));
+        if (num_results + 1 > max_results)
+            results = GC_REALLOC(results, (max_results *= 2) * sizeof(cell));
+        if (t.children_done) {
+            cell d = results[--num_results];
+            cell a = results[--num_results];
+            results[num_results++] = intern(a, d);
+        } else if (!IS_PAIR(t.c) || is_canonical(t.c)) {
+            results[num_results++] = t.c;
+        } else {
+            stack[num_todo++] = (todo) {t.c, true};
+            stack[num_todo++] = (todo) {cdr(t.c), false};
+            stack[num_todo++] = (todo) {car(t.c), false};
+        }
+    }
+    return results[0];
+}
+
+cell hashcons(cell c) {
+    pthread_mutex_lock(&lock);
+    cell rv = hashcons_locked(c);
+    pthread_mutex_unlock(&lock);
+    return rv;
+}
+
+cell hashcons_fn(int argc, cell* argv) {
+    // hashcons (a (b c) (b c)) -> (a (b c) (b c)), where both (b c) are the same
+    // For any lists x and y of integers and interned symbols:
+    // deep-equal x y -> same (hashcons x) (hashcons y)
+    return argc ? hashcons(argv[0]) : NIL;
+}
+
+cell hashcons_count(int argc, cell* argv) {
+    // hashcons-count () -> the number of pairs in the table
+    // Pairs which have been collected may be counted until they are found
+    pthread_mutex_lock(&lock);
+    size_t n = num_entries;
+    pthread_mutex_unlock(&lock);
+    return make_int(n);
+}
@@ -1,50 +1,35 @@
 #include "crisp.h"
 
+static void dump_trace(void) {
+    if (!trace_dump("crisp.trace")) fputs("couldn't write crisp.trace\n", stderr);
+}
+
 // This is the crisp REPL. All of the evaluation logic is in crisp.c.
-// First we set up a global environment mapping symbols to builtin functions
-// Then we read logical lines and print the result of their evaluation until EOF
+// First we create a vm, whose global environment maps symbols to builtin
+// functions (see vm.c). Then we read logical lines and print the result of
+// their evaluation until EOF
 
 int main(int argc, char** argv) {
-    if (argc >= 2 && !strcmp(argv[1], "debug"))
-        debug = true;
-
-    stack_base = &argc;
-
-    global_env = cons(cons(sym("eval"), CAST(eval, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("quote"), CAST(quote, NATIVE_MACRO)), global_env);
-    global_env = cons(cons(sym("lambda"), CAST(lambda, NATIVE_MACRO)), global_env);
-    global_env = cons(cons(sym("car"), CAST(car_fn, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("cdr"), CAST(cdr_fn, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("list"), CAST(quote, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("equal"), CAST(equal_fn, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("same"), CAST(same, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("def"), CAST(def, NATIVE_MACRO)), global_env);
-    global_env = cons(cons(sym("macro"), CAST(macro, NATIVE_MACRO)), global_env);
-    global_env = cons(cons(sym("typeof"), CAST(typeof_fn, NATIVE_FN)), global_env);
-
-#ifndef DISABLE_FFI
-    global_env = cons(cons(sym("dlopen"), CAST(dlopen_fn, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("dlsym"), CAST(dlsym_fn, NATIVE_FN)), global_env);
-    global_env = cons(cons(sym("import"), CAST(import, NATIVE_FN)), global_env);
-#endif
-
-    global_env = cons(cons(sym("apply"), CAST(apply_fn, NATIVE_FN_TCO)), global_env);
-    global_env = cons(cons(sym("if"), CAST(if_fn, NATIVE_FN_TCO)), global_env);
-    global_env = cons(cons(sym("with"), CAST(with, NATIVE_FN_TCO)), global_env);
-    global_env = cons(cons(sym("cons"), CAST(NIL, CONS)), global_env);
-
-    global_env = cons(cons(sym("GLOBALS"), NIL), global_env);
+    current_vm = crisp_vm_new();
+    current_vm->stack_base = &argc;
 
-    // The global env looks like this:
-    //     (y . 5) (z . 5) ..       (GLOBALS) (foo . 5) (identity . FN(x)<x>) .. (hash . NATIVE_FUNCTION<...>) (asc . NATIVE_FUNCTION<...>) ...
-    // local variables-^  just a marker-^       ^-global var  ^-builtins
-
-    // Lookups proceed left to right so local variables occlude global variables,
-    // global variables occlude builtins, and more recent global var definitions
-    // occlude older definitions
-
-    // global_env always points at the GLOBALS marker and new definitions
-    // are inserted just under it by the def function
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "debug"))
+            current_vm->debug = true;
+        // Evaluate with pending work on the heap, so recursion
+        // depth is limited only by memory
+        if (!strcmp(argv[i], "heap-stack"))
+            current_vm->heap_stack = true;
+        // Compile hot lambdas to native code
+        if (!strcmp(argv[i], "jit"))
+            current_vm->jit_enabled = true;
+        // Record binary trace events, written to crisp.trace at exit
+        if (!strcmp(argv[i], "trace")) {
+            trace_start();
+            atexit(dump_trace);
+        }
+    }
 
     logical_line ll;
     reset_logical_line(&ll);
@@ -53,11 +38,9 @@ int main(int argc, char** argv) {
 
 #ifdef FUZZ
 
-    import(LIST1(sym("std")), global_env);
-    import(LIST1(sym("map")), global_env);
-    import(LIST1(sym("queue")), global_env);
-
-    int i;
+    import(LIST1(sym("std")), current_vm->global_env);
+    import(LIST1(sym("map")), current_vm->global_env);
+    import(LIST1(sym("queue")), current_vm->global_env);
 
     for(i = 0; i<5; i++){
         if (-1 == getline(&line, &len, stdin))
@@ -75,7 +58,7 @@ int main(int argc, char** argv) {
             cell expr = parse(&ll.str);
             if (expr) {
                 DPRINTF("Parsed %s\n", print_cell(expr));
-                cell evalled = eval(expr, global_env);
+                cell evalled = eval(expr, current_vm->global_env);
                 if (evalled) puts(print_cell(evalled));
             }
             reset_logical_line(&ll);
@@ -99,7 +82,7 @@ int main(int argc, char** argv) {
             cell expr = parse(&ll.str);
             if (expr) {
                 DPRINTF("Parsed %s\n", print_cell(expr));
-                cell evalled = eval(expr, global_env);
+                cell evalled = eval(expr, current_vm->global_env);
                 if (evalled) puts(print_cell(evalled));
             }
             reset_logical_line(&ll);
@@ -0,0 +1,843 @@
+#include "crisp.h"
+
+// This file contains an optional baseline JIT compiler for x86-64 Linux.
+// It is disabled unless crisp is run with the `jit` argument.
+
+// apply counts the applications of each lambda. Once a lambda has been
+// applied JIT_THRESHOLD times, its body is translated template by template
+// into native code in an executable mapping:
+
+// - parameters are loaded from a vector rather than looked up in a list
+// - other symbols are looked up through inline caches, invalidated by def
+// - if, quote, car, cdr, equal, sum and asc get inline fixnum fast paths,
+//   guarded by a check that the symbol still refers to the builtin
+// - calls to other functions pass their arguments as a vector
+// - a tail call to the lambda itself becomes a jump, and other tail calls
+//   to compiled lambdas return to a trampoline in run
+// - anything else calls back into the interpreter, with an environment
+//   built only when needed
+
+// Lambdas with unsupported parameter lists, too many parameters or too
+// large a body are simply left to the interpreter.
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_THRESHOLD 100
+#define JIT_MAX_ARGS 8
+#define JIT_MAX_SITES 256
+#define JIT_MAX_NESTING 256
+
+// Compiled code returns one of these
+enum {
+    // fr->result is the value of the body
+    JIT_VALUE,
+    // evaluation should continue with fr->result in fr->env
+    JIT_SLIDE,
+    // fr->next should be applied to fr->next_args
+    JIT_TAIL_CALL,
+};
+
+typedef enum {
+    OP_NONE,
+    OP_IF,
+    OP_QUOTE,
+    OP_CAR,
+    OP_CDR,
+    OP_EQUAL,
+    OP_SUM,
+    OP_ASC,
+} jit_op;
+
+typedef struct {
+    cell* argv;
+    // Pairs of (def_epoch, value) caching symbol lookups
+    cell* sites;
+    cell self;
+    cell closure_env;
+    // The environment with parameters bound, or NIL until needed
+    cell env;
+    cell result;
+    cell next;
+    cell next_args[JIT_MAX_ARGS];
+} jit_frame;
+
+typedef struct {
+    int (* entry)(jit_frame*);
+    // The length of the mapping holding entry
+    size_t size;
+    cell body;
+    int nparams;
+    int nsites;
+    cell* syms;
+} jit_code;
+
+// Marks lambdas which couldn't be compiled
+static jit_code failed;
+
+// Compiled code is shared between closures of the same lambda, so each
+// vm's jit_compiled maps lambda bodies to their compiled code. Code reads
+// the def_epoch of the vm it was compiled in.
+
+// Functions defined in modules which have fast paths are mapped to their
+// ops by each vm's jit_intrinsics
+
+typedef struct {
+    unsigned char* buf;
+    size_t len;
+    size_t max_len;
+    // Number of values pushed on the machine stack
+    int depth;
+    int nesting;
+    cell params;
+    int nparams;
+    cell closure_env;
+    cell* syms;
+    int nsites;
+    bool failed;
+    size_t body_start;
+} jit_state;
+
+// Register numbers used in encodings
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7 };
+
+// Condition codes for jcc
+enum { JAE = 0x83, JE = 0x84, JNE = 0x85, JGE = 0x8d };
+
+static void emit(jit_state* s, const unsigned char* bytes, size_t n) {
+    if (s->len + n > s->max_len)
+        s->buf = GC_REALLOC(s->buf, s->max_len = (s->len + n) * 2);
+    memcpy(s->buf + s->len, bytes, n);
+    s->len += n;
+}
+
+#define EMIT(s, ...) do { \
+    static const unsigned char bytes_[] = {__VA_ARGS__}; \
+    emit(s, bytes_, sizeof(bytes_)); \
+} while (0)
+
+static void emit4(jit_state* s, unsigned int x) {
+    emit(s, (unsigned char*) &x, 4);
+}
+
+static void emit8(jit_state* s, uint64_t x) {
+    emit(s, (unsigned char*) &x, 8);
+}
+
+// mov reg, imm64
+static void mov_imm(jit_state* s, int reg, uint64_t x) {
+    unsigned char op[] = {0x48, 0xb8 + reg};
+    emit(s, op, 2);
+    emit8(s, x);
+}
+
+// mov reg, [rsp + 8 * i]
+static void load_stack(jit_state* s, int reg, int i) {
+    unsigned char op[] = {0x48, 0x8b, 0x84 | reg << 3, 0x24};
+    emit(s, op, 4);
+    emit4(s, 8 * i);
+}
+
+// mov [rbx + offset], rax
+static void store_frame(jit_state* s, size_t offset) {
+    EMIT(s, 0x48, 0x89, 0x83);
+    emit4(s, offset);
+}
+
+static void push_rax(jit_state* s) {
+    EMIT(s, 0x50);
+    s->depth++;
+}
+
+// add rsp, 8 * n
+static void drop(jit_state* s, int n) {
+    if (!n) return;
+    EMIT(s, 0x48, 0x81, 0xc4);
+    emit4(s, 8 * n);
+}
+
+// Call a C function, keeping the stack 16 byte aligned
+static void call(jit_state* s, void* fn) {
+    if (s->depth & 1) EMIT(s, 0x48, 0x83, 0xec, 0x08);
+    EMIT(s, 0x49, 0xbb);  // mov r11, fn
+    emit8(s, (uint64_t) fn);
+    EMIT(s, 0x41, 0xff, 0xd3);  // call r11
+    if (s->depth & 1) EMIT(s, 0x48, 0x83, 0xc4, 0x08);
+}
+
+// Emit a jump with a 32 bit displacement to be patched later
+static size_t jump(jit_state* s, int cc) {
+    if (cc) {
+        unsigned char op[] = {0x0f, cc};
+        emit(s, op, 2);
+    }
+    else EMIT(s, 0xe9);
+    emit4(s, 0);
+    return s->len - 4;
+}
+
+// Point a jump at the current position
+static void patch(jit_state* s, size_t at) {
+    int rel = s->len - (at + 4);
+    memcpy(s->buf + at, &rel, 4);
+}
+
+// Compare the type of the cell in rax (or rcx) with a type code
+static void check_type(jit_state* s, int reg, uint64_t type) {
+    if (reg == RAX) EMIT(s, 0x48, 0x89, 0xc2);  // mov rdx, rax
+    else EMIT(s, 0x48, 0x89, 0xca);             // mov rdx, rcx
+    EMIT(s, 0x48, 0xc1, 0xea, 0x30);            // shr rdx, 48
+    unsigned char op[] = {0x83, 0xfa, type >> 48};
+    emit(s, op, 3);                             // cmp edx, type
+}
+
+// Restore the stack and callee-saved registers and return eax
+static void leave(jit_state* s) {
+    drop(s, s->depth);
+    EMIT(s, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+}
+
+// Return the value in rax from the compiled code
+static void return_value(jit_state* s) {
+    store_frame(s, offsetof(jit_frame, result));
+    EMIT(s, 0x31, 0xc0);  // xor eax, eax
+    leave(s);
+}
+
+// The environment with parameters bound, built at most once per application
+static cell jit_env(jit_frame* fr) {
+    if (fr->env) return fr->env;
+    fn_t* l = (fn_t*) PTR(fr->self);
+    cell env = NIL;
+    cell* tail = &env;
+    cell params = l->args;
+    int i;
+    for (i = 0; IS_PAIR(params); params = cdr(params), i++) {
+        *tail = LIST1(cons(car(params), fr->argv[i]));
+        tail = &((pair*) PTR(*tail))->cdr;
+    }
+    *tail = fr->closure_env;
+    return fr->env = env;
+}
+
+// Look up a symbol just as eval does
+static cell lookup(cell c, cell env) {
+    cell resolved_symbol = assoc(c, env);
+    if (resolved_symbol) return cdr(resolved_symbol);
+    cell ffi_sym = find_ffi_sym(SYM_STR(c), env);
+    return ffi_sym ? ffi_sym : c;
+}
+
+// The slow path for an inline cache
+static cell jit_lookup_site(jit_frame* fr, long i) {
+    jit_code* code = ((fn_t*) PTR(fr->self))->jit;
+    cell value = lookup(code->syms[i], fr->closure_env);
+    fr->sites[2 * i] = current_vm->def_epoch;
+    fr->sites[2 * i + 1] = value;
+    return value;
+}
+
+static cell jit_eval(jit_frame* fr, cell c) {
+    return eval(c, jit_env(fr));
+}
+
+static int jit_slide(jit_frame* fr, cell c) {
+    fr->env = jit_env(fr);
+    fr->result = c;
+    return JIT_SLIDE;
+}
+
+static bool ready(cell fn, int argc);
+
+// Run compiled code, following tail calls between compiled lambdas
+static int run(cell fn, cell* argv, cell* result, cell* env) {
+    cell args[JIT_MAX_ARGS];
+    jit_frame fr;
+    // Compiled code recurses without passing through eval, so keep its guard
+    if ((uint64_t) (current_vm->stack_base - (void*) &fr) > 0x200000) {
+        puts("Stack overflowed");
+        exit(-1);
+    }
+    memcpy(args, argv, ((jit_code*) ((fn_t*) PTR(fn))->jit)->nparams * sizeof(cell));
+    while (1) {
+        fn_t* l = (fn_t*) PTR(fn);
+        fr.argv = args;
+        fr.sites = l->sites;
+        fr.self = fn;
+        fr.closure_env = l->env;
+        fr.env = NIL;
+        fr.result = NIL;
+        int outcome = ((jit_code*) l->jit)->entry(&fr);
+        if (outcome != JIT_TAIL_CALL) {
+            *result = fr.result;
+            *env = fr.env;
+            return outcome;
+        }
+        fn = fr.next;
+        memcpy(args, fr.next_args, sizeof(args));
+    }
+}
+
+// Build an argument list from the values compiled code pushed
+static cell list_args(long argc, cell* argv) {
+    cell args = NIL;
+    while (argc) args = cons(argv[--argc], args);
+    return args;
+}
+
+// Apply fn to arguments pushed on the machine stack, in reverse order
+static cell jit_call(jit_frame* fr, cell fn, long argc, cell* rev_argv) {
+    cell argv[argc ? argc : 1];
+    long i;
+    for (i = 0; i < argc; i++) argv[i] = rev_argv[argc - 1 - i];
+    if (TYPE(fn) == NATIVE_FN_V) return FN_V_PTR(fn)(argc, argv);
+    cell result, env;
+    if (TYPE(fn) == FN && ready(fn, argc)) {
+        if (run(fn, argv, &result, &env) == JIT_SLIDE) return eval(result, env);
+        return result;
+    }
+    result = list_args(argc, argv);
+    env = TYPE(fn) == NATIVE_FN ? jit_env(fr) : NIL;
+    if (apply(fn, &result, &env)) return eval(result, env);
+    return result;
+}
+
+// The slow path of an intrinsic, counted so that the fast paths can be
+// seen to run
+static cell jit_call_builtin(jit_frame* fr, cell fn, long argc, cell* rev_argv) {
+    current_vm->jit_slow_paths++;
+    return jit_call(fr, fn, argc, rev_argv);
+}
+
+// Like jit_call, for a call in tail position
+static int jit_tail_call(jit_frame* fr, cell fn, long argc, cell* rev_argv) {
+    cell argv[argc ? argc : 1];
+    long i;
+    for (i = 0; i < argc; i++) argv[i] = rev_argv[argc - 1 - i];
+    if (TYPE(fn) == NATIVE_FN_V) {
+        fr->result = FN_V_PTR(fn)(argc, argv);
+        return JIT_VALUE;
+    }
+    if (TYPE(fn) == FN && ready(fn, argc)) {
+        fr->next = fn;
+        memcpy(fr->next_args, argv, argc * sizeof(cell));
+        return JIT_TAIL_CALL;
+    }
+    cell args = list_args(argc, argv);
+    if (TYPE(fn) == FN) {
+        // Bind the arguments here rather than in apply, which could
+        // run compiled code in a nested frame
+        fn_t* l = (fn_t*) PTR(fn);
+        fr->env = concat(bind_args(l, args), l->env);
+        fr->result = l->body;
+        return JIT_SLIDE;
+    }
+    cell env = TYPE(fn) == NATIVE_FN ? jit_env(fr) : NIL;
+    fr->result = args;
+    if (!apply(fn, &fr->result, &env)) return JIT_VALUE;
+    fr->env = env;
+    return JIT_SLIDE;
+}
+
+static jit_op intrinsic_op(cell fn) {
+    if (fn == CAST(if_fn, NATIVE_FN_TCO)) return OP_IF;
+    if (fn == CAST(quote, NATIVE_MACRO)) return OP_QUOTE;
+    if (fn == CAST(car_fn, NATIVE_FN_V)) return OP_CAR;
+    if (fn == CAST(cdr_fn, NATIVE_FN_V)) return OP_CDR;
+    if (fn == CAST(equal_fn, NATIVE_FN_V)) return OP_EQUAL;
+    cell i;
+    for (i = current_vm->jit_intrinsics; i; i = cdr(i))
+        if (car(car(i)) == fn) return (jit_op) INT_VAL(cdr(car(i)));
+    return OP_NONE;
+}
+
+// Register a function defined in a module as having a fast path
+// jit-intrinsic sum 'sum
+cell jit_intrinsic(cell args, cell env) {
+    if (!args || !IS_PAIR(cdr(args)) || TYPE(car(cdr(args))) != SYMBOL) return NIL;
+    char* name = SYM_STR(car(cdr(args)));
+    jit_op op = OP_NONE;
+    if (!strcmp(name, "sum")) op = OP_SUM;
+    if (!strcmp(name, "asc")) op = OP_ASC;
+    if (!op) return NIL;
+    current_vm->jit_intrinsics = cons(cons(car(args), make_int(op)), current_vm->jit_intrinsics);
+    return car(args);
+}
+
+static int param_index(jit_state* s, cell c) {
+    cell p = s->params;
+    int i;
+    for (i = 0; IS_PAIR(p); p = cdr(p), i++)
+        if (car(p) == c) return i;
+    return -1;
+}
+
+static int list_length(cell l) {
+    int n = 0;
+    for (; IS_PAIR(l); l = cdr(l)) n++;
+    return l ? -1 : n;
+}
+
+static void compile(jit_state* s, cell c, bool tail);
+
+// Evaluate c with the interpreter, or slide into it in tail position
+static void compile_generic(jit_state* s, cell c, bool tail) {
+    EMIT(s, 0x48, 0x89, 0xdf);  // mov rdi, rbx
+    mov_imm(s, RSI, c);
+    if (!tail) {
+        call(s, jit_eval);
+        return;
+    }
+    call(s, jit_slide);
+    leave(s);
+}
+
+static void compile_symbol(jit_state* s, cell c) {
+    int i = param_index(s, c);
+    if (i >= 0) {
+        // mov rax, [r12 + 8 * i]
+        unsigned char op[] = {0x49, 0x8b, 0x44, 0x24, 8 * i};
+        emit(s, op, 5);
+        return;
+    }
+    // A symbol like lib.fn may refer to a parameter named lib
+    if (strchr(SYM_STR(c), '.')) {
+        compile_generic(s, c, false);
+        return;
+    }
+    for (i = 0; i < s->nsites; i++)
+        if (s->syms[i] == c) break;
+    if (i == s->nsites) {
+        if (s->nsites == JIT_MAX_SITES) {
+            s->failed = true;
+            return;
+        }
+        s->syms[s->nsites++] = c;
+    }
+    // Use the cached value if nothing has been defined since it was cached
+    EMIT(s, 0x49, 0x8b, 0x85);  // mov rax, [r13 + 16 * i]
+    emit4(s, 16 * i);
+    mov_imm(s, RCX, (uint64_t) &current_vm->def_epoch);
+    EMIT(s, 0x48, 0x3b, 0x01);  // cmp rax, [rcx]
+    size_t miss = jump(s, JNE);
+    EMIT(s, 0x49, 0x8b, 0x85);  // mov rax, [r13 + 16 * i + 8]
+    emit4(s, 16 * i + 8);
+    size_t done = jump(s, 0);
+    patch(s, miss);
+    EMIT(s, 0x48, 0x89, 0xdf);  // mov rdi, rbx
+    mov_imm(s, RSI, i);
+    call(s, jit_lookup_site);
+    patch(s, done);
+}
+
+// if predicate then else...
+static void compile_if(jit_state* s, cell args, bool tail) {
+    compile(s, car(args), false);
+    // Return nil if there was no "then" branch
+    if (!IS_PAIR(cdr(args))) {
+        EMIT(s, 0x31, 0xc0);
+        if (tail) return_value(s);
+        return;
+    }
+    EMIT(s, 0x48, 0x85, 0xc0);  // test rax, rax
+    size_t otherwise = jump(s, JE);
+    compile(s, car(cdr(args)), tail);
+    size_t done = tail ? 0 : jump(s, 0);
+    patch(s, otherwise);
+    if (!IS_PAIR(cddr(args))) {
+        // The predicate was false but no "else" branch was provided
+        EMIT(s, 0x31, 0xc0);
+        if (tail) return_value(s);
+    }
+    else compile(s, cdddr(args) ? cddr(args) : cddar(args), tail);
+    if (!tail) patch(s, done);
+}
+
+// Pass the pushed function and arguments to a C helper
+static void call_helper(jit_state* s, int argc, void* helper) {
+    EMIT(s, 0x48, 0x89, 0xdf);  // mov rdi, rbx
+    load_stack(s, RSI, argc);
+    mov_imm(s, RDX, argc);
+    EMIT(s, 0x48, 0x89, 0xe1);  // mov rcx, rsp
+    call(s, helper);
+}
+
+// Fast paths for intrinsics, with the function and its arguments pushed
+static void compile_intrinsic(jit_state* s, jit_op op) {
+    size_t slow[2], done[3];
+    int nslow = 0, ndone = 0;
+    switch (op) {
+        case OP_CAR:
+        case OP_CDR: {
+            load_stack(s, RAX, 0);
+            check_type(s, RAX, PAIR);
+            size_t compact = jump(s, JNE);
+            mov_imm(s, RCX, 0xffffffffffff);
+            EMIT(s, 0x48, 0x21, 0xc8);  // and rax, rcx
+            if (op == OP_CAR) EMIT(s, 0x48, 0x8b, 0x00);  // mov rax, [rax]
+            else EMIT(s, 0x48, 0x8b, 0x40, 0x08);         // mov rax, [rax + 8]
+            done[ndone++] = jump(s, 0);
+            // Compact pairs have the types from COMPACT up. Anything else
+            // goes to the builtin
+            patch(s, compact);
+            EMIT(s, 0x81, 0xea);  // sub edx, COMPACT >> 48
+            emit4(s, COMPACT >> 48);
+            EMIT(s, 0x81, 0xfa);  // cmp edx, COMPACT_RUN
+            emit4(s, COMPACT_RUN);
+            slow[nslow++] = jump(s, JAE);
+            if (op == OP_CAR) {
+                mov_imm(s, RCX, 0xffffffffffff);
+                EMIT(s, 0x48, 0x21, 0xc8);  // and rax, rcx
+                EMIT(s, 0x48, 0x8b, 0x00);  // mov rax, [rax]
+                done[ndone++] = jump(s, 0);
+                break;
+            }
+            // The cdr is the next cell, an ordinary pair if it ends the run
+            EMIT(s, 0x83, 0xfa, 0x01);  // cmp edx, 1
+            size_t more = jump(s, JNE);
+            mov_imm(s, RCX, 0xffffffffffff);
+            EMIT(s, 0x48, 0x21, 0xc8);  // and rax, rcx
+            mov_imm(s, RCX, PAIR + 8);
+            EMIT(s, 0x48, 0x01, 0xc8);  // add rax, rcx
+            done[ndone++] = jump(s, 0);
+            patch(s, more);
+            mov_imm(s, RCX, 8 - (1ULL << 48));
+            EMIT(s, 0x48, 0x01, 0xc8);  // add rax, rcx
+            done[ndone++] = jump(s, 0);
+            break;
+        }
+        case OP_EQUAL:
+            load_stack(s, RAX, 1);
+            load_stack(s, RCX, 0);
+            EMIT(s, 0x48, 0x39, 0xc8);  // cmp rax, rcx
+            done[ndone++] = jump(s, JE);
+            // Distinct fixnums are never equal
+            check_type(s, RAX, S32);
+            slow[nslow++] = jump(s, JNE);
+            check_type(s, RCX, S32);
+            slow[nslow++] = jump(s, JNE);
+            EMIT(s, 0x31, 0xc0);
+            done[ndone++] = jump(s, 0);
+            break;
+        case OP_SUM:
+        case OP_ASC:
+            load_stack(s, RAX, 1);
+            load_stack(s, RCX, 0);
+            check_type(s, RAX, S32);
+            slow[nslow++] = jump(s, JNE);
+            check_type(s, RCX, S32);
+            slow[nslow++] = jump(s, JNE);
+            EMIT(s, 0x48, 0x63, 0xc0);  // movsxd rax, eax
+            EMIT(s, 0x48, 0x63, 0xc9);  // movsxd rcx, ecx
+            if (op == OP_ASC) {
+                EMIT(s, 0x48, 0x39, 0xc8);  // cmp rax, rcx
+                size_t not_asc = jump(s, JGE);
+                load_stack(s, RAX, 1);
+                done[ndone++] = jump(s, 0);
+                patch(s, not_asc);
+                EMIT(s, 0x31, 0xc0);
+                done[ndone++] = jump(s, 0);
+                break;
+            }
+            EMIT(s, 0x48, 0x01, 0xc8);  // add rax, rcx
+            EMIT(s, 0x48, 0x63, 0xd0);  // movsxd rdx, eax
+            EMIT(s, 0x48, 0x39, 0xc2);  // cmp rdx, rax
+            size_t big = jump(s, JNE);
+            mov_imm(s, RCX, 0xffffffffffff);
+            EMIT(s, 0x48, 0x21, 0xc8);  // and rax, rcx
+            mov_imm(s, RCX, S32);
+            EMIT(s, 0x48, 0x09, 0xc8);  // or rax, rcx
+            done[ndone++] = jump(s, 0);
+            patch(s, big);
+            EMIT(s, 0x48, 0x89, 0xc7);  // mov rdi, rax
+            call(s, make_int);
+            done[ndone++] = jump(s, 0);
+            break;
+        default:
+            break;
+    }
+    // Anything other than fixnums and pairs goes to the builtin itself
+    int i;
+    for (i = 0; i < nslow; i++) patch(s, slow[i]);
+    if (nslow) call_helper(s, op == OP_CAR || op == OP_CDR ? 1 : 2, jit_call_builtin);
+    for (i = 0; i < ndone; i++) patch(s, done[i]);
+}
+
+static void compile_call(jit_state* s, cell c, bool tail) {
+    cell head = car(c);
+    cell args = cdr(c);
+    int argc = list_length(args);
+    int depth = s->depth;
+
+    // Decide which fast path to use from what the head refers to now
+    cell expected = NIL;
+    jit_op op = OP_NONE;
+    if (param_index(s, head) < 0) {
+        expected = lookup(head, s->closure_env);
+        op = intrinsic_op(expected);
+    }
+    if ((op == OP_CAR || op == OP_CDR) && argc != 1) op = OP_NONE;
+    if ((op == OP_EQUAL || op == OP_SUM || op == OP_ASC) && argc != 2) op = OP_NONE;
+    if (op == OP_IF && argc < 1) op = OP_NONE;
+
+    compile_symbol(s, head);
+    size_t generic[4];
+    int ngeneric = 0;
+    if (op != OP_NONE) {
+        // Make sure the symbol still refers to the builtin
+        mov_imm(s, RCX, expected);
+        EMIT(s, 0x48, 0x39, 0xc8);  // cmp rax, rcx
+        generic[ngeneric++] = jump(s, JNE);
+    }
+    if (op == OP_IF) {
+        compile_if(s, args, tail);
+    }
+    else if (op == OP_QUOTE) {
+        mov_imm(s, RAX, argc ? car(args) : NIL);
+        if (tail) return_value(s);
+    }
+    else {
+        if (op == OP_NONE) {
+            // Other callables which take evaluated arguments
+            size_t ok[3];
+            check_type(s, RAX, FN);
+            ok[0] = jump(s, JE);
+            EMIT(s, 0x83, 0xfa, NATIVE_FN_V >> 48);
+            ok[1] = jump(s, JE);
+            EMIT(s, 0x83, 0xfa, NATIVE_FN >> 48);
+            ok[2] = jump(s, JE);
+            EMIT(s, 0x83, 0xfa, FFI_FN >> 48);
+            generic[ngeneric++] = jump(s, JNE);
+            patch(s, ok[0]);
+            patch(s, ok[1]);
+            patch(s, ok[2]);
+        }
+        push_rax(s);
+        cell a;
+        for (a = args; a; a = cdr(a)) {
+            compile(s, car(a), false);
+            push_rax(s);
+        }
+        if (op != OP_NONE) {
+            compile_intrinsic(s, op);
+            drop(s, argc + 1);
+            s->depth -= argc + 1;
+            if (tail) return_value(s);
+        }
+        else if (tail) {
+            if (argc == s->nparams) {
+                // A call to ourselves becomes a jump back to the start
+                load_stack(s, RAX, argc);
+                EMIT(s, 0x48, 0x3b, 0x83);  // cmp rax, [rbx + self]
+                emit4(s, offsetof(jit_frame, self));
+                size_t other = jump(s, JNE);
+                int i;
+                for (i = argc - 1; i >= 0; i--) {
+                    // pop rax; mov [r12 + 8 * i], rax
+                    unsigned char op[] = {0x58, 0x49, 0x89, 0x44, 0x24, 8 * i};
+                    emit(s, op, 6);
+                }
+                drop(s, 1);
+                EMIT(s, 0x48, 0xc7, 0x83);  // mov qword [rbx + env], 0
+                emit4(s, offsetof(jit_frame, env));
+                emit4(s, 0);
+                size_t loop = jump(s, 0);
+                int rel = s->body_start - s->len;
+                memcpy(s->buf + loop, &rel, 4);
+                patch(s, other);
+            }
+            call_helper(s, argc, jit_tail_call);
+            leave(s);
+        }
+        else {
+            call_helper(s, argc, jit_call);
+            drop(s, argc + 1);
+        }
+        s->depth = depth;
+    }
+    if (!ngeneric) return;
+    size_t done = tail ? 0 : jump(s, 0);
+    int i;
+    for (i = 0; i < ngeneric; i++) patch(s, generic[i]);
+    compile_generic(s, c, tail);
+    if (!tail) patch(s, done);
+}
+
+// Compile c, leaving its value in rax, or returning from the code if tail
+static void compile(jit_state* s, cell c, bool tail) {
+    if (s->failed || ++s->nesting > JIT_MAX_NESTING) {
+        s->failed = true;
+        return;
+    }
+    if (IS_PAIR(c) && car(c) && !cdr(c)) {
+        // (x) -> eval x
+        compile(s, car(c), tail);
+    }
+    else if (IS_PAIR(c)) {
+        cell head = car(c);
+        if (TYPE(head) == SYMBOL && !strchr(SYM_STR(head), '.') && list_length(cdr(c)) >= 0)
+            compile_call(s, c, tail);
+        else
+            compile_generic(s, c, tail);
+    }
+    else {
+        if (TYPE(c) == SYMBOL) compile_symbol(s, c);
+        else mov_imm(s, RAX, c);
+        if (tail) return_value(s);
+    }
+    s->nesting--;
+}
+
+static jit_code* compile_fn(fn_t* l) {
+    jit_state s;
+    memset(&s, 0, sizeof(s));
+    s.params = l->args;
+    s.closure_env = l->env;
+
+    // Only plain lists of distinct symbols are supported as parameters
+    cell p;
+    for (p = l->args; IS_PAIR(p); p = cdr(p)) {
+        if (TYPE(car(p)) != SYMBOL || param_index(&s, car(p)) < s.nparams) return NULL;
+        s.nparams++;
+    }
+    if (p || s.nparams > JIT_MAX_ARGS) return NULL;
+
+    s.max_len = 256;
+    s.buf = GC_MALLOC(s.max_len);
+    s.syms = GC_MALLOC(JIT_MAX_SITES * sizeof(cell));
+
+    EMIT(&s, 0x53, 0x41, 0x54, 0x41, 0x55);  // push rbx; push r12; push r13
+    EMIT(&s, 0x48, 0x89, 0xfb);              // mov rbx, rdi
+    EMIT(&s, 0x4c, 0x8b, 0x63, offsetof(jit_frame, argv));   // mov r12, [rbx + argv]
+    EMIT(&s, 0x4c, 0x8b, 0x6b, offsetof(jit_frame, sites));  // mov r13, [rbx + sites]
+    s.body_start = s.len;
+    compile(&s, l->body, true);
+    if (s.failed) return NULL;
+
+    size_t size = (s.len + 4095) & ~4095;
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return NULL;
+    memcpy(mem, s.buf, s.len);
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC)) {
+        munmap(mem, size);
+        return NULL;
+    }
+
+    jit_code* code = malloc_or_die(sizeof(jit_code));
+    code->entry = mem;
+    code->size = size;
+    code->body = l->body;
+    code->nparams = s.nparams;
+    code->nsites = s.nsites;
+    code->syms = s.syms;
+    DPRINTF("JIT compiled %s into %zu bytes\n", print_cell(l->body), s.len);
+    return code;
+}
+
+// Count an application of fn, compiling it once it becomes hot
+// Returns true if fn has compiled code taking argc arguments
+static bool ready(cell fn, int argc) {
+    fn_t* l = (fn_t*) PTR(fn);
+    if (!l->jit) {
+        if (++l->calls < JIT_THRESHOLD) return false;
+        cell i;
+        for (i = current_vm->jit_compiled; i; i = cdr(i))
+            if (car(car(i)) == l->body) break;
+        jit_code* code;
+        if (i) code = (jit_code*) cdr(car(i));
+        else {
+            code = compile_fn(l);
+            if (!code) code = &failed;
+            current_vm->jit_compiled = cons(cons(l->body, (cell) code), current_vm->jit_compiled);
+        }
+        if (code != &failed)
+            l->sites = malloc_or_die((code->nsites + 1) * 2 * sizeof(cell));
+        l->jit = code;
+    }
+    return l->jit != &failed && argc == ((jit_code*) l->jit)->nparams;
+}
+
+bool jit_ready(cell fn, cell args) {
+    int argc = list_length(args);
+    return argc >= 0 && ready(fn, argc);
+}
+
+bool jit_ready_v(cell fn, int argc) {
+    return ready(fn, argc);
+}
+
+// Apply a compiled lambda to a vector of arguments, with the same result
+// as apply: true if *args is left to be evaluated in *env
+bool jit_apply_v(cell fn, cell* argv, cell* args, cell* env) {
+    cell result, new_env;
+    int outcome = run(fn, argv, &result, &new_env);
+    *args = result;
+    if (outcome != JIT_SLIDE) return false;
+    *env = new_env;
+    return true;
+}
+
+// Apply a compiled lambda on behalf of apply
+bool jit_apply(cell fn, cell* args, cell* env) {
+    cell argv[JIT_MAX_ARGS];
+    int i = 0;
+    cell a;
+    for (a = *args; IS_PAIR(a); a = cdr(a)) argv[i++] = car(a);
+    return jit_apply_v(fn, argv, args, env);
+}
+
+// Unmap the code compiled in a vm which is being freed
+void jit_free(crisp_vm* vm) {
+    cell i;
+    for (i = vm->jit_compiled; i; i = cdr(i)) {
+        jit_code* code = (jit_code*) cdr(car(i));
+        if (code == &failed) continue;
+        munmap(code->entry, code->size);
+    }
+    vm->jit_compiled = NIL;
+}
+
+// jit-stats () -> (true 12 3), whether the jit is enabled, the number of
+// lambdas compiled, and the applications of intrinsics which missed their
+// fast paths
+cell jit_stats(int argc, cell* argv) {
+    int64_t compiled = 0;
+    cell i;
+    for (i = current_vm->jit_compiled; i; i = cdr(i))
+        if ((jit_code*) cdr(car(i)) != &failed) compiled++;
+    return cons(current_vm->jit_enabled ? sym("true") : NIL,
+                LIST2(make_int(compiled), make_int(current_vm->jit_slow_paths)));
+}
+
+#else
+
+bool jit_ready(cell fn, cell args) {
+    return false;
+}
+
+bool jit_ready_v(cell fn, int argc) {
+    return false;
+}
+
+bool jit_apply_v(cell fn, cell* argv, cell* args, cell* env) {
+    return false;
+}
+
+bool jit_apply(cell fn, cell* args, cell* env) {
+    return false;
+}
+
+void jit_free(crisp_vm* vm) {
+}
+
+cell jit_intrinsic(cell args, cell env) {
+    return NIL;
+}
+
+cell jit_stats(int argc, cell* argv) {
+    return cons(NIL, LIST2(make_int(0), make_int(0)));
+}
+
+#endif
@@ -0,0 +1,337 @@
+#include <crisp.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// This is a type code which will be filled in when imported
+uint64_t BITVEC;
+
+// A bit vector is packed into 64 bit words, bit i being bit i % 64 of word
+// i / 64. Rank uses a two level directory: the number of ones before each
+// superblock of 512 bits, and the number of ones before each word within
+// its superblock. Select samples the position of every 512th one; a sample
+// whose ones are spread over many superblocks stores all of their positions
+// instead, so the binary search between samples covers a bounded range.
+// With both, rank, select and get are constant time.
+
+#define WORD_BITS 64
+#define SUPER_WORDS 8
+#define SUPER_BITS (WORD_BITS * SUPER_WORDS)
+#define SELECT_SAMPLE 512
+// Samples spanning more bits than this keep every position
+#define SELECT_SPARSE (1 << 17)
+
+typedef struct {
+    uint64_t* words;
+    size_t len;
+    size_t ones;
+    // super[s] is the number of ones before superblock s
+    uint64_t* super;
+    // block[w] is the number of ones in the superblock of w before word w
+    uint16_t* block;
+    // sample[j] is the superblock holding the (j * SELECT_SAMPLE)th one
+    size_t* sample;
+    // sparse[j] is NULL, or the positions of the ones of sample j
+    uint64_t** sparse;
+    size_t samples;
+} bitvec;
+
+// Counting ones and finding the kth one in a word are plain C here, and use
+// popcnt, pdep and tzcnt instead if the CPU has them. The kernels built on
+// them have both versions, chosen when the module is loaded
+static inline unsigned popcount_c(uint64_t w) {
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (w * 0x0101010101010101ULL) >> 56;
+}
+
+// The position of the kth one in w, which must have more than k ones
+static inline unsigned select_in_word_c(uint64_t w, unsigned k) {
+    // Skip whole bytes, then clear the ones below the kth in the last
+    unsigned shift = 0;
+    unsigned c;
+    while (k >= (c = popcount_c(w & 0xff))) {
+        k -= c;
+        w >>= 8;
+        shift += 8;
+    }
+    while (k--) w &= w - 1;
+    return shift + __builtin_ctzll(w);
+}
+
+static bitvec* bitvec_alloc(size_t len) {
+    bitvec* bv = malloc_or_die(sizeof(bitvec));
+    bv->len = len;
+    bv->ones = 0;
+    size_t words = (len + WORD_BITS - 1) / WORD_BITS;
+    // Round up to whole superblocks so the directory needs no bounds checks
+    size_t supers = words / SUPER_WORDS + 1;
+    bv->words = GC_MALLOC_ATOMIC(supers * SUPER_WORDS * sizeof(uint64_t));
+    bv->super = GC_MALLOC_ATOMIC((supers + 1) * sizeof(uint64_t));
+    bv->block = GC_MALLOC_ATOMIC(supers * SUPER_WORDS * sizeof(uint16_t));
+    if (!bv->words || !bv->super || !bv->block) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    memset(bv->words, 0, supers * SUPER_WORDS * sizeof(uint64_t));
+    return bv;
+}
+
+static inline size_t superblocks(bitvec* bv) {
+    return (bv->len + WORD_BITS - 1) / WORD_BITS / SUPER_WORDS + 1;
+}
+
+// The position of the kth one, found from the words alone, starting at
+// word w with before ones in the words preceding it
+static size_t scan_select_c(bitvec* bv, size_t w, size_t before, size_t k) {
+    while (1) {
+        unsigned c = popcount_c(bv->words[w]);
+        if (before + c > k) return w * WORD_BITS + select_in_word_c(bv->words[w], k - before);
+        before += c;
+        w++;
+    }
+}
+
+// Fill in the counts of ones before each word within its superblock, and
+// return the number of ones in the superblock
+static uint64_t count_block_c(bitvec* bv, size_t s) {
+    uint16_t in_super = 0;
+    size_t w;
+    for (w = s * SUPER_WORDS; w < (s + 1) * SUPER_WORDS; w++) {
+        bv->block[w] = in_super;
+        in_super += popcount_c(bv->words[w]);
+    }
+    return in_super;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HW __attribute__((target("popcnt,bmi,bmi2")))
+
+static HW inline unsigned popcount_hw(uint64_t w) {
+    return __builtin_popcountll(w);
+}
+
+static HW inline unsigned select_in_word_hw(uint64_t w, unsigned k) {
+    return __builtin_ctzll(_pdep_u64(1ULL << k, w));
+}
+
+static HW size_t scan_select_hw(bitvec* bv, size_t w, size_t before, size_t k) {
+    while (1) {
+        unsigned c = popcount_hw(bv->words[w]);
+        if (before + c > k) return w * WORD_BITS + select_in_word_hw(bv->words[w], k - before);
+        before += c;
+        w++;
+    }
+}
+
+static HW uint64_t count_block_hw(bitvec* bv, size_t s) {
+    uint16_t in_super = 0;
+    size_t w;
+    for (w = s * SUPER_WORDS; w < (s + 1) * SUPER_WORDS; w++) {
+        bv->block[w] = in_super;
+        in_super += popcount_hw(bv->words[w]);
+    }
+    return in_super;
+}
+
+static bool hw;
+
+__attribute__((constructor)) static void detect_hw(void) {
+    // This may run before libgcc has looked at the CPU itself
+    __builtin_cpu_init();
+    hw = __builtin_cpu_supports("popcnt") &&
+         __builtin_cpu_supports("bmi") &&
+         __builtin_cpu_supports("bmi2");
+}
+
+#define DISPATCH(kernel, ...) (hw ? kernel##_hw(__VA_ARGS__) : kernel##_c(__VA_ARGS__))
+#else
+#define DISPATCH(kernel, ...) kernel##_c(__VA_ARGS__)
+#endif
+
+// Fill in the rank directory and select samples once the words are set
+static cell bitvec_finish(bitvec* bv) {
+    size_t supers = superblocks(bv);
+    size_t s, w;
+    uint64_t ones = 0;
+    for (s = 0; s < supers; s++) {
+        bv->super[s] = ones;
+        ones += DISPATCH(count_block, bv, s);
+    }
+    bv->super[supers] = bv->ones = ones;
+
+    bv->samples = (ones + SELECT_SAMPLE - 1) / SELECT_SAMPLE;
+    bv->sample = GC_MALLOC_ATOMIC((bv->samples + 1) * sizeof(size_t));
+    bv->sparse = malloc_or_die((bv->samples + 1) * sizeof(uint64_t*));
+    if (!bv->sample) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    size_t j;
+    size_t prev = 0;
+    for (j = 0; j < bv->samples; j++) {
+        size_t k = j * SELECT_SAMPLE;
+        // Each sample starts from the last, so this pass is linear overall
+        s = prev;
+        while (bv->super[s + 1] <= k) s++;
+        bv->sample[j] = prev = s;
+        bv->sparse[j] = NULL;
+    }
+    bv->sample[bv->samples] = supers - 1;
+    bv->sparse[bv->samples] = NULL;
+
+    for (j = 0; j < bv->samples; j++) {
+        if ((bv->sample[j + 1] - bv->sample[j] + 1) * SUPER_BITS <= SELECT_SPARSE) continue;
+        size_t first = j * SELECT_SAMPLE;
+        size_t n = ones - first < SELECT_SAMPLE ? ones - first : SELECT_SAMPLE;
+        uint64_t* positions = GC_MALLOC_ATOMIC(n * sizeof(uint64_t));
+        if (!positions) {
+            puts("malloc failed");
+            exit(-1);
+        }
+        size_t pos = DISPATCH(scan_select, bv, bv->sample[j] * SUPER_WORDS, bv->super[bv->sample[j]], first);
+        size_t i;
+        for (i = 0; i < n; i++) {
+            positions[i] = pos;
+            if (i + 1 == n) break;
+            // Move to the next one, skipping empty words
+            w = pos / WORD_BITS;
+            uint64_t rest = bv->words[w] & (~1ULL << (pos % WORD_BITS));
+            while (!rest) rest = bv->words[++w];
+            pos = w * WORD_BITS + __builtin_ctzll(rest);
+        }
+        bv->sparse[j] = positions;
+    }
+    return CAST(bv, BITVEC);
+}
+
+static inline bool is_one(cell c) {
+    return c && !(IS_INT(c) && INT_VAL(c) == 0);
+}
+
+cell bitvec_from_list(int argc, cell* argv) {
+    // bitvec.from-list (1 0 1 1) -> BITVEC<...>
+    // Zeros and nils are 0 bits, anything else is a 1
+    if (!argc || (argv[0] && !IS_PAIR(argv[0]))) return NIL;
+    size_t len = 0;
+    cell l;
+    for (l = argv[0]; IS_PAIR(l); l = cdr(l)) len++;
+    bitvec* bv = bitvec_alloc(len);
+    size_t i = 0;
+    for (l = argv[0]; IS_PAIR(l); l = cdr(l), i++)
+        if (is_one(car(l))) bv->words[i / WORD_BITS] |= 1ULL << (i % WORD_BITS);
+    return bitvec_finish(bv);
+}
+
+cell bitvec_from_bytes(int argc, cell* argv) {
+    // bitvec.from-bytes text -> BITVEC<...>, with bit i taken from bit
+    // i % 8 of byte i / 8
+    // bitvec.from-bytes "AB" 12 -> only the first 12 bits
+    // Text ends at its first NUL byte; a list of byte values may contain zeros
+    if (!argc) return NIL;
+    size_t n = 0;
+    const unsigned char* text = NULL;
+    cell l;
+    if (TYPE(argv[0]) == SYMBOL) {
+        text = (const unsigned char*) SYM_STR(argv[0]);
+        n = strlen((const char*) text);
+    } else if (IS_INT(argv[0])) {
+        // A one character string literal evaluates to its character code
+        argv[0] = LIST1(argv[0]);
+    } else if (argv[0] && !IS_PAIR(argv[0])) {
+        return NIL;
+    }
+    if (!text)
+        for (l = argv[0]; IS_PAIR(l); l = cdr(l)) n++;
+    size_t len = n * 8;
+    if (argc > 1 && IS_INT(argv[1]) && INT_VAL(argv[1]) >= 0 && (size_t) INT_VAL(argv[1]) < len)
+        len = INT_VAL(argv[1]);
+
+    bitvec* bv = bitvec_alloc(len);
+    unsigned char* bytes = (unsigned char*) bv->words;
+    size_t used = (len + 7) / 8;
+    size_t i;
+    if (text) {
+        memcpy(bytes, text, used);
+    } else {
+        for (i = 0, l = argv[0]; i < used; i++, l = cdr(l))
+            bytes[i] = IS_INT(car(l)) ? INT_VAL(car(l)) : 0;
+    }
+    // Words are little endian, matching the bit numbering, on the hosts we
+    // support; clear any bits past the end of the vector
+    if (len % 8) bytes[used - 1] &= (1 << (len % 8)) - 1;
+    return bitvec_finish(bv);
+}
+
+cell bitvec_to_list(int argc, cell* argv) {
+    // bitvec.to-list (bitvec.from-list (1 0 1)) -> 1 0 1
+    if (!argc || TYPE(argv[0]) != BITVEC) return NIL;
+    bitvec* bv = PTR(argv[0]);
+    cell rv = NIL;
+    size_t i = bv->len;
+    while (i--) rv = cons(make_int((bv->words[i / WORD_BITS] >> (i % WORD_BITS)) & 1), rv);
+    return rv;
+}
+
+cell bitvec_len(int argc, cell* argv) {
+    // bitvec.len bv -> the number of bits
+    if (!argc || TYPE(argv[0]) != BITVEC) return NIL;
+    return make_int(((bitvec*) PTR(argv[0]))->len);
+}
+
+cell bitvec_count(int argc, cell* argv) {
+    // bitvec.count bv -> the number of ones
+    if (!argc || TYPE(argv[0]) != BITVEC) return NIL;
+    return make_int(((bitvec*) PTR(argv[0]))->ones);
+}
+
+cell bitvec_get(int argc, cell* argv) {
+    // bitvec.get (bitvec.from-list (1 0 1)) 2 -> 1
+    // Returns nil outside of the vector
+    if (argc < 2 || TYPE(argv[0]) != BITVEC || !IS_INT(argv[1])) return NIL;
+    bitvec* bv = PTR(argv[0]);
+    int64_t i = INT_VAL(argv[1]);
+    if (i < 0 || (size_t) i >= bv->len) return NIL;
+    return make_int((bv->words[i / WORD_BITS] >> (i % WORD_BITS)) & 1);
+}
+
+cell bitvec_rank(int argc, cell* argv) {
+    // bitvec.rank (bitvec.from-list (1 0 1 1)) 3 -> 2, the ones before bit 3
+    // Indices past the end count every one
+    if (argc < 2 || TYPE(argv[0]) != BITVEC || !IS_INT(argv[1])) return NIL;
+    bitvec* bv = PTR(argv[0]);
+    int64_t i = INT_VAL(argv[1]);
+    if (i <= 0) return make_int(0);
+    if ((size_t) i >= bv->len) return make_int(bv->ones);
+    size_t w = i / WORD_BITS;
+    uint64_t below = bv->words[w] & ((1ULL << (i % WORD_BITS)) - 1);
+    return make_int(bv->super[w / SUPER_WORDS] + bv->block[w] + DISPATCH(popcount, below));
+}
+
+cell bitvec_select(int argc, cell* argv) {
+    // bitvec.select (bitvec.from-list (1 0 1 1)) 1 -> 2, the position of
+    // the one with rank 1
+    // Returns nil if there are too few ones
+    if (argc < 2 || TYPE(argv[0]) != BITVEC || !IS_INT(argv[1])) return NIL;
+    bitvec* bv = PTR(argv[0]);
+    int64_t k = INT_VAL(argv[1]);
+    if (k < 0 || (size_t) k >= bv->ones) return NIL;
+    size_t j = k / SELECT_SAMPLE;
+    if (bv->sparse[j]) return make_int(bv->sparse[j][k % SELECT_SAMPLE]);
+
+    // Find the last superblock in range with no more than k ones before it
+    size_t lo = bv->sample[j];
+    size_t hi = bv->sample[j + 1];
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (bv->super[mid] <= (uint64_t) k) lo = mid;
+        else hi = mid - 1;
+    }
+    // Then the word within it, of which there are only a few
+    size_t rest = k - bv->super[lo];
+    size_t w = lo * SUPER_WORDS;
+    size_t end = w + SUPER_WORDS;
+    while (w + 1 < end && bv->block[w + 1] <= rest) w++;
+    return make_int(w * WORD_BITS + DISPATCH(select_in_word, bv->words[w], rest - bv->block[w]));
+}
@@ -0,0 +1,330 @@
+#include <crisp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// This is a type code which will be filled in when imported
+uint64_t EVENT_LOOP;
+
+// The most events handled per call to epoll_wait
+#define EVENT_BATCH 64
+
+// The most bytes returned by a single event.read
+#define EVENT_READ_MAX 65536
+
+// An event loop multiplexes any number of non-blocking descriptors with epoll
+// Each watched descriptor has a callback, applied to the descriptor and a
+// list of the conditions which are ready, such as (read) or (read hangup)
+
+typedef struct {
+    int epfd;
+    // Callbacks indexed by descriptor, or NIL if not watched
+    cell* callbacks;
+    // Whether each descriptor is a timer or notifier
+    bool* counters;
+    int max_fd;
+    int watched;
+    bool stopped;
+} event_loop;
+
+#define LOOP_PTR(c) ((event_loop*) PTR(c))
+
+static cell pair_of_fds(int* fds) {
+    return cons(make_int(fds[0]), LIST1(make_int(fds[1])));
+}
+
+// Turn a list of condition names into epoll flags
+static uint32_t parse_conditions(cell c) {
+    uint32_t events = 0;
+    if (!IS_PAIR(c)) c = LIST1(c);
+    for (; IS_PAIR(c); c = cdr(c)) {
+        if (TYPE(car(c)) != SYMBOL) continue;
+        if (!strcmp(SYM_STR(car(c)), "read")) events |= EPOLLIN;
+        if (!strcmp(SYM_STR(car(c)), "write")) events |= EPOLLOUT;
+    }
+    return events;
+}
+
+static cell conditions(uint32_t events) {
+    cell rv = NIL;
+    if (events & EPOLLERR) rv = cons(sym("error"), rv);
+    if (events & (EPOLLHUP | EPOLLRDHUP)) rv = cons(sym("hangup"), rv);
+    if (events & EPOLLOUT) rv = cons(sym("write"), rv);
+    if (events & EPOLLIN) rv = cons(sym("read"), rv);
+    return rv;
+}
+
+static cell call2(cell fn, cell x, cell y) {
+    cell args = cons(x, LIST1(y));
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+// Associate a callback with a descriptor, growing the tables as needed
+static void set_callback(event_loop* loop, int fd, cell callback, bool counter) {
+    if (fd >= loop->max_fd) {
+        int max_fd = loop->max_fd;
+        while (fd >= loop->max_fd) loop->max_fd *= 2;
+        loop->callbacks = GC_REALLOC(loop->callbacks, loop->max_fd * sizeof(cell));
+        loop->counters = GC_REALLOC(loop->counters, loop->max_fd * sizeof(bool));
+        memset(loop->callbacks + max_fd, 0, (loop->max_fd - max_fd) * sizeof(cell));
+        memset(loop->counters + max_fd, 0, (loop->max_fd - max_fd) * sizeof(bool));
+    }
+    loop->callbacks[fd] = callback;
+    loop->counters[fd] = counter;
+}
+
+static bool watch_fd(event_loop* loop, int fd, uint32_t events, cell callback, bool counter) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (fd < 0) return false;
+    bool watched = fd < loop->max_fd && loop->callbacks[fd];
+    if (epoll_ctl(loop->epfd, watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0) return false;
+    if (!watched) loop->watched++;
+    set_callback(loop, fd, callback, counter);
+    return true;
+}
+
+cell event_new(int argc, cell* argv) {
+    // event.new -> EVENT_LOOP<...>
+    event_loop* loop = malloc_or_die(sizeof(event_loop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        GC_FREE(loop);
+        return NIL;
+    }
+    loop->max_fd = 64;
+    loop->callbacks = malloc_or_die(loop->max_fd * sizeof(cell));
+    memset(loop->callbacks, 0, loop->max_fd * sizeof(cell));
+    loop->counters = malloc_or_die(loop->max_fd * sizeof(bool));
+    memset(loop->counters, 0, loop->max_fd * sizeof(bool));
+    loop->watched = 0;
+    loop->stopped = false;
+    return CAST(loop, EVENT_LOOP);
+}
+
+cell event_watch(int argc, cell* argv) {
+    // event.watch loop fd (read write) callback -> fd
+    // Watching a descriptor again replaces its conditions and callback
+    if (argc < 4 || TYPE(argv[0]) != EVENT_LOOP || !IS_INT(argv[1]) || !IS_CALLABLE(argv[3])) return NIL;
+    uint32_t events = parse_conditions(argv[2]);
+    if (!watch_fd(LOOP_PTR(argv[0]), INT_VAL(argv[1]), events, argv[3], false)) return NIL;
+    return argv[1];
+}
+
+cell event_unwatch(int argc, cell* argv) {
+    // event.unwatch loop fd -> fd
+    if (argc < 2 || TYPE(argv[0]) != EVENT_LOOP || !IS_INT(argv[1])) return NIL;
+    event_loop* loop = LOOP_PTR(argv[0]);
+    int fd = INT_VAL(argv[1]);
+    if (fd < 0 || fd >= loop->max_fd || !loop->callbacks[fd]) return NIL;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    loop->callbacks[fd] = NIL;
+    loop->watched--;
+    return argv[1];
+}
+
+cell event_timer(int argc, cell* argv) {
+    // event.timer loop 100 callback -> fd, once after 100ms
+    // event.timer loop 100 callback 50 -> fd, after 100ms then every 50ms
+    // The callback is passed the timer's descriptor and the number of expirations
+    if (argc < 3 || TYPE(argv[0]) != EVENT_LOOP || !IS_INT(argv[1]) || !IS_CALLABLE(argv[2])) return NIL;
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) return NIL;
+    int64_t ms = INT_VAL(argv[1]);
+    int64_t interval = argc > 3 && IS_INT(argv[3]) ? INT_VAL(argv[3]) : 0;
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    // A zero value would disarm the timer, so fire as soon as possible instead
+    spec.it_value.tv_sec = ms / 1000;
+    spec.it_value.tv_nsec = ms > 0 ? ms % 1000 * 1000000 : 1;
+    spec.it_interval.tv_sec = interval / 1000;
+    spec.it_interval.tv_nsec = interval % 1000 * 1000000;
+    if (timerfd_settime(fd, 0, &spec, NULL) < 0 || !watch_fd(LOOP_PTR(argv[0]), fd, EPOLLIN, argv[2], true)) {
+        close(fd);
+        return NIL;
+    }
+    return make_int(fd);
+}
+
+cell event_notifier(int argc, cell* argv) {
+    // event.notifier loop callback -> fd
+    // The callback is passed the descriptor and the number of notifications
+    if (argc < 2 || TYPE(argv[0]) != EVENT_LOOP || !IS_CALLABLE(argv[1])) return NIL;
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) return NIL;
+    if (!watch_fd(LOOP_PTR(argv[0]), fd, EPOLLIN, argv[1], true)) {
+        close(fd);
+        return NIL;
+    }
+    return make_int(fd);
+}
+
+cell event_notify(int argc, cell* argv) {
+    // event.notify fd -> fd
+    if (!argc || !IS_INT(argv[0])) return NIL;
+    uint64_t one = 1;
+    if (write(INT_VAL(argv[0]), &one, sizeof(one)) != sizeof(one)) return NIL;
+    return argv[0];
+}
+
+// Apply the callback for one ready descriptor
+static void dispatch(event_loop* loop, struct epoll_event* ev) {
+    int fd = ev->data.fd;
+    // An earlier callback in the same batch may have unwatched it
+    if (fd >= loop->max_fd || !loop->callbacks[fd]) return;
+    cell ready;
+    if (loop->counters[fd]) {
+        // Reading a timer or notifier returns and resets its count
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) return;
+        ready = make_int(count);
+    }
+    else ready = conditions(ev->events);
+    call2(loop->callbacks[fd], make_int(fd), ready);
+}
+
+cell event_run_once(int argc, cell* argv) {
+    // event.run-once loop -> number of events dispatched
+    // event.run-once loop 100 -> waiting at most 100ms
+    if (!argc || TYPE(argv[0]) != EVENT_LOOP) return NIL;
+    event_loop* loop = LOOP_PTR(argv[0]);
+    int timeout = argc > 1 && IS_INT(argv[1]) ? INT_VAL(argv[1]) : -1;
+    struct epoll_event events[EVENT_BATCH];
+    int n;
+    do n = epoll_wait(loop->epfd, events, EVENT_BATCH, timeout);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) return NIL;
+    int i;
+    for (i = 0; i < n; i++) dispatch(loop, &events[i]);
+    return make_int(n);
+}
+
+cell event_run(int argc, cell* argv) {
+    // event.run loop -> total number of events dispatched
+    // Runs until nothing is watched or event.stop is called
+    if (!argc || TYPE(argv[0]) != EVENT_LOOP) return NIL;
+    event_loop* loop = LOOP_PTR(argv[0]);
+    int64_t total = 0;
+    loop->stopped = false;
+    while (loop->watched && !loop->stopped) {
+        cell n = event_run_once(1, argv);
+        if (!n) break;
+        total += INT_VAL(n);
+    }
+    return make_int(total);
+}
+
+cell event_stop(int argc, cell* argv) {
+    // event.stop loop -> loop
+    if (!argc || TYPE(argv[0]) != EVENT_LOOP) return NIL;
+    LOOP_PTR(argv[0])->stopped = true;
+    return argv[0];
+}
+
+cell event_pipe(int argc, cell* argv) {
+    // event.pipe -> read-fd write-fd
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) return NIL;
+    return pair_of_fds(fds);
+}
+
+cell event_socketpair(int argc, cell* argv) {
+    // event.socketpair -> fd fd
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) < 0) return NIL;
+    return pair_of_fds(fds);
+}
+
+static bool unix_address(cell path, struct sockaddr_un* addr) {
+    if (TYPE(path) != SYMBOL || strlen(SYM_STR(path)) >= sizeof(addr->sun_path)) return false;
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, SYM_STR(path));
+    return true;
+}
+
+cell event_listen(int argc, cell* argv) {
+    // event.listen /tmp/sock -> fd
+    struct sockaddr_un addr;
+    if (!argc || !unix_address(argv[0], &addr)) return NIL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NIL;
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return NIL;
+    }
+    return make_int(fd);
+}
+
+cell event_connect(int argc, cell* argv) {
+    // event.connect /tmp/sock -> fd
+    struct sockaddr_un addr;
+    if (!argc || !unix_address(argv[0], &addr)) return NIL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NIL;
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return NIL;
+    }
+    return make_int(fd);
+}
+
+cell event_accept(int argc, cell* argv) {
+    // event.accept fd -> fd, or nil if no connection is waiting
+    if (!argc || !IS_INT(argv[0])) return NIL;
+    int fd = accept4(INT_VAL(argv[0]), NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    return fd < 0 ? NIL : make_int(fd);
+}
+
+cell event_read(int argc, cell* argv) {
+    // event.read fd -> the data available as text, which isn't interned
+    // event.read fd 10 -> at most 10 bytes
+    // Returns nil if no data is available yet, and 0 at end of file
+    if (!argc || !IS_INT(argv[0])) return NIL;
+    int64_t max = argc > 1 && IS_INT(argv[1]) ? INT_VAL(argv[1]) : EVENT_READ_MAX;
+    if (max <= 0 || max > EVENT_READ_MAX) max = EVENT_READ_MAX;
+    char buf[max];
+    ssize_t n;
+    do n = read(INT_VAL(argv[0]), buf, max);
+    while (n < 0 && errno == EINTR);
+    if (n < 0) return NIL;
+    if (!n) return make_int(0);
+    return text(buf, n);
+}
+
+cell event_write(int argc, cell* argv) {
+    // event.write fd hello -> 5
+    // Returns the number of bytes written, or nil if the write would block
+    if (argc < 2 || !IS_INT(argv[0]) || TYPE(argv[1]) != SYMBOL) return NIL;
+    ssize_t n;
+    do n = write(INT_VAL(argv[0]), SYM_STR(argv[1]), text_len(argv[1]));
+    while (n < 0 && errno == EINTR);
+    return n < 0 ? NIL : make_int(n);
+}
+
+cell event_close(int argc, cell* argv) {
+    // event.close fd -> fd
+    // Closing a descriptor also removes it from any epoll sets, but
+    // event.unwatch should be used first so its loop can stop
+    // event.close loop -> loop, which then watches nothing
+    if (argc && TYPE(argv[0]) == EVENT_LOOP) {
+        event_loop* loop = LOOP_PTR(argv[0]);
+        if (loop->epfd < 0 || close(loop->epfd) < 0) return NIL;
+        loop->epfd = -1;
+        loop->watched = 0;
+        memset(loop->callbacks, 0, loop->max_fd * sizeof(cell));
+        return argv[0];
+    }
+    if (!argc || !IS_INT(argv[0]) || close(INT_VAL(argv[0])) < 0) return NIL;
+    return argv[0];
+}
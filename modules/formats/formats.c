@@ -0,0 +1,695 @@
+#include <crisp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// Readers for CSV and JSON which build cells as they parse. Input comes from
+// text, a path or a file descriptor. A regular file is mapped into memory
+// whole; anything else is read through a buffer, so a stream is parsed as
+// it arrives.
+//
+// Parsing happens a record at a time: a CSV row, or a top-level JSON value.
+// The end of the record is found first, by scanning for the few bytes which
+// matter (quotes, newlines and brackets) 16 or 32 bytes at a time, reading
+// more input if the record runs past the buffer. Then the record, which is
+// now wholly in memory, is turned into cells. The *.each functions pass each
+// record to a function as soon as it's parsed, so a large input is never
+// held in memory all at once.
+//
+// Strings are returned as text, like the io module returns: SYMBOL cells
+// which aren't interned. Numbers are integers where possible, or floats.
+
+#define FORMATS_BUFFER_SIZE (1 << 20)
+// Deeper JSON is rejected rather than risking the C stack
+#define JSON_MAX_DEPTH 4096
+
+// A set of up to 8 bytes to scan for
+typedef struct {
+    int count;
+    char bytes[8];
+    bool member[256];
+} byte_set;
+
+typedef struct {
+    int fd;
+    bool close_fd;
+    char* buf;
+    // Bytes before start have been parsed; positions in a record are
+    // relative to start, since reading more input may move the buffer
+    size_t start;
+    size_t end;
+    size_t size;
+    bool eof;
+    // The length of the mapping if buf was mapped from a file, or 0
+    size_t mapped;
+} source;
+
+// The bytes which end a CSV row or a quoted field, and which matter in JSON
+static byte_set quote_newline, quote_only, string_end, structure, scalar_end;
+
+static cell call(cell fn, cell args) {
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+static byte_set make_set(const char* bytes, int count) {
+    byte_set set = {count};
+    int i;
+    for (i = 0; i < count; i++) {
+        set.bytes[i] = bytes[i];
+        set.member[(unsigned char) bytes[i]] = true;
+    }
+    return set;
+}
+
+// Find the first byte of s which is in set, or n if there is none
+static size_t scan_c(const char* s, size_t n, const byte_set* set) {
+    size_t i;
+    for (i = 0; i < n && !set->member[(unsigned char) s[i]]; i++);
+    return i;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AVX2 __attribute__((target("avx2")))
+
+// SSE2 is part of x86-64, so this needs no check
+static size_t scan_sse2(const char* s, size_t n, const byte_set* set) {
+    __m128i needles[8];
+    int k;
+    for (k = 0; k < set->count; k++) needles[k] = _mm_set1_epi8(set->bytes[k]);
+    size_t i;
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (s + i));
+        __m128i found = _mm_cmpeq_epi8(v, needles[0]);
+        for (k = 1; k < set->count; k++) found = _mm_or_si128(found, _mm_cmpeq_epi8(v, needles[k]));
+        int mask = _mm_movemask_epi8(found);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scan_c(s + i, n - i, set);
+}
+
+static AVX2 size_t scan_avx2(const char* s, size_t n, const byte_set* set) {
+    __m256i needles[8];
+    int k;
+    for (k = 0; k < set->count; k++) needles[k] = _mm256_set1_epi8(set->bytes[k]);
+    size_t i;
+    for (i = 0; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (s + i));
+        __m256i found = _mm256_cmpeq_epi8(v, needles[0]);
+        for (k = 1; k < set->count; k++) found = _mm256_or_si256(found, _mm256_cmpeq_epi8(v, needles[k]));
+        unsigned mask = _mm256_movemask_epi8(found);
+        if (mask) return i + __builtin_ctz(mask);
+    }
+    return i + scan_sse2(s + i, n - i, set);
+}
+
+static bool avx2;
+
+__attribute__((constructor)) static void detect_avx2(void) {
+    // This may run before libgcc has looked at the CPU itself
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+}
+
+#define scan(s, n, set) (avx2 ? scan_avx2(s, n, set) : scan_sse2(s, n, set))
+#else
+#define scan(s, n, set) scan_c(s, n, set)
+#endif
+
+__attribute__((constructor)) static void init_sets(void) {
+    quote_newline = make_set("\"\n", 2);
+    quote_only = make_set("\"", 1);
+    string_end = make_set("\"\\", 2);
+    structure = make_set("\"[]{}", 5);
+    scalar_end = make_set(" \t\r\n,]}", 7);
+}
+
+// Parse s as a number if all of it is one
+static bool number(const char* s, size_t n, cell* rv) {
+    char buf[64];
+    if (!n || n >= sizeof(buf)) return false;
+    memcpy(buf, s, n);
+    buf[n] = '\0';
+    if (strspn(buf, "+-0123456789.eE") < n) return false;
+    if (!isdigit(buf[buf[0] == '-' || buf[0] == '+'])) return false;
+    char* end;
+    errno = 0;
+    long long i = strtoll(buf, &end, 10);
+    if (end == buf + n && !errno) {
+        *rv = make_int(i);
+        return true;
+    }
+    double x = strtod(buf, &end);
+    if (end != buf + n) return false;
+    *rv = make_float(x);
+    return true;
+}
+
+// Sources
+
+static bool open_source(source* s, cell c, bool is_text) {
+    memset(s, 0, sizeof(source));
+    s->fd = -1;
+    if (is_text) {
+        // Text may also be a string literal, a list of character codes
+        if (IS_PAIR(c)) {
+            size_t len = 0;
+            cell l;
+            for (l = c; IS_PAIR(l); l = cdr(l)) len++;
+            s->buf = GC_MALLOC_ATOMIC(len + 1);
+            if (!s->buf) {
+                puts("malloc failed");
+                exit(-1);
+            }
+            for (len = 0; IS_PAIR(c); c = cdr(c))
+                s->buf[len++] = IS_INT(car(c)) ? INT_VAL(car(c)) : '?';
+            s->buf[len] = '\0';
+        } else if (TYPE(c) == SYMBOL) {
+            s->buf = SYM_STR(c);
+        } else {
+            return false;
+        }
+        s->end = s->size = strlen(s->buf);
+        s->eof = true;
+        return true;
+    }
+    if (IS_INT(c)) {
+        s->fd = INT_VAL(c);
+    } else if (TYPE(c) == SYMBOL) {
+        do s->fd = open(SYM_STR(c), O_RDONLY | O_CLOEXEC);
+        while (s->fd < 0 && errno == EINTR);
+        s->close_fd = true;
+    }
+    if (s->fd < 0) return false;
+    struct stat st;
+    if (fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && s->close_fd) {
+        char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, s->fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            s->buf = data;
+            s->end = s->size = s->mapped = st.st_size;
+            s->eof = true;
+            return true;
+        }
+    }
+    s->buf = GC_MALLOC_ATOMIC(s->size = FORMATS_BUFFER_SIZE);
+    if (!s->buf) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    return true;
+}
+
+static void close_source(source* s) {
+    if (s->mapped) munmap(s->buf, s->mapped);
+    if (s->close_fd) close(s->fd);
+}
+
+// Read more input, keeping anything after start
+// Returns false if no more could be read
+static bool fill(source* s) {
+    if (s->eof) return false;
+    if (s->start) {
+        memmove(s->buf, s->buf + s->start, s->end - s->start);
+        s->end -= s->start;
+        s->start = 0;
+    }
+    if (s->end == s->size) s->buf = GC_REALLOC(s->buf, s->size *= 2);
+    ssize_t n;
+    do n = read(s->fd, s->buf + s->end, s->size - s->end);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        s->eof = true;
+        return false;
+    }
+    s->end += n;
+    return true;
+}
+
+// Advance pos to the next byte in set, reading more input as needed
+// Returns false if the input ends first
+static bool seek(source* s, size_t* pos, const byte_set* set) {
+    while (1) {
+        size_t avail = s->end - s->start;
+        if (*pos < avail) {
+            *pos += scan(s->buf + s->start + *pos, avail - *pos, set);
+            if (*pos < avail) return true;
+        }
+        if (!fill(s)) return false;
+    }
+}
+
+// The byte at pos, or -1 at the end of the input
+static int peek(source* s, size_t pos) {
+    while (pos >= s->end - s->start)
+        if (!fill(s)) return -1;
+    return (unsigned char) s->buf[s->start + pos];
+}
+
+// CSV
+
+// Find the length of the row at the start of the input, not counting its
+// newline. Newlines in quoted fields are part of the row; a doubled quote
+// in a quoted field toggles quoting twice, so needs no special case
+static bool csv_row_length(source* s, size_t* len) {
+    size_t pos = 0;
+    bool quoted = false;
+    while (seek(s, &pos, &quote_newline)) {
+        char c = s->buf[s->start + pos];
+        if (c == '\n' && !quoted) {
+            *len = pos;
+            return true;
+        }
+        if (c == '"') quoted = !quoted;
+        pos++;
+    }
+    // The last row may not end with a newline
+    *len = s->end - s->start;
+    return *len > 0;
+}
+
+// Parse a quoted field starting after its opening quote at p[*i]
+static cell quoted_field(const char* p, size_t n, size_t* i) {
+    char* t = GC_MALLOC_ATOMIC(n - *i + 1);
+    if (!t) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    size_t len = 0;
+    while (*i < n) {
+        size_t j = *i + scan(p + *i, n - *i, &quote_only);
+        memcpy(t + len, p + *i, j - *i);
+        len += j - *i;
+        *i = j + 1;
+        // A doubled quote is a quote; anything else ends the field
+        if (j + 1 < n && p[j + 1] == '"') {
+            t[len++] = '"';
+            (*i)++;
+        } else {
+            break;
+        }
+    }
+    t[len] = '\0';
+    return CAST(t, SYMBOL);
+}
+
+static cell csv_row(const char* p, size_t n, char sep) {
+    byte_set sep_quote = make_set((char[]) {sep, '"'}, 2);
+    byte_set sep_only = make_set(&sep, 1);
+    cell rv = NIL;
+    cell* tail = &rv;
+    size_t i = 0;
+    while (1) {
+        cell field = NIL;
+        if (i < n && p[i] == '"') {
+            i++;
+            field = quoted_field(p, n, &i);
+            // Skip anything between the closing quote and the separator
+            if (i < n) i += scan(p + i, n - i, &sep_only);
+        } else {
+            size_t j = i + scan(p + i, n - i, &sep_quote);
+            // A quote inside an unquoted field is taken literally
+            while (j < n && p[j] == '"') j += 1 + scan(p + j + 1, n - j - 1, &sep_quote);
+            if (j > i && !number(p + i, j - i, &field)) field = text(p + i, j - i);
+            i = j;
+        }
+        *tail = LIST1(field);
+        tail = &((pair*) PTR(*tail))->cdr;
+        if (i >= n) break;
+        i++;
+    }
+    return rv;
+}
+
+// Parse every row, collecting them into a list, or passing each to fn and
+// counting them if fn isn't nil
+static cell csv_rows(source* s, char sep, cell fn) {
+    cell rv = NIL;
+    cell* tail = &rv;
+    int64_t count = 0;
+    size_t len;
+    while (csv_row_length(s, &len)) {
+        size_t next = len + 1;
+        const char* p = s->buf + s->start;
+        if (len && p[len - 1] == '\r') len--;
+        // Blank lines aren't rows
+        if (len) {
+            cell row = csv_row(p, len, sep);
+            if (fn) {
+                call(fn, LIST1(row));
+                count++;
+            } else {
+                *tail = LIST1(row);
+                tail = &((pair*) PTR(*tail))->cdr;
+            }
+        }
+        s->start += next < s->end - s->start ? next : s->end - s->start;
+    }
+    return fn ? make_int(count) : rv;
+}
+
+// The separator is a symbol such as ; or a character code, by default a comma
+static char separator(int argc, cell* argv, int i) {
+    if (argc <= i) return ',';
+    if (TYPE(argv[i]) == SYMBOL) return SYM_STR(argv[i])[0];
+    if (IS_INT(argv[i])) return INT_VAL(argv[i]);
+    return ',';
+}
+
+static cell csv(cell input, bool is_text, char sep, cell fn) {
+    source s;
+    if (!open_source(&s, input, is_text)) return NIL;
+    cell rv = csv_rows(&s, sep, fn);
+    close_source(&s);
+    return rv;
+}
+
+cell csv_parse(int argc, cell* argv) {
+    // csv.parse "a,1\nb,2.5" -> ((a 1) (b 2.5))
+    // csv.parse text 59 -> rows separated by semicolons
+    if (!argc) return NIL;
+    return csv(argv[0], true, separator(argc, argv, 1), NIL);
+}
+
+cell csv_read(int argc, cell* argv) {
+    // csv.read data.csv -> the rows of the file
+    // csv.read 0 -> the rows of stdin
+    if (!argc) return NIL;
+    return csv(argv[0], false, separator(argc, argv, 1), NIL);
+}
+
+cell csv_each(int argc, cell* argv) {
+    // csv.each data.csv f -> the number of rows, after applying f to each
+    if (argc < 2 || !IS_CALLABLE(argv[1])) return NIL;
+    return csv(argv[0], false, separator(argc, argv, 2), argv[1]);
+}
+
+// JSON
+
+static void skip_space(source* s, size_t* pos) {
+    int c;
+    while ((c = peek(s, *pos)) == ' ' || c == '\t' || c == '\r' || c == '\n') (*pos)++;
+}
+
+// Move pos from the opening quote of a string to just after its closing one
+static bool skip_string(source* s, size_t* pos) {
+    (*pos)++;
+    while (seek(s, pos, &string_end)) {
+        if (s->buf[s->start + *pos] == '"') {
+            (*pos)++;
+            return true;
+        }
+        *pos += 2;
+    }
+    return false;
+}
+
+// Find the end of the value starting at pos, reading more input as needed
+static bool json_value_end(source* s, size_t pos, size_t* end) {
+    int c = peek(s, pos);
+    if (c < 0) return false;
+    if (c == '"') {
+        if (!skip_string(s, &pos)) return false;
+    } else if (c == '[' || c == '{') {
+        int depth = 0;
+        while (seek(s, &pos, &structure)) {
+            c = s->buf[s->start + pos];
+            if (c == '"') {
+                if (!skip_string(s, &pos)) return false;
+                continue;
+            }
+            depth += c == '[' || c == '{' ? 1 : -1;
+            pos++;
+            if (!depth) break;
+        }
+        if (depth) return false;
+    } else if (!seek(s, &pos, &scalar_end)) {
+        pos = s->end - s->start;
+    }
+    *end = pos;
+    return true;
+}
+
+typedef struct {
+    const char* p;
+    const char* end;
+    int depth;
+    // Applied to the (key . value) list of each object, or nil
+    cell object_fn;
+} json_parser;
+
+static void skip_json_space(json_parser* j) {
+    while (j->p < j->end && (*j->p == ' ' || *j->p == '\t' || *j->p == '\r' || *j->p == '\n')) j->p++;
+}
+
+static int hex4(const char* p) {
+    int i, rv = 0;
+    for (i = 0; i < 4; i++) {
+        unsigned char c = p[i];
+        int d = isdigit(c) ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (d < 0) return -1;
+        rv = rv * 16 + d;
+    }
+    return rv;
+}
+
+static size_t utf8(char* out, unsigned code) {
+    if (code < 0x80) {
+        out[0] = code;
+        return 1;
+    }
+    if (code < 0x800) {
+        out[0] = 0xc0 | code >> 6;
+        out[1] = 0x80 | (code & 0x3f);
+        return 2;
+    }
+    if (code < 0x10000) {
+        out[0] = 0xe0 | code >> 12;
+        out[1] = 0x80 | (code >> 6 & 0x3f);
+        out[2] = 0x80 | (code & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | code >> 18;
+    out[1] = 0x80 | (code >> 12 & 0x3f);
+    out[2] = 0x80 | (code >> 6 & 0x3f);
+    out[3] = 0x80 | (code & 0x3f);
+    return 4;
+}
+
+// Parse a string after its opening quote. Escapes never take fewer bytes
+// than what they stand for, so the text is at most as long as the input
+static bool json_string(json_parser* j, cell* rv) {
+    const char* p = j->p;
+    size_t n = j->end - p;
+    size_t i = scan(p, n, &string_end);
+    if (i < n && p[i] == '"') {
+        // No escapes
+        *rv = text(p, i);
+        j->p += i + 1;
+        return true;
+    }
+    char* t = GC_MALLOC_ATOMIC(n + 1);
+    if (!t) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    size_t len = 0;
+    while (1) {
+        memcpy(t + len, p, i);
+        len += i;
+        p += i;
+        n -= i;
+        if (!n) return false;
+        if (*p == '"') break;
+        if (n < 2) return false;
+        char c = p[1];
+        p += 2;
+        n -= 2;
+        switch (c) {
+            case 'b': t[len++] = '\b'; break;
+            case 'f': t[len++] = '\f'; break;
+            case 'n': t[len++] = '\n'; break;
+            case 'r': t[len++] = '\r'; break;
+            case 't': t[len++] = '\t'; break;
+            case 'u': {
+                int code = n >= 4 ? hex4(p) : -1;
+                if (code < 0) return false;
+                p += 4;
+                n -= 4;
+                // Characters outside the basic plane are surrogate pairs
+                if (code >= 0xd800 && code < 0xdc00 && n >= 6 && p[0] == '\\' && p[1] == 'u') {
+                    int low = hex4(p + 2);
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                        n -= 6;
+                    }
+                }
+                len += utf8(t + len, code);
+                break;
+            }
+            default:
+                t[len++] = c;
+        }
+        i = scan(p, n, &string_end);
+    }
+    t[len] = '\0';
+    *rv = CAST(t, SYMBOL);
+    j->p = p + 1;
+    return true;
+}
+
+static bool json_value(json_parser* j, cell* rv);
+
+// Parse the elements of an array or the members of an object, after its
+// opening bracket, into a list
+static bool json_members(json_parser* j, char close, bool keys, cell* rv) {
+    *rv = NIL;
+    cell* tail = rv;
+    skip_json_space(j);
+    if (j->p < j->end && *j->p == close) {
+        j->p++;
+        return true;
+    }
+    while (1) {
+        cell key = NIL, value;
+        if (keys) {
+            skip_json_space(j);
+            if (j->p >= j->end || *j->p != '"') return false;
+            j->p++;
+            if (!json_string(j, &key)) return false;
+            skip_json_space(j);
+            if (j->p >= j->end || *j->p != ':') return false;
+            j->p++;
+        }
+        if (!json_value(j, &value)) return false;
+        *tail = LIST1(keys ? cons(key, value) : value);
+        tail = &((pair*) PTR(*tail))->cdr;
+        skip_json_space(j);
+        if (j->p >= j->end) return false;
+        char c = *j->p++;
+        if (c == close) return true;
+        if (c != ',') return false;
+    }
+}
+
+static bool json_value(json_parser* j, cell* rv) {
+    skip_json_space(j);
+    if (j->p >= j->end) return false;
+    const char* p = j->p;
+    size_t n = j->end - p;
+    switch (*p) {
+        case '"':
+            j->p++;
+            return json_string(j, rv);
+        case '[':
+        case '{': {
+            if (++j->depth > JSON_MAX_DEPTH) return false;
+            j->p++;
+            bool object = *p == '{';
+            if (!json_members(j, object ? '}' : ']', object, rv)) return false;
+            j->depth--;
+            if (object && j->object_fn && *rv) *rv = call(j->object_fn, LIST1(*rv));
+            return true;
+        }
+        case 't':
+            *rv = sym("true");
+            j->p += 4;
+            return n >= 4 && !memcmp(p, "true", 4);
+        case 'f':
+            *rv = NIL;
+            j->p += 5;
+            return n >= 5 && !memcmp(p, "false", 5);
+        case 'n':
+            *rv = NIL;
+            j->p += 4;
+            return n >= 4 && !memcmp(p, "null", 4);
+        default: {
+            size_t len = scan(p, n, &scalar_end);
+            j->p += len;
+            return number(p, len, rv);
+        }
+    }
+}
+
+// Parse the value in the input from pos to end, which holds all of it
+static bool json_parse_at(source* s, size_t pos, size_t end, cell object_fn, cell* rv) {
+    json_parser j = {s->buf + s->start + pos, s->buf + s->start + end, 0, object_fn};
+    return json_value(&j, rv);
+}
+
+// Parse every record, passing each to fn. Records are the elements of a
+// top-level array, or else the top-level values, as in newline-delimited
+// JSON. Without fn, the first record is returned
+static cell json_records(source* s, cell fn, cell object_fn) {
+    int64_t count = 0;
+    size_t pos = 0, end;
+    cell value;
+    skip_space(s, &pos);
+    bool array = fn && peek(s, pos) == '[';
+    if (array) {
+        pos++;
+        skip_space(s, &pos);
+        if (peek(s, pos) == ']') return make_int(0);
+    }
+    while (1) {
+        skip_space(s, &pos);
+        if (peek(s, pos) < 0) break;
+        if (!json_value_end(s, pos, &end) || !json_parse_at(s, pos, end, object_fn, &value)) return NIL;
+        if (!fn) return value;
+        call(fn, LIST1(value));
+        count++;
+        s->start += end;
+        pos = 0;
+        if (array) {
+            skip_space(s, &pos);
+            int c = peek(s, pos++);
+            if (c == ']') break;
+            if (c != ',') return NIL;
+        }
+    }
+    return fn ? make_int(count) : NIL;
+}
+
+// The vm's json.object, which json.object-fn defines
+static cell object_fn(void) {
+    static cell name;
+    if (!name) name = sym("json.object");
+    cell fn = eval(name, current_vm->global_env);
+    return IS_CALLABLE(fn) ? fn : NIL;
+}
+
+static cell json(cell input, bool is_text, cell fn) {
+    source s;
+    if (!open_source(&s, input, is_text)) return NIL;
+    cell rv = json_records(&s, fn, object_fn());
+    close_source(&s);
+    return rv;
+}
+
+cell json_parse(int argc, cell* argv) {
+    // json.parse "[1, 2.5, \"a\", true, null]" -> (1 2.5 a true ())
+    // Returns nil if the text isn't valid JSON
+    if (!argc) return NIL;
+    return json(argv[0], true, NIL);
+}
+
+cell json_read(int argc, cell* argv) {
+    // json.read data.json -> the value in the file
+    if (!argc) return NIL;
+    return json(argv[0], false, NIL);
+}
+
+cell json_each(int argc, cell* argv) {
+    // json.each data.json f -> the number of records, after applying f to each
+    // Records are the elements of a top-level array, or the values of
+    // newline-delimited JSON
+    if (argc < 2 || !IS_CALLABLE(argv[1])) return NIL;
+    return json(argv[0], false, argv[1]);
+}
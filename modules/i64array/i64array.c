@@ -0,0 +1,376 @@
+#include <crisp.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+// This is a type code which will be filled in when imported
+uint64_t I64ARRAY;
+
+// An i64array is a packed, immutable array of 64 bit integers. Arithmetic
+// wraps around like the integer operations in C.
+//
+// Each kernel has a plain C version, which the compiler vectorizes with SSE2
+// on x86-64, and an AVX2 version which is used if the CPU supports it.
+
+typedef struct {
+    size_t len;
+    int64_t* data;
+} i64array;
+
+typedef enum { CMP_LT, CMP_EQ, CMP_GT } comparison;
+
+static cell new_array(size_t len, i64array** a) {
+    *a = malloc_or_die(sizeof(i64array));
+    (*a)->len = len;
+    (*a)->data = GC_MALLOC_ATOMIC((len ? len : 1) * sizeof(int64_t));
+    if (!(*a)->data) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    return CAST(*a, I64ARRAY);
+}
+
+static int64_t sum_c(const int64_t* x, size_t n) {
+    uint64_t s = 0;
+    size_t i;
+    for (i = 0; i < n; i++) s += x[i];
+    return s;
+}
+
+static int64_t dot_c(const int64_t* x, const int64_t* y, size_t n) {
+    uint64_t s = 0;
+    size_t i;
+    for (i = 0; i < n; i++) s += (uint64_t) x[i] * y[i];
+    return s;
+}
+
+// n must be at least 1
+static int64_t extreme_c(const int64_t* x, size_t n, bool max) {
+    int64_t e = x[0];
+    size_t i;
+    if (max)
+        for (i = 1; i < n; i++) e = x[i] > e ? x[i] : e;
+    else
+        for (i = 1; i < n; i++) e = x[i] < e ? x[i] : e;
+    return e;
+}
+
+// y is added to or multiplied into x; a stride of 0 repeats y[0]
+static void add_c(int64_t* out, const int64_t* x, const int64_t* y, size_t stride, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) out[i] = (uint64_t) x[i] + y[i * stride];
+}
+
+static void mul_c(int64_t* out, const int64_t* x, const int64_t* y, size_t stride, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) out[i] = (uint64_t) x[i] * y[i * stride];
+}
+
+static void prefix_sum_c(int64_t* out, const int64_t* x, size_t n) {
+    uint64_t s = 0;
+    size_t i;
+    for (i = 0; i < n; i++) out[i] = s += x[i];
+}
+
+static void compare_c(int64_t* out, const int64_t* x, const int64_t* y, size_t stride, size_t n, comparison cmp) {
+    size_t i;
+    switch (cmp) {
+        case CMP_LT: for (i = 0; i < n; i++) out[i] = x[i] < y[i * stride]; break;
+        case CMP_EQ: for (i = 0; i < n; i++) out[i] = x[i] == y[i * stride]; break;
+        case CMP_GT: for (i = 0; i < n; i++) out[i] = x[i] > y[i * stride]; break;
+    }
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AVX2 __attribute__((target("avx2")))
+
+static AVX2 inline __m256i load(const int64_t* x) {
+    return _mm256_loadu_si256((const __m256i*) x);
+}
+
+static AVX2 inline void store(int64_t* x, __m256i v) {
+    _mm256_storeu_si256((__m256i*) x, v);
+}
+
+static AVX2 inline int64_t hsum(__m256i v) {
+    int64_t lanes[4];
+    store(lanes, v);
+    return (uint64_t) lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+// AVX2 has no 64 bit multiply, so build one from 32 bit multiplies:
+// the low halves' product plus the cross products shifted up
+static AVX2 inline __m256i mul64(__m256i a, __m256i b) {
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+
+static AVX2 int64_t sum_avx2(const int64_t* x, size_t n) {
+    // Two accumulators hide the latency of the adds
+    __m256i a = _mm256_setzero_si256(), b = _mm256_setzero_si256();
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        a = _mm256_add_epi64(a, load(x + i));
+        b = _mm256_add_epi64(b, load(x + i + 4));
+    }
+    return (uint64_t) hsum(_mm256_add_epi64(a, b)) + sum_c(x + i, n - i);
+}
+
+static AVX2 int64_t dot_avx2(const int64_t* x, const int64_t* y, size_t n) {
+    __m256i s = _mm256_setzero_si256();
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4)
+        s = _mm256_add_epi64(s, mul64(load(x + i), load(y + i)));
+    return (uint64_t) hsum(s) + dot_c(x + i, y + i, n - i);
+}
+
+static AVX2 int64_t extreme_avx2(const int64_t* x, size_t n, bool max) {
+    if (n < 4) return extreme_c(x, n, max);
+    __m256i e = load(x);
+    size_t i;
+    for (i = 4; i + 4 <= n; i += 4) {
+        __m256i v = load(x + i);
+        __m256i greater = _mm256_cmpgt_epi64(v, e);
+        e = max ? _mm256_blendv_epi8(e, v, greater) : _mm256_blendv_epi8(v, e, greater);
+    }
+    int64_t lanes[4];
+    store(lanes, e);
+    int64_t r = extreme_c(lanes, 4, max);
+    if (i < n) {
+        int64_t rest = extreme_c(x + i, n - i, max);
+        r = max ? (rest > r ? rest : r) : (rest < r ? rest : r);
+    }
+    return r;
+}
+
+static AVX2 void add_avx2(int64_t* out, const int64_t* x, const int64_t* y, size_t stride, size_t n) {
+    size_t i = 0;
+    if (stride) {
+        for (; i + 4 <= n; i += 4) store(out + i, _mm256_add_epi64(load(x + i), load(y + i)));
+    } else {
+        __m256i c = _mm256_set1_epi64x(y[0]);
+        for (; i + 4 <= n; i += 4) store(out + i, _mm256_add_epi64(load(x + i), c));
+    }
+    add_c(out + i, x + i, y + i * stride, stride, n - i);
+}
+
+static AVX2 void mul_avx2(int64_t* out, const int64_t* x, const int64_t* y, size_t stride, size_t n) {
+    size_t i = 0;
+    if (stride) {
+        for (; i + 4 <= n; i += 4) store(out + i, mul64(load(x + i), load(y + i)));
+    } else {
+        __m256i c = _mm256_set1_epi64x(y[0]);
+        for (; i + 4 <= n; i += 4) store(out + i, mul64(load(x + i), c));
+    }
+    mul_c(out + i, x + i, y + i * stride, stride, n - i);
+}
+
+static AVX2 void prefix_sum_avx2(int64_t* out, const int64_t* x, size_t n) {
+    // Scan within each vector by adding copies shifted up one and then two
+    // lanes, then add the running total carried from the last vector
+    __m256i zero = _mm256_setzero_si256();
+    __m256i carry = zero;
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i v = load(x + i);
+        v = _mm256_add_epi64(v, _mm256_blend_epi32(_mm256_permute4x64_epi64(v, 0x90), zero, 0x03));
+        v = _mm256_add_epi64(v, _mm256_blend_epi32(_mm256_permute4x64_epi64(v, 0x40), zero, 0x0f));
+        v = _mm256_add_epi64(v, carry);
+        store(out + i, v);
+        carry = _mm256_permute4x64_epi64(v, 0xff);
+    }
+    uint64_t s = i ? out[i - 1] : 0;
+    for (; i < n; i++) out[i] = s += x[i];
+}
+
+static AVX2 void compare_avx2(int64_t* out, const int64_t* x, const int64_t* y, size_t stride, size_t n, comparison cmp) {
+    __m256i one = _mm256_set1_epi64x(1);
+    __m256i c = stride ? one : _mm256_set1_epi64x(y[0]);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i a = load(x + i);
+        __m256i b = stride ? load(y + i) : c;
+        __m256i mask = cmp == CMP_EQ ? _mm256_cmpeq_epi64(a, b)
+                     : cmp == CMP_GT ? _mm256_cmpgt_epi64(a, b)
+                     : _mm256_cmpgt_epi64(b, a);
+        store(out + i, _mm256_and_si256(mask, one));
+    }
+    compare_c(out + i, x + i, y + i * stride, stride, n - i, cmp);
+}
+
+static bool avx2;
+
+__attribute__((constructor)) static void detect_avx2(void) {
+    // This may run before libgcc has looked at the CPU itself
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+}
+
+#define DISPATCH(kernel, ...) (avx2 ? kernel##_avx2(__VA_ARGS__) : kernel##_c(__VA_ARGS__))
+#else
+#define DISPATCH(kernel, ...) kernel##_c(__VA_ARGS__)
+#endif
+
+static i64array* as_array(cell c) {
+    return TYPE(c) == I64ARRAY ? PTR(c) : NULL;
+}
+
+cell i64array_from_list(int argc, cell* argv) {
+    // i64array.from-list (1 2 3) -> I64ARRAY<...>
+    // Returns nil if the list holds anything but integers
+    if (!argc || (argv[0] && !IS_PAIR(argv[0]))) return NIL;
+    size_t len = 0;
+    cell l;
+    for (l = argv[0]; IS_PAIR(l); l = cdr(l)) {
+        if (!IS_INT(car(l))) return NIL;
+        len++;
+    }
+    i64array* a;
+    cell rv = new_array(len, &a);
+    size_t i = 0;
+    for (l = argv[0]; IS_PAIR(l); l = cdr(l)) a->data[i++] = INT_VAL(car(l));
+    return rv;
+}
+
+cell i64array_to_list(int argc, cell* argv) {
+    // i64array.to-list (i64array.range 3) -> 0 1 2
+    i64array* a = argc ? as_array(argv[0]) : NULL;
+    if (!a) return NIL;
+    cell rv = NIL;
+    size_t i = a->len;
+    while (i--) rv = cons(make_int(a->data[i]), rv);
+    return rv;
+}
+
+cell i64array_range(int argc, cell* argv) {
+    // i64array.range 5 -> an array of 0 1 2 3 4
+    // i64array.range 10 0 -3 -> an array of 10 7 4 1
+    int64_t start = 0, end, step = 1;
+    if (!argc || !IS_INT(argv[0])) return NIL;
+    end = INT_VAL(argv[0]);
+    if (argc > 1) {
+        if (!IS_INT(argv[1])) return NIL;
+        start = end;
+        end = INT_VAL(argv[1]);
+    }
+    if (argc > 2) {
+        if (!IS_INT(argv[2]) || !INT_VAL(argv[2])) return NIL;
+        step = INT_VAL(argv[2]);
+    }
+    size_t len = 0;
+    if (step > 0 && end > start) len = (end - start + step - 1) / step;
+    if (step < 0 && end < start) len = (start - end - step - 1) / -step;
+    i64array* a;
+    cell rv = new_array(len, &a);
+    size_t i;
+    for (i = 0; i < len; i++) a->data[i] = start + (int64_t) i * step;
+    return rv;
+}
+
+cell i64array_len(int argc, cell* argv) {
+    // i64array.len a -> the number of elements
+    i64array* a = argc ? as_array(argv[0]) : NULL;
+    return a ? make_int(a->len) : NIL;
+}
+
+cell i64array_get(int argc, cell* argv) {
+    // i64array.get (i64array.range 5) 2 -> 2
+    // Returns nil outside of the array
+    i64array* a = argc > 1 ? as_array(argv[0]) : NULL;
+    if (!a || !IS_INT(argv[1]) || INT_VAL(argv[1]) < 0 || (size_t) INT_VAL(argv[1]) >= a->len) return NIL;
+    return make_int(a->data[INT_VAL(argv[1])]);
+}
+
+cell i64array_sum(int argc, cell* argv) {
+    // i64array.sum (i64array.range 5) -> 10
+    i64array* a = argc ? as_array(argv[0]) : NULL;
+    return a ? make_int(DISPATCH(sum, a->data, a->len)) : NIL;
+}
+
+cell i64array_min(int argc, cell* argv) {
+    // i64array.min (i64array.from-list (3 1 2)) -> 1
+    // Returns nil for an empty array
+    i64array* a = argc ? as_array(argv[0]) : NULL;
+    return a && a->len ? make_int(DISPATCH(extreme, a->data, a->len, false)) : NIL;
+}
+
+cell i64array_max(int argc, cell* argv) {
+    // i64array.max (i64array.from-list (3 1 2)) -> 3
+    i64array* a = argc ? as_array(argv[0]) : NULL;
+    return a && a->len ? make_int(DISPATCH(extreme, a->data, a->len, true)) : NIL;
+}
+
+cell i64array_dot(int argc, cell* argv) {
+    // i64array.dot a b -> the sum of the products of their elements
+    // Returns nil unless both arrays have the same length
+    i64array* a = argc > 1 ? as_array(argv[0]) : NULL;
+    i64array* b = argc > 1 ? as_array(argv[1]) : NULL;
+    if (!a || !b || a->len != b->len) return NIL;
+    return make_int(DISPATCH(dot, a->data, b->data, a->len));
+}
+
+// Find the second operand of an elementwise operation, which is either an
+// array as long as the first or an integer used for every element
+static const int64_t* operand(i64array* a, cell c, int64_t* scratch, size_t* stride) {
+    if (IS_INT(c)) {
+        *scratch = INT_VAL(c);
+        *stride = 0;
+        return scratch;
+    }
+    i64array* b = as_array(c);
+    if (!b || b->len != a->len) return NULL;
+    *stride = 1;
+    return b->data;
+}
+
+// Apply one of the elementwise kernels taking a second operand
+#define ELEMENTWISE(kernel, ...)                                        \
+    i64array* a = argc > 1 ? as_array(argv[0]) : NULL;                  \
+    int64_t scratch;                                                    \
+    size_t stride;                                                      \
+    const int64_t* y = a ? operand(a, argv[1], &scratch, &stride) : NULL; \
+    if (!y) return NIL;                                                 \
+    i64array* out;                                                      \
+    cell rv = new_array(a->len, &out);                                  \
+    DISPATCH(kernel, out->data, a->data, y, stride, a->len, ##__VA_ARGS__); \
+    return rv
+
+cell i64array_add(int argc, cell* argv) {
+    // i64array.add a b -> an array of the sums of their elements
+    // i64array.add a 5 -> an array with 5 added to every element
+    ELEMENTWISE(add);
+}
+
+cell i64array_mul(int argc, cell* argv) {
+    // i64array.mul a b -> an array of the products of their elements
+    // i64array.mul a 5 -> an array with every element multiplied by 5
+    ELEMENTWISE(mul);
+}
+
+cell i64array_lt(int argc, cell* argv) {
+    // i64array.lt a 5 -> an array with 1 where an element is less than 5
+    // and 0 elsewhere; the second operand may also be an array
+    ELEMENTWISE(compare, CMP_LT);
+}
+
+cell i64array_eq(int argc, cell* argv) {
+    // i64array.eq a b -> an array with 1 where their elements are equal
+    ELEMENTWISE(compare, CMP_EQ);
+}
+
+cell i64array_gt(int argc, cell* argv) {
+    // i64array.gt a b -> an array with 1 where an element of a is greater
+    ELEMENTWISE(compare, CMP_GT);
+}
+
+cell i64array_prefix_sum(int argc, cell* argv) {
+    // i64array.prefix-sum (i64array.from-list (1 2 3)) -> an array of 1 3 6
+    i64array* a = argc ? as_array(argv[0]) : NULL;
+    if (!a) return NIL;
+    i64array* out;
+    cell rv = new_array(a->len, &out);
+    DISPATCH(prefix_sum, out->data, a->data, a->len);
+    return rv;
+}
@@ -0,0 +1,333 @@
+#include <crisp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// These are type codes which will be filled in when imported
+uint64_t IO_READER;
+uint64_t IO_WRITER;
+uint64_t IO_MAPPING;
+
+// Data is returned as text, a SYMBOL cell which isn't interned (see text in
+// crisp.c), so it is only equal to other symbols with the same contents
+// after intern
+// Data to be written may be a symbol, a string literal (a list of character
+// codes), or an integer, which is written in decimal
+
+#define IO_BUFFER_SIZE (1 << 20)
+
+typedef struct {
+    int fd;
+    char* buf;
+    size_t start;
+    size_t end;
+    size_t size;
+    bool eof;
+} reader;
+
+typedef struct {
+    int fd;
+    char* buf;
+    size_t len;
+} writer;
+
+typedef struct {
+    char* data;
+    size_t size;
+} mapping;
+
+// Find the bytes to write for a cell, using buf for anything but a symbol
+// Returns NULL if c can't be written
+static char* bytes(cell c, size_t* n, char* buf, size_t buf_size) {
+    if (TYPE(c) == SYMBOL) {
+        *n = strlen(SYM_STR(c));
+        return SYM_STR(c);
+    }
+    if (IS_INT(c)) {
+        *n = snprintf(buf, buf_size, "%ld", INT_VAL(c));
+        return buf;
+    }
+    if (!IS_PAIR(c)) return NULL;
+    size_t len = 0;
+    cell l;
+    for (l = c; IS_PAIR(l); l = cdr(l)) len++;
+    if (len > buf_size) buf = GC_MALLOC_ATOMIC(len);
+    for (*n = 0; IS_PAIR(c); c = cdr(c))
+        buf[(*n)++] = IS_INT(car(c)) ? INT_VAL(car(c)) : '?';
+    return buf;
+}
+
+static int open_path(cell path, int flags) {
+    if (TYPE(path) != SYMBOL) return -1;
+    int fd;
+    do fd = open(SYM_STR(path), flags | O_CLOEXEC, 0666);
+    while (fd < 0 && errno == EINTR);
+    return fd;
+}
+
+// Write all of a buffer, retrying after partial writes
+static bool write_fully(int fd, const char* data, size_t n) {
+    while (n) {
+        ssize_t written = write(fd, data, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        n -= written;
+    }
+    return true;
+}
+
+cell io_reader(int argc, cell* argv) {
+    // io.reader path -> IO_READER<...>
+    // io.reader 0 -> a reader for stdin
+    // io.reader (mmap-file path) -> a reader over the mapping
+    if (!argc) return NIL;
+    if (TYPE(argv[0]) == IO_READER) return argv[0];
+    reader* r = malloc_or_die(sizeof(reader));
+    if (TYPE(argv[0]) == IO_MAPPING) {
+        // Everything is already in memory
+        mapping* m = PTR(argv[0]);
+        r->fd = -1;
+        r->buf = m->data;
+        r->start = 0;
+        r->end = r->size = m->size;
+        r->eof = true;
+        return CAST(r, IO_READER);
+    }
+    r->fd = IS_INT(argv[0]) ? INT_VAL(argv[0]) : open_path(argv[0], O_RDONLY);
+    if (r->fd < 0) return NIL;
+    r->buf = GC_MALLOC_ATOMIC(r->size = IO_BUFFER_SIZE);
+    r->start = r->end = 0;
+    r->eof = false;
+    return CAST(r, IO_READER);
+}
+
+// Read more data into a reader's buffer, keeping any unconsumed data
+// Returns false if no more data could be read
+static bool fill(reader* r) {
+    if (r->eof) return false;
+    if (r->start) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->end == r->size) r->buf = GC_REALLOC(r->buf, r->size *= 2);
+    ssize_t n;
+    do n = read(r->fd, r->buf + r->end, r->size - r->end);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        r->eof = true;
+        return false;
+    }
+    r->end += n;
+    return true;
+}
+
+cell io_read_line(int argc, cell* argv) {
+    // io.read-line reader -> the next line, without its newline
+    // Returns nil at the end of the input
+    if (!argc || TYPE(argv[0]) != IO_READER) return NIL;
+    reader* r = PTR(argv[0]);
+    size_t scanned = 0;
+    while (1) {
+        char* start = r->buf + r->start;
+        char* newline = memchr(start + scanned, '\n', r->end - r->start - scanned);
+        if (newline) {
+            r->start += newline - start + 1;
+            return text(start, newline - start);
+        }
+        scanned = r->end - r->start;
+        if (!fill(r)) break;
+    }
+    // The last line may not end with a newline
+    if (r->start == r->end) return NIL;
+    cell line = text(r->buf + r->start, r->end - r->start);
+    r->start = r->end;
+    return line;
+}
+
+cell io_read(int argc, cell* argv) {
+    // io.read reader 10 -> at most 10 bytes
+    // io.read reader -> whatever is buffered, or the next chunk
+    // Returns nil at the end of the input
+    if (!argc || TYPE(argv[0]) != IO_READER) return NIL;
+    reader* r = PTR(argv[0]);
+    if (r->start == r->end && !fill(r)) return NIL;
+    size_t n = r->end - r->start;
+    if (argc > 1 && IS_INT(argv[1]) && INT_VAL(argv[1]) >= 0 && (size_t) INT_VAL(argv[1]) < n)
+        n = INT_VAL(argv[1]);
+    cell data = text(r->buf + r->start, n);
+    r->start += n;
+    return data;
+}
+
+cell io_writer(int argc, cell* argv) {
+    // io.writer path -> IO_WRITER<...>, truncating the file
+    // io.writer 1 -> a writer for stdout
+    if (!argc) return NIL;
+    writer* w = malloc_or_die(sizeof(writer));
+    w->fd = IS_INT(argv[0]) ? INT_VAL(argv[0]) : open_path(argv[0], O_WRONLY | O_CREAT | O_TRUNC);
+    if (w->fd < 0) return NIL;
+    w->buf = GC_MALLOC_ATOMIC(IO_BUFFER_SIZE);
+    w->len = 0;
+    return CAST(w, IO_WRITER);
+}
+
+static bool flush(writer* w) {
+    bool ok = write_fully(w->fd, w->buf, w->len);
+    w->len = 0;
+    return ok;
+}
+
+cell io_write(int argc, cell* argv) {
+    // io.write writer hello world -> writer
+    // Integers are written in decimal
+    if (!argc || TYPE(argv[0]) != IO_WRITER) return NIL;
+    writer* w = PTR(argv[0]);
+    int i;
+    for (i = 1; i < argc; i++) {
+        char small[256];
+        size_t n;
+        char* s = bytes(argv[i], &n, small, sizeof(small));
+        if (!s) continue;
+        if (w->len + n > IO_BUFFER_SIZE && !flush(w)) return NIL;
+        // Large writes skip the buffer
+        if (n > IO_BUFFER_SIZE) {
+            if (!write_fully(w->fd, s, n)) return NIL;
+            continue;
+        }
+        memcpy(w->buf + w->len, s, n);
+        w->len += n;
+    }
+    return argv[0];
+}
+
+cell io_flush(int argc, cell* argv) {
+    // io.flush writer -> writer
+    if (!argc || TYPE(argv[0]) != IO_WRITER || !flush(PTR(argv[0]))) return NIL;
+    return argv[0];
+}
+
+cell io_close(int argc, cell* argv) {
+    // io.close reader ->
+    // io.close writer -> flushes first
+    // io.close mapping -> unmaps it; text already taken from it remains valid
+    if (!argc) return NIL;
+    if (TYPE(argv[0]) == IO_READER) {
+        reader* r = PTR(argv[0]);
+        if (r->fd >= 0) close(r->fd);
+        r->fd = -1;
+        r->start = r->end = 0;
+        r->eof = true;
+    }
+    if (TYPE(argv[0]) == IO_WRITER) {
+        writer* w = PTR(argv[0]);
+        if (w->fd >= 0) {
+            flush(w);
+            close(w->fd);
+        }
+        w->fd = -1;
+    }
+    if (TYPE(argv[0]) == IO_MAPPING) {
+        mapping* m = PTR(argv[0]);
+        if (m->size) munmap(m->data, m->size);
+        m->data = NULL;
+        m->size = 0;
+    }
+    return NIL;
+}
+
+cell read_file(int argc, cell* argv) {
+    // read-file path -> the whole file as text
+    if (!argc) return NIL;
+    int fd = open_path(argv[0], O_RDONLY);
+    if (fd < 0) return NIL;
+    // Size the buffer up front so a regular file takes one read
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 && st.st_size > 0 ? st.st_size + 1 : IO_BUFFER_SIZE;
+    char* buf = GC_MALLOC_ATOMIC(size);
+    size_t len = 0;
+    while (1) {
+        if (len + 1 == size) buf = GC_REALLOC(buf, size *= 2);
+        ssize_t n = read(fd, buf + len, size - len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+    close(fd);
+    buf[len] = '\0';
+    return CAST(buf, SYMBOL);
+}
+
+cell write_all(int argc, cell* argv) {
+    // write-all path hello -> 5, replacing the contents of path
+    char small[256];
+    size_t n;
+    char* data = argc > 1 ? bytes(argv[1], &n, small, sizeof(small)) : NULL;
+    if (!data) return NIL;
+    int fd = open_path(argv[0], O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd < 0) return NIL;
+    bool ok = write_fully(fd, data, n);
+    close(fd);
+    return ok ? make_int(n) : NIL;
+}
+
+cell mmap_file(int argc, cell* argv) {
+    // mmap-file path -> IO_MAPPING<...>, a read-only view of the file
+    if (!argc) return NIL;
+    int fd = open_path(argv[0], O_RDONLY);
+    if (fd < 0) return NIL;
+    struct stat st;
+    mapping* m = malloc_or_die(sizeof(mapping));
+    m->data = NULL;
+    m->size = 0;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        m->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        m->size = st.st_size;
+    }
+    close(fd);
+    if (m->data == MAP_FAILED) return NIL;
+    // The file is usually read from start to end
+    if (m->size) madvise(m->data, m->size, MADV_SEQUENTIAL);
+    return CAST(m, IO_MAPPING);
+}
+
+cell io_size(int argc, cell* argv) {
+    // io.size mapping -> its length in bytes
+    if (!argc || TYPE(argv[0]) != IO_MAPPING) return NIL;
+    return make_int(((mapping*) PTR(argv[0]))->size);
+}
+
+cell io_slice(int argc, cell* argv) {
+    // io.slice mapping 10 5 -> the text of bytes 10 to 14
+    if (argc < 3 || TYPE(argv[0]) != IO_MAPPING || !IS_INT(argv[1]) || !IS_INT(argv[2])) return NIL;
+    mapping* m = PTR(argv[0]);
+    int64_t start = INT_VAL(argv[1]);
+    int64_t n = INT_VAL(argv[2]);
+    if (start < 0 || n < 0 || (size_t) start > m->size) return NIL;
+    if ((size_t) (start + n) > m->size) n = m->size - start;
+    return text(m->data + start, n);
+}
+
+cell io_chars(int argc, cell* argv) {
+    // io.chars abc -> 97 98 99, like the string literal "abc"
+    if (!argc || TYPE(argv[0]) != SYMBOL) return NIL;
+    cell rv = NIL;
+    cell* tail = &rv;
+    unsigned char* s;
+    for (s = (unsigned char*) SYM_STR(argv[0]); *s; s++) {
+        *tail = LIST1(make_int(*s));
+        tail = &((pair*) PTR(*tail))->cdr;
+    }
+    return rv;
+}
+
+cell io_intern(int argc, cell* argv) {
+    // io.intern text -> the symbol with the same name
+    if (!argc || TYPE(argv[0]) != SYMBOL) return NIL;
+    return sym(SYM_STR(argv[0]));
+}
@@ -0,0 +1,286 @@
+#include <crisp.h>
+
+// This is a type code which will be filled in when imported
+uint64_t LAZY;
+
+// A lazy sequence is a cons cell whose head and tail are computed only when
+// first needed, and then remembered. Until then it holds a source of
+// elements and a pipeline of stages to pass them through. Applying another
+// stage to a sequence which hasn't been forced yet just extends a copy of
+// its pipeline, so a chain like
+//
+//     take 10 (lazy-filter f (lazy-map g (lazy-range 1000000)))
+//
+// runs as a single loop over the range, and no intermediate list is built.
+
+typedef enum {
+    SOURCE_RANGE,
+    SOURCE_LIST,
+    // Elements of another lazy sequence which has already been forced
+    SOURCE_SEQ,
+    // Results of applying a function to no arguments, until it returns nil
+    SOURCE_GENERATE,
+} source_kind;
+
+typedef enum {
+    STAGE_MAP,
+    STAGE_FILTER,
+    STAGE_TAKE,
+    STAGE_DROP_WHILE,
+} stage_kind;
+
+typedef struct {
+    stage_kind kind;
+    cell fn;
+    // For take, the number of elements still to be taken
+    // For drop-while, whether elements are still being dropped
+    int64_t n;
+} stage;
+
+typedef struct {
+    bool forced;
+    // Once forced, an empty sequence has no head or tail
+    bool empty;
+    cell head;
+    cell tail;
+
+    // Before it is forced, where the elements come from
+    source_kind kind;
+    int64_t next;
+    int64_t end;
+    int64_t step;
+    bool unbounded;
+    cell rest;
+    cell fn;
+
+    int num_stages;
+    stage* stages;
+} lazy;
+
+#define LAZY_PTR(c) ((lazy*) PTR(c))
+
+static lazy* new_lazy(source_kind kind, int num_stages) {
+    lazy* l = malloc_or_die(sizeof(lazy));
+    memset(l, 0, sizeof(lazy));
+    l->kind = kind;
+    l->num_stages = num_stages;
+    if (num_stages) l->stages = malloc_or_die(num_stages * sizeof(stage));
+    return l;
+}
+
+static cell call(cell fn, cell args) {
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+static void force(lazy* l) {
+    if (l->forced) return;
+
+    // Work on a copy of the pipeline, since its state advances
+    lazy* tail = new_lazy(l->kind, 0);
+    memcpy(tail, l, sizeof(lazy));
+    if (l->num_stages) {
+        tail->stages = malloc_or_die(l->num_stages * sizeof(stage));
+        memcpy(tail->stages, l->stages, l->num_stages * sizeof(stage));
+    }
+
+    cell x;
+    int i;
+    next_element:
+    // An element must pass every stage, so once any take
+    // is exhausted there are no more elements
+    for (i = 0; i < tail->num_stages; i++)
+        if (tail->stages[i].kind == STAGE_TAKE && !tail->stages[i].n) goto empty;
+
+    switch (tail->kind) {
+        case SOURCE_RANGE:
+            if (!tail->unbounded && (tail->step > 0 ? tail->next >= tail->end : tail->next <= tail->end))
+                goto empty;
+            x = make_int(tail->next);
+            tail->next += tail->step;
+            break;
+        case SOURCE_LIST:
+            if (!IS_PAIR(tail->rest)) goto empty;
+            x = car(tail->rest);
+            tail->rest = cdr(tail->rest);
+            break;
+        case SOURCE_SEQ: {
+            lazy* source = LAZY_PTR(tail->rest);
+            force(source);
+            if (source->empty) goto empty;
+            x = source->head;
+            tail->rest = source->tail;
+            break;
+        }
+        case SOURCE_GENERATE:
+            x = call(tail->fn, NIL);
+            if (!x) goto empty;
+            break;
+    }
+
+    for (i = 0; i < tail->num_stages; i++) {
+        stage* s = &tail->stages[i];
+        switch (s->kind) {
+            case STAGE_MAP:
+                x = call(s->fn, LIST1(x));
+                break;
+            case STAGE_FILTER:
+                if (!call(s->fn, LIST1(x))) goto next_element;
+                break;
+            case STAGE_TAKE:
+                s->n--;
+                break;
+            case STAGE_DROP_WHILE:
+                if (s->n && call(s->fn, LIST1(x))) goto next_element;
+                s->n = 0;
+                break;
+        }
+    }
+
+    l->head = x;
+    l->tail = CAST(tail, LAZY);
+    goto done;
+
+    empty:
+    l->empty = true;
+
+    done:
+    l->forced = true;
+    // Let the source be collected
+    l->rest = NIL;
+    l->fn = NIL;
+    l->stages = NULL;
+}
+
+// Take the next element of a list or lazy sequence, forcing the latter
+static bool next(cell* seq, cell* x) {
+    if (TYPE(*seq) == LAZY) {
+        lazy* l = LAZY_PTR(*seq);
+        force(l);
+        if (l->empty) return false;
+        *x = l->head;
+        *seq = l->tail;
+        return true;
+    }
+    if (!IS_PAIR(*seq)) return false;
+    *x = car(*seq);
+    *seq = cdr(*seq);
+    return true;
+}
+
+// Apply a stage to a list or lazy sequence
+static cell add_stage(cell seq, stage_kind kind, cell fn, int64_t n) {
+    lazy* l;
+    // A generator may have side effects, so it must only run once
+    // rather than once for each pipeline built on it
+    if (TYPE(seq) == LAZY && !LAZY_PTR(seq)->forced && LAZY_PTR(seq)->kind != SOURCE_GENERATE) {
+        // Fuse with the pipeline which hasn't run yet
+        lazy* prev = LAZY_PTR(seq);
+        l = new_lazy(prev->kind, prev->num_stages + 1);
+        stage* stages = l->stages;
+        memcpy(l, prev, sizeof(lazy));
+        l->stages = stages;
+        l->num_stages = prev->num_stages + 1;
+        memcpy(stages, prev->stages, prev->num_stages * sizeof(stage));
+    }
+    else {
+        l = new_lazy(TYPE(seq) == LAZY ? SOURCE_SEQ : SOURCE_LIST, 1);
+        l->rest = seq;
+    }
+    stage* s = &l->stages[l->num_stages - 1];
+    s->kind = kind;
+    s->fn = fn;
+    s->n = n;
+    return CAST(l, LAZY);
+}
+
+cell lazy_range(int argc, cell* argv) {
+    // lazy-range 3 -> 0 1 2
+    // lazy-range 2 5 -> 2 3 4
+    // lazy-range 10 0 -3 -> 10 7 4 1
+    // lazy-range 1 () -> 1 2 3 ...
+    lazy* l = new_lazy(SOURCE_RANGE, 0);
+    l->step = 1;
+    if (argc == 1) {
+        if (!IS_INT(argv[0])) return NIL;
+        l->end = INT_VAL(argv[0]);
+    }
+    else if (argc > 1) {
+        if (!IS_INT(argv[0])) return NIL;
+        l->next = INT_VAL(argv[0]);
+        if (IS_INT(argv[1])) l->end = INT_VAL(argv[1]);
+        else l->unbounded = true;
+        if (argc > 2 && IS_INT(argv[2]) && INT_VAL(argv[2])) l->step = INT_VAL(argv[2]);
+    }
+    else l->unbounded = true;
+    return CAST(l, LAZY);
+}
+
+cell lazy_generate(int argc, cell* argv) {
+    // lazy-generate f -> (f) (f) (f) ... until (f) returns nil
+    if (!argc || !IS_CALLABLE(argv[0])) return NIL;
+    lazy* l = new_lazy(SOURCE_GENERATE, 0);
+    l->fn = argv[0];
+    return CAST(l, LAZY);
+}
+
+cell lazy_map(int argc, cell* argv) {
+    // lazy-map inc (1 2) -> 2 3
+    if (argc < 2 || !IS_CALLABLE(argv[0])) return NIL;
+    return add_stage(argv[1], STAGE_MAP, argv[0], 0);
+}
+
+cell lazy_filter(int argc, cell* argv) {
+    // lazy-filter (lambda x asc x 2) (1 2 3) -> 1
+    if (argc < 2 || !IS_CALLABLE(argv[0])) return NIL;
+    return add_stage(argv[1], STAGE_FILTER, argv[0], 0);
+}
+
+cell take(int argc, cell* argv) {
+    // take 2 (a b c) -> a b
+    if (argc < 2 || !IS_INT(argv[0])) return NIL;
+    int64_t n = INT_VAL(argv[0]);
+    return add_stage(argv[1], STAGE_TAKE, NIL, n > 0 ? n : 0);
+}
+
+cell drop_while(int argc, cell* argv) {
+    // drop-while (lambda x asc x 2) (1 2 3) -> 2 3
+    if (argc < 2 || !IS_CALLABLE(argv[0])) return NIL;
+    return add_stage(argv[1], STAGE_DROP_WHILE, argv[0], 1);
+}
+
+cell realize(int argc, cell* argv) {
+    // realize (lazy-range 3) -> 0 1 2
+    // realize (a b) -> a b
+    if (!argc) return NIL;
+    // The elements are gathered first, so they can be copied into one
+    // compact list
+    size_t n = 0, size = 16, i;
+    cell* items = malloc_or_die(size * sizeof(cell));
+    cell seq = argv[0];
+    cell x;
+    while (next(&seq, &x)) {
+        if (n == size) items = GC_REALLOC(items, (size *= 2) * sizeof(cell));
+        items[n++] = x;
+    }
+    cell rv = make_list(n, NIL), c = rv;
+    for (i = 0; i < n; i++, c = cdr(c)) SET_CAR(c, items[i]);
+    GC_FREE(items);
+    return rv;
+}
+
+cell lazy_first(int argc, cell* argv) {
+    // lazy-first (lazy-range 1 3) -> 1
+    // lazy-first (lazy-range 0) ->
+    cell seq = argc ? argv[0] : NIL;
+    cell x;
+    return next(&seq, &x) ? x : NIL;
+}
+
+cell lazy_rest(int argc, cell* argv) {
+    // lazy-rest (lazy-range 1 3) -> (lazy-range 2 3)
+    cell seq = argc ? argv[0] : NIL;
+    cell x;
+    return next(&seq, &x) ? seq : NIL;
+}
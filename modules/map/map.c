@@ -17,11 +17,16 @@ unsigned int hash64(uint64_t a){
     return hash32(a >> 32) ^ hash32(a);
 }
 
+// Keys may be any structure; those which are deep-equal hash the same
 unsigned int get_key_hash(cell k) {
-    uint64_t k_val = k;
-    if(IS_INT(k)) k_val = INT_VAL(k);
-    else if(TYPE(k) == SYMBOL) k_val = SYM_STR(k);
-    return hash64(k_val);
+    return hash64(deep_hash(k));
+}
+
+// Like assoc, but comparing keys structurally
+cell deep_assoc(cell key, cell dict) {
+    for (; IS_PAIR(dict) && IS_PAIR(car(dict)); dict = cdr(dict))
+        if (deep_equal(key, caar(dict))) return car(dict);
+    return NIL;
 }
 
 // Each node is shaped like:
@@ -47,12 +52,12 @@ cell tree_lookup(cell root, unsigned int keyhash, cell key) {
     } else if(keyhash > node_keyhash) {
         return tree_lookup(cddar(root), keyhash, key);
     } else {
-        return assoc(key, cdddr(root));
+        return deep_assoc(key, cdddr(root));
     }
 }
 
 cell map_lookup(cell args, cell env) {
-    if (!args || TYPE(cdr(args)) != PAIR || TYPE(cdar(args) != MAP)) return NIL;
+    if (!args || !IS_PAIR(cdr(args)) || TYPE(cdar(args) != MAP)) return NIL;
     return tree_lookup(cdar(args), get_key_hash(car(args)), car(args));
 }
 
@@ -72,7 +77,7 @@ void print_tree(cell tree, int level) {
 }
 
 cell mkmap(cell args, cell env) {
-    if (!args || TYPE(car(args)) != PAIR) return NIL;
+    if (!args || !IS_PAIR(car(args))) return NIL;
     args = car(args);
     cell root = NIL;
     while(IS_PAIR(args) && IS_PAIR(car(args))) {
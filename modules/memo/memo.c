@@ -0,0 +1,179 @@
+#include <crisp.h>
+
+// This is a type code which will be filled in when imported
+uint64_t MEMO_TABLE;
+
+// A memo table caches the results of a function by its argument list.
+// Arguments are found with deep-hash and deep-equal, so lists which are
+// equal but were built separately share an entry.
+//
+// A table may be bounded, in which case it evicts entries with the CLOCK
+// algorithm: each entry has a bit set whenever it is used, and a hand sweeps
+// the entries, clearing set bits and evicting the first entry whose bit is
+// already clear. This approximates LRU without reordering on every hit.
+
+typedef struct {
+    cell key;
+    cell value;
+    uint64_t hash;
+    // Next entry in the same bucket, or -1
+    int64_t next;
+    bool referenced;
+} entry;
+
+typedef struct {
+    cell fn;
+    entry* entries;
+    // Each bucket is the index of its first entry, or -1
+    int64_t* buckets;
+    size_t num_buckets;
+    size_t size;
+    size_t count;
+    // The most entries to keep, or 0 for no bound
+    size_t bound;
+    size_t hand;
+    uint64_t hits;
+    uint64_t misses;
+} memo_table;
+
+static void alloc_entries(memo_table* t, size_t size) {
+    t->size = size;
+    t->entries = malloc_or_die(size * sizeof(entry));
+    memset(t->entries, 0, size * sizeof(entry));
+    for (t->num_buckets = 1; t->num_buckets < size; t->num_buckets *= 2);
+    t->buckets = GC_MALLOC_ATOMIC(t->num_buckets * sizeof(int64_t));
+    if (!t->buckets) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    memset(t->buckets, 0xff, t->num_buckets * sizeof(int64_t));
+}
+
+static void link_entry(memo_table* t, size_t i) {
+    int64_t* bucket = &t->buckets[t->entries[i].hash & (t->num_buckets - 1)];
+    t->entries[i].next = *bucket;
+    *bucket = i;
+}
+
+static void unlink_entry(memo_table* t, size_t i) {
+    int64_t* link = &t->buckets[t->entries[i].hash & (t->num_buckets - 1)];
+    while (*link != (int64_t) i) link = &t->entries[*link].next;
+    *link = t->entries[i].next;
+}
+
+static entry* find(memo_table* t, cell key, uint64_t hash) {
+    int64_t i;
+    for (i = t->buckets[hash & (t->num_buckets - 1)]; i >= 0; i = t->entries[i].next) {
+        entry* e = &t->entries[i];
+        if (e->hash == hash && deep_equal(e->key, key)) return e;
+    }
+    return NULL;
+}
+
+// Find a free entry, growing an unbounded table or evicting from a full one
+static size_t free_entry(memo_table* t) {
+    if (t->count < t->size) {
+        // Entries are only freed by clearing the table, so they fill in order
+        return t->count++;
+    }
+    if (!t->bound) {
+        entry* old = t->entries;
+        size_t old_size = t->size;
+        alloc_entries(t, old_size * 2);
+        memcpy(t->entries, old, old_size * sizeof(entry));
+        size_t i;
+        for (i = 0; i < old_size; i++) link_entry(t, i);
+        return t->count++;
+    }
+    while (t->entries[t->hand].referenced) {
+        t->entries[t->hand].referenced = false;
+        t->hand = (t->hand + 1) % t->size;
+    }
+    size_t victim = t->hand;
+    t->hand = (t->hand + 1) % t->size;
+    unlink_entry(t, victim);
+    return victim;
+}
+
+static cell call(cell fn, cell args) {
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+cell memo_table_new(int argc, cell* argv) {
+    // memo.table fn -> MEMO_TABLE<...>, caching results of fn without bound
+    // memo.table fn 1000 -> a table holding at most 1000 results
+    // fn may be nil, to be set later with memo.set-fn
+    if (!argc || (argv[0] && !IS_CALLABLE(argv[0]))) return NIL;
+    memo_table* t = malloc_or_die(sizeof(memo_table));
+    t->fn = argv[0];
+    t->bound = argc > 1 && IS_INT(argv[1]) && INT_VAL(argv[1]) > 0 ? INT_VAL(argv[1]) : 0;
+    t->count = t->hand = 0;
+    t->hits = t->misses = 0;
+    alloc_entries(t, t->bound ? t->bound : 64);
+    return CAST(t, MEMO_TABLE);
+}
+
+cell memo_set_fn(int argc, cell* argv) {
+    // memo.set-fn table fn -> table
+    if (argc < 2 || TYPE(argv[0]) != MEMO_TABLE || !IS_CALLABLE(argv[1])) return NIL;
+    ((memo_table*) PTR(argv[0]))->fn = argv[1];
+    return argv[0];
+}
+
+cell memo_call(int argc, cell* argv) {
+    // memo.call table (1 2) -> fn 1 2, computed only the first time
+    if (!argc || TYPE(argv[0]) != MEMO_TABLE) return NIL;
+    memo_table* t = PTR(argv[0]);
+    if (!t->fn) return NIL;
+    cell key = argc > 1 ? argv[1] : NIL;
+    uint64_t hash = deep_hash(key);
+    entry* e = find(t, key, hash);
+    if (e) {
+        t->hits++;
+        e->referenced = true;
+        return e->value;
+    }
+    t->misses++;
+    cell value = call(t->fn, key);
+    // A recursive call may have cached the same arguments meanwhile
+    if (find(t, key, hash)) return value;
+    size_t i = free_entry(t);
+    e = &t->entries[i];
+    e->key = key;
+    e->value = value;
+    e->hash = hash;
+    e->referenced = false;
+    link_entry(t, i);
+    return value;
+}
+
+// Find the table of a function returned by memo, which keeps it in its
+// closure as memo-table
+static memo_table* table_of(cell c) {
+    if (TYPE(c) == MEMO_TABLE) return PTR(c);
+    if (TYPE(c) != FN) return NULL;
+    static cell name;
+    if (!name) name = sym("memo-table");
+    cell binding = assoc(name, ((fn_t*) PTR(c))->env);
+    if (!binding || TYPE(cdr(binding)) != MEMO_TABLE) return NULL;
+    return PTR(cdr(binding));
+}
+
+cell memo_stats(int argc, cell* argv) {
+    // memo.stats f -> (hits misses entries)
+    memo_table* t = argc ? table_of(argv[0]) : NULL;
+    if (!t) return NIL;
+    return cons(make_int(t->hits), LIST2(make_int(t->misses), make_int(t->count)));
+}
+
+cell memo_clear(int argc, cell* argv) {
+    // memo.clear f -> f, with its cache emptied and its counters reset
+    memo_table* t = argc ? table_of(argv[0]) : NULL;
+    if (!t) return NIL;
+    alloc_entries(t, t->bound ? t->bound : 64);
+    t->count = t->hand = 0;
+    t->hits = t->misses = 0;
+    return argv[0];
+}
@@ -0,0 +1,358 @@
+#include <crisp.h>
+
+// These are type codes which will be filled in when imported
+uint64_t OMAP;
+uint64_t OMAP_CURSOR;
+
+// An ordered map is a persistent B+ tree. Values are kept in the leaves, and
+// each entry of an inner node holds the smallest key below its child, so a
+// search at each level finds the last entry with a key no greater than the
+// one sought. Nodes are never changed once built: an insert copies the path
+// from the root to its leaf and shares everything else.
+//
+// Keys are integers or symbols. Integers are ordered by value and come
+// before all symbols, which are ordered by their names.
+
+#define OMAP_ORDER 32
+// Enough levels for far more entries than fit in memory
+#define OMAP_MAX_DEPTH 16
+
+typedef struct node {
+    int n;
+    bool leaf;
+    cell keys[OMAP_ORDER];
+    union {
+        cell vals[OMAP_ORDER];
+        struct node* kids[OMAP_ORDER];
+    };
+} node;
+
+typedef struct {
+    node* root;
+    size_t len;
+    int depth;
+} omap;
+
+// A cursor walks the leaves in order, remembering its path from the root
+typedef struct {
+    node* path[OMAP_MAX_DEPTH];
+    int index[OMAP_MAX_DEPTH];
+    int depth;
+    cell hi;
+    bool done;
+} cursor;
+
+static inline bool is_key(cell k) {
+    return IS_INT(k) || TYPE(k) == SYMBOL;
+}
+
+static int compare_keys(cell a, cell b) {
+    if (IS_INT(a) && IS_INT(b)) return INT_VAL(a) < INT_VAL(b) ? -1 : INT_VAL(a) > INT_VAL(b);
+    if (IS_INT(a)) return -1;
+    if (IS_INT(b)) return 1;
+    if (a == b) return 0;
+    return strcmp(SYM_STR(a), SYM_STR(b));
+}
+
+// The number of keys in n no greater than k
+static int upper_bound(node* n, cell k) {
+    int lo = 0, hi = n->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compare_keys(n->keys[mid], k) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The number of keys in n less than k
+static int lower_bound(node* n, cell k) {
+    int lo = 0, hi = n->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compare_keys(n->keys[mid], k) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// The child of an inner node which would hold k
+static inline int child_for(node* n, cell k) {
+    int i = upper_bound(n, k);
+    return i ? i - 1 : 0;
+}
+
+static node* copy_node(node* n) {
+    node* c = malloc_or_die(sizeof(node));
+    memcpy(c, n, sizeof(node));
+    return c;
+}
+
+static cell new_omap(node* root, size_t len, int depth) {
+    omap* m = malloc_or_die(sizeof(omap));
+    m->root = root;
+    m->len = len;
+    m->depth = depth;
+    return CAST(m, OMAP);
+}
+
+// Move the upper half of a full node into a new right sibling
+static node* split(node* n) {
+    node* right = malloc_or_die(sizeof(node));
+    int half = n->n / 2;
+    right->leaf = n->leaf;
+    right->n = n->n - half;
+    memcpy(right->keys, n->keys + half, right->n * sizeof(cell));
+    memcpy(right->vals, n->vals + half, right->n * sizeof(cell));
+    n->n = half;
+    return right;
+}
+
+// Return a copy of n with k set to v, setting *right if it had to be split
+// and *added if k is new
+static node* insert(node* n, cell k, cell v, node** right, bool* added) {
+    node* c = copy_node(n);
+    *right = NULL;
+    int i;
+    if (c->leaf) {
+        i = lower_bound(c, k);
+        if (i < c->n && compare_keys(c->keys[i], k) == 0) {
+            c->vals[i] = v;
+            return c;
+        }
+        memmove(c->keys + i + 1, c->keys + i, (c->n - i) * sizeof(cell));
+        memmove(c->vals + i + 1, c->vals + i, (c->n - i) * sizeof(cell));
+        c->keys[i] = k;
+        c->vals[i] = v;
+        *added = true;
+    } else {
+        i = child_for(c, k);
+        node* kid_right;
+        c->kids[i] = insert(c->kids[i], k, v, &kid_right, added);
+        // k may now be the smallest key below this child
+        c->keys[i] = c->kids[i]->keys[0];
+        if (!kid_right) return c;
+        i++;
+        memmove(c->keys + i + 1, c->keys + i, (c->n - i) * sizeof(cell));
+        memmove(c->kids + i + 1, c->kids + i, (c->n - i) * sizeof(node*));
+        c->keys[i] = kid_right->keys[0];
+        c->kids[i] = kid_right;
+    }
+    // A node is split as soon as it fills, so there is always room above
+    if (++c->n == OMAP_ORDER) *right = split(c);
+    return c;
+}
+
+static cell omap_set(omap* m, cell k, cell v) {
+    if (!m->root) {
+        node* leaf = malloc_or_die(sizeof(node));
+        leaf->leaf = true;
+        leaf->n = 1;
+        leaf->keys[0] = k;
+        leaf->vals[0] = v;
+        return new_omap(leaf, 1, 1);
+    }
+    node* right;
+    bool added = false;
+    node* root = insert(m->root, k, v, &right, &added);
+    int depth = m->depth;
+    if (right) {
+        node* top = malloc_or_die(sizeof(node));
+        top->leaf = false;
+        top->n = 2;
+        top->keys[0] = root->keys[0];
+        top->kids[0] = root;
+        top->keys[1] = right->keys[0];
+        top->kids[1] = right;
+        root = top;
+        depth++;
+    }
+    return new_omap(root, m->len + added, depth);
+}
+
+cell omap_new(int argc, cell* argv) {
+    // omap.new () -> an empty OMAP
+    return new_omap(NULL, 0, 0);
+}
+
+cell omap_insert(int argc, cell* argv) {
+    // omap.insert m 5 five -> a new map with 5 mapped to five
+    // Returns nil if the key isn't an integer or a symbol
+    if (argc < 3 || TYPE(argv[0]) != OMAP || !is_key(argv[1])) return NIL;
+    return omap_set(PTR(argv[0]), argv[1], argv[2]);
+}
+
+cell omap_from_list(int argc, cell* argv) {
+    // omap.from-list ((3 . c) (1 . a) (2 . b)) -> an OMAP
+    // Later pairs replace earlier ones with the same key
+    cell m = new_omap(NULL, 0, 0);
+    cell l;
+    for (l = argc ? argv[0] : NIL; IS_PAIR(l); l = cdr(l)) {
+        if (!IS_PAIR(car(l)) || !is_key(caar(l))) return NIL;
+        m = omap_set(PTR(m), caar(l), cdr(car(l)));
+    }
+    return m;
+}
+
+cell omap_len(int argc, cell* argv) {
+    // omap.len m -> the number of keys
+    if (!argc || TYPE(argv[0]) != OMAP) return NIL;
+    return make_int(((omap*) PTR(argv[0]))->len);
+}
+
+// The leaf which would hold k, and the number of its keys no greater than k
+static node* find_leaf(omap* m, cell k, int* i) {
+    node* n = m->root;
+    while (!n->leaf) n = n->kids[child_for(n, k)];
+    *i = upper_bound(n, k);
+    return n;
+}
+
+cell omap_get(int argc, cell* argv) {
+    // omap.get m 5 -> five
+    // Returns nil if the key isn't present
+    if (argc < 2 || TYPE(argv[0]) != OMAP || !is_key(argv[1])) return NIL;
+    omap* m = PTR(argv[0]);
+    if (!m->root) return NIL;
+    int i;
+    node* leaf = find_leaf(m, argv[1], &i);
+    if (!i || compare_keys(leaf->keys[i - 1], argv[1])) return NIL;
+    return leaf->vals[i - 1];
+}
+
+cell omap_floor(int argc, cell* argv) {
+    // omap.floor m 7 -> (5 . five), the entry with the greatest key <= 7
+    if (argc < 2 || TYPE(argv[0]) != OMAP || !is_key(argv[1])) return NIL;
+    omap* m = PTR(argv[0]);
+    if (!m->root) return NIL;
+    // Every subtree holds its first key, so if there is an entry at or
+    // below k it is in the leaf a search for k reaches
+    int i;
+    node* leaf = find_leaf(m, argv[1], &i);
+    if (!i) return NIL;
+    return cons(leaf->keys[i - 1], leaf->vals[i - 1]);
+}
+
+cell omap_min(int argc, cell* argv) {
+    // omap.min m -> the entry with the smallest key
+    if (!argc || TYPE(argv[0]) != OMAP) return NIL;
+    node* n = ((omap*) PTR(argv[0]))->root;
+    if (!n) return NIL;
+    while (!n->leaf) n = n->kids[0];
+    return cons(n->keys[0], n->vals[0]);
+}
+
+cell omap_max(int argc, cell* argv) {
+    // omap.max m -> the entry with the largest key
+    if (!argc || TYPE(argv[0]) != OMAP) return NIL;
+    node* n = ((omap*) PTR(argv[0]))->root;
+    if (!n) return NIL;
+    while (!n->leaf) n = n->kids[n->n - 1];
+    return cons(n->keys[n->n - 1], n->vals[n->n - 1]);
+}
+
+// Step past exhausted leaves, climbing until a node has another child
+static void settle(cursor* c) {
+    int d = c->depth - 1;
+    while (!c->done && c->index[d] == c->path[d]->n) {
+        int up = d - 1;
+        while (up >= 0 && ++c->index[up] == c->path[up]->n) up--;
+        if (up < 0) {
+            c->done = true;
+            return;
+        }
+        for (up++; up <= d; up++) {
+            c->path[up] = c->path[up - 1]->kids[c->index[up - 1]];
+            c->index[up] = 0;
+        }
+    }
+    if (!c->done && c->hi && compare_keys(c->path[d]->keys[c->index[d]], c->hi) >= 0)
+        c->done = true;
+}
+
+// Position a new cursor at the first key no less than lo, stopping before hi
+// Either bound may be nil
+static cursor* seek(omap* m, cell lo, cell hi) {
+    cursor* c = malloc_or_die(sizeof(cursor));
+    c->depth = m->depth;
+    c->hi = hi;
+    c->done = !m->root;
+    if (c->done) return c;
+    node* n = m->root;
+    int d;
+    for (d = 0; d < m->depth; d++) {
+        c->path[d] = n;
+        if (n->leaf) c->index[d] = lo ? lower_bound(n, lo) : 0;
+        else n = n->kids[c->index[d] = lo ? child_for(n, lo) : 0];
+    }
+    settle(c);
+    return c;
+}
+
+// The entry at a cursor, then move it along
+static cell next(cursor* c) {
+    if (c->done) return NIL;
+    node* leaf = c->path[c->depth - 1];
+    int i = c->index[c->depth - 1]++;
+    settle(c);
+    return cons(leaf->keys[i], leaf->vals[i]);
+}
+
+static bool bounds(int argc, cell* argv, cell* lo, cell* hi) {
+    if (!argc || TYPE(argv[0]) != OMAP) return false;
+    *lo = argc > 1 ? argv[1] : NIL;
+    *hi = argc > 2 ? argv[2] : NIL;
+    return (!*lo || is_key(*lo)) && (!*hi || is_key(*hi));
+}
+
+cell omap_ceiling(int argc, cell* argv) {
+    // omap.ceiling m 3 -> (5 . five), the entry with the smallest key >= 3
+    if (argc < 2 || TYPE(argv[0]) != OMAP || !is_key(argv[1])) return NIL;
+    return next(seek(PTR(argv[0]), argv[1], NIL));
+}
+
+cell omap_range(int argc, cell* argv) {
+    // omap.range m 2 6 -> the entries with keys from 2 up to but not including 6
+    // omap.range m 2 () -> the entries from 2 on
+    // omap.range m -> every entry
+    cell lo, hi;
+    if (!bounds(argc, argv, &lo, &hi)) return NIL;
+    cursor* c = seek(PTR(argv[0]), lo, hi);
+    cell rv = NIL;
+    cell* tail = &rv;
+    while (!c->done) {
+        *tail = LIST1(next(c));
+        tail = &((pair*) PTR(*tail))->cdr;
+    }
+    return rv;
+}
+
+cell omap_cursor(int argc, cell* argv) {
+    // omap.cursor m 2 6 -> an OMAP_CURSOR over the same entries as omap.range
+    cell lo, hi;
+    if (!bounds(argc, argv, &lo, &hi)) return NIL;
+    return CAST(seek(PTR(argv[0]), lo, hi), OMAP_CURSOR);
+}
+
+cell omap_next(int argc, cell* argv) {
+    // omap.next cursor -> the next entry, or nil once there are none left
+    if (!argc || TYPE(argv[0]) != OMAP_CURSOR) return NIL;
+    return next(PTR(argv[0]));
+}
+
+static cell call(cell fn, cell args) {
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+cell omap_fold(int argc, cell* argv) {
+    // omap.fold fn init m -> fn (... (fn init first-entry) ...) last-entry
+    // omap.fold fn init m 2 6 -> only over the entries omap.range m 2 6 returns
+    cell lo, hi;
+    if (argc < 3 || !IS_CALLABLE(argv[0]) || !bounds(argc - 2, argv + 2, &lo, &hi)) return NIL;
+    cursor* c = seek(PTR(argv[2]), lo, hi);
+    cell acc = argv[1];
+    while (!c->done) acc = call(argv[0], cons(acc, LIST1(next(c))));
+    return acc;
+}
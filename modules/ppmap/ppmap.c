@@ -0,0 +1,555 @@
+#include <crisp.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// ppmap maps a function over a list in a pool of forked worker processes.
+// Workers are forked from the vm which calls ppmap, so they start with a
+// copy-on-write copy of its heap, its globals and its imported modules, and
+// never share memory with it afterwards. Each call splits the list into
+// chunks, hands them to idle workers over sockets, and joins the results
+// in order.
+//
+// Cells are sent in a compact format: a tag byte, then varints for integers
+// and lengths, the bytes of floats and the names of symbols. Functions are
+// sent as their arguments, body and captured locals, with the global env
+// left to the receiver. Builtins are pointers into code, which is mapped at
+// the same addresses in every worker, so they're sent as they are. Anything
+// else, like channels or the types of modules, is sent as nil.
+//
+// Workers are kept between calls, and forked again when globals have been
+// defined since they were forked, so they see the same definitions as the
+// vm. A worker which dies, by exiting on an error or by a signal, gives
+// nil for every element of the chunk it had, and is replaced.
+//
+// Forking copies only the calling thread, so ppmap shouldn't be used while
+// other threads are evaluating.
+
+// Chunks per worker in each call, so workers which finish early get more
+#define CHUNKS_PER_WORKER 4
+#define MAX_WORKERS 64
+
+enum {
+    TAG_NIL,
+    TAG_PAIR,
+    TAG_INT,
+    TAG_FLOAT,
+    TAG_SYMBOL,
+    TAG_FN,
+    TAG_MACRO,
+    TAG_PURE_MACRO,
+    // The global env at the end of a function's env
+    TAG_GLOBALS,
+    // A cell which means the same in every process, like a builtin
+    TAG_RAW,
+};
+
+typedef struct {
+    pid_t pid;
+    // This end of a socket pair, the worker has the other
+    int fd;
+    // The chunk the worker has, or -1 if it's idle
+    int64_t chunk;
+} worker;
+
+static worker workers[MAX_WORKERS];
+static int num_workers;
+static int max_workers;
+// The vm the workers were forked from, and its def_epoch then
+static crisp_vm* pool_vm;
+static uint64_t pool_epoch;
+static uint64_t chunks_done;
+static uint64_t crashes;
+
+typedef struct {
+    unsigned char* data;
+    size_t len;
+    size_t size;
+} buffer;
+
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+    size_t pos;
+    bool error;
+} reader;
+
+static void put(buffer* b, const void* p, size_t n) {
+    if (b->len + n > b->size) {
+        while (b->len + n > b->size) b->size = b->size ? b->size * 2 : 256;
+        b->data = realloc(b->data, b->size);
+        if (!b->data) {
+            puts("malloc failed");
+            exit(-1);
+        }
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+}
+
+static void put_byte(buffer* b, unsigned char c) {
+    put(b, &c, 1);
+}
+
+static void put_varint(buffer* b, uint64_t x) {
+    unsigned char bytes[10];
+    int n = 0;
+    while (x >= 0x80) {
+        bytes[n++] = x | 0x80;
+        x >>= 7;
+    }
+    bytes[n++] = x;
+    put(b, bytes, n);
+}
+
+static void encode(buffer* b, cell c);
+
+// Encode a function's env up to the global env, which the receiver has its
+// own copy of
+static void encode_env(buffer* b, cell env) {
+    for (; IS_PAIR(env) && env != current_vm->global_env; env = cdr(env)) {
+        put_byte(b, TAG_PAIR);
+        encode(b, car(env));
+    }
+    if (env && env == current_vm->global_env) put_byte(b, TAG_GLOBALS);
+    else encode(b, env);
+}
+
+static void encode(buffer* b, cell c) {
+    // Lists are encoded as a pair tag and car for each element, then the
+    // final cdr, so long lists don't recurse
+    for (; IS_PAIR(c); c = cdr(c)) {
+        put_byte(b, TAG_PAIR);
+        encode(b, car(c));
+    }
+    if (IS_INT(c)) {
+        // Zigzag, so small negative numbers are short too
+        int64_t x = INT_VAL(c);
+        put_byte(b, TAG_INT);
+        put_varint(b, ((uint64_t) x << 1) ^ (uint64_t) (x >> 63));
+        return;
+    }
+    if (IS_FLOAT(c)) {
+        double x = FLOAT_VAL(c);
+        put_byte(b, TAG_FLOAT);
+        put(b, &x, sizeof(double));
+        return;
+    }
+    switch (TYPE(c)) {
+    case SYMBOL: {
+        size_t n = strlen(SYM_STR(c));
+        put_byte(b, TAG_SYMBOL);
+        put_varint(b, n);
+        put(b, SYM_STR(c), n);
+        return;
+    }
+    case FN:
+    case MACRO:
+    case PURE_MACRO: {
+        fn_t* f = PTR(c);
+        put_byte(b, TYPE(c) == FN ? TAG_FN : TYPE(c) == MACRO ? TAG_MACRO : TAG_PURE_MACRO);
+        encode(b, f->args);
+        encode(b, f->body);
+        encode_env(b, f->env);
+        return;
+    }
+    case FFI_SYM:
+    case FFI_LIBRARY:
+    case FFI_FN:
+    case NATIVE_FN:
+    case NATIVE_MACRO:
+    case NATIVE_FN_TCO:
+    case NATIVE_FN_V:
+    case CONS:
+        put_byte(b, TAG_RAW);
+        put(b, &c, sizeof(cell));
+        return;
+    default:
+        put_byte(b, TAG_NIL);
+    }
+}
+
+static bool get(reader* r, void* p, size_t n) {
+    if (r->error || r->len - r->pos < n) {
+        r->error = true;
+        return false;
+    }
+    memcpy(p, r->data + r->pos, n);
+    r->pos += n;
+    return true;
+}
+
+static int get_byte(reader* r) {
+    unsigned char c;
+    return get(r, &c, 1) ? c : -1;
+}
+
+static uint64_t get_varint(reader* r) {
+    uint64_t x = 0;
+    int shift, c;
+    for (shift = 0; shift < 64; shift += 7) {
+        if ((c = get_byte(r)) < 0) return 0;
+        x |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) return x;
+    }
+    r->error = true;
+    return 0;
+}
+
+static cell decode(reader* r);
+
+static cell decode_tag(reader* r, int tag) {
+    switch (tag) {
+    case TAG_PAIR: {
+        cell rv;
+        cell* tail = &rv;
+        while (tag == TAG_PAIR) {
+            *tail = cons(decode(r), NIL);
+            tail = &((pair*) PTR(*tail))->cdr;
+            tag = get_byte(r);
+        }
+        *tail = decode_tag(r, tag);
+        return rv;
+    }
+    case TAG_INT: {
+        uint64_t x = get_varint(r);
+        return make_int((int64_t) (x >> 1) ^ -(int64_t) (x & 1));
+    }
+    case TAG_FLOAT: {
+        double x;
+        return get(r, &x, sizeof(double)) ? make_float(x) : NIL;
+    }
+    case TAG_SYMBOL: {
+        uint64_t n = get_varint(r);
+        if (r->error || r->len - r->pos < n) {
+            r->error = true;
+            return NIL;
+        }
+        char* name = malloc(n + 1);
+        if (!name) {
+            puts("malloc failed");
+            exit(-1);
+        }
+        get(r, name, n);
+        name[n] = '\0';
+        cell rv = sym(name);
+        free(name);
+        return rv;
+    }
+    case TAG_FN:
+    case TAG_MACRO:
+    case TAG_PURE_MACRO: {
+        cell args = decode(r);
+        cell body = decode(r);
+        cell env = decode(r);
+        cell rv = make_fn(args, body, env);
+        return tag == TAG_FN ? rv : CAST(PTR(rv), tag == TAG_MACRO ? MACRO : PURE_MACRO);
+    }
+    case TAG_GLOBALS:
+        return current_vm->global_env;
+    case TAG_RAW: {
+        cell c;
+        return get(r, &c, sizeof(cell)) ? c : NIL;
+    }
+    case TAG_NIL:
+        return NIL;
+    default:
+        r->error = true;
+        return NIL;
+    }
+}
+
+static cell decode(reader* r) {
+    return decode_tag(r, get_byte(r));
+}
+
+// Messages are a 64 bit length and then that many bytes
+static bool write_all(int fd, const void* p, size_t n) {
+    while (n) {
+        // MSG_NOSIGNAL, so writing to a dead worker fails rather than
+        // killing this process with SIGPIPE
+        ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p = (const char*) p + w;
+        n -= w;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* p, size_t n) {
+    while (n) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p = (char*) p + r;
+        n -= r;
+    }
+    return true;
+}
+
+static bool send_message(int fd, buffer* b) {
+    // The first 8 bytes of the buffer are left for the length
+    uint64_t n = b->len - sizeof(uint64_t);
+    memcpy(b->data, &n, sizeof(uint64_t));
+    return write_all(fd, b->data, b->len);
+}
+
+static bool receive_message(int fd, buffer* b) {
+    uint64_t n;
+    if (!read_all(fd, &n, sizeof(uint64_t))) return false;
+    b->len = 0;
+    if (n > b->size) {
+        free(b->data);
+        b->data = NULL;
+        b->size = n;
+        if (!(b->data = malloc(n))) {
+            puts("malloc failed");
+            exit(-1);
+        }
+    }
+    if (!read_all(fd, b->data, n)) return false;
+    b->len = n;
+    return true;
+}
+
+static cell call(cell fn, cell args) {
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+// A worker reads a function and a chunk, and replies with the function
+// applied to each element, until the vm closes its socket
+static void serve(int fd) {
+    buffer in = {0}, out = {0};
+    while (receive_message(fd, &in)) {
+        reader r = {in.data, in.len, 0, false};
+        cell fn = decode(&r);
+        cell items = decode(&r);
+        if (r.error) break;
+        out.len = 0;
+        put(&out, &out.len, sizeof(uint64_t));
+        for (; IS_PAIR(items); items = cdr(items)) {
+            put_byte(&out, TAG_PAIR);
+            encode(&out, call(fn, LIST1(car(items))));
+        }
+        put_byte(&out, TAG_NIL);
+        // Output of fn shouldn't wait for the worker to exit
+        fflush(NULL);
+        if (!send_message(fd, &out)) break;
+    }
+    _exit(0);
+}
+
+static bool spawn(int i) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) return false;
+    // Buffered output would otherwise be written again by the worker
+    fflush(NULL);
+#ifndef FUZZ
+    GC_atfork_prepare();
+#endif
+    pid_t pid = fork();
+    if (!pid) {
+#ifndef FUZZ
+        GC_atfork_child();
+#endif
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        // The worker mustn't hold other workers' sockets open, or they
+        // wouldn't see the vm close them. A ppmap in the worker forks a
+        // pool of its own
+        int j;
+        for (j = 0; j < num_workers; j++)
+            if (j != i) close(workers[j].fd);
+        num_workers = 0;
+        pool_vm = NULL;
+        close(sv[0]);
+        serve(sv[1]);
+    }
+#ifndef FUZZ
+    GC_atfork_parent();
+#endif
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return false;
+    }
+    workers[i] = (worker) {pid, sv[0], -1};
+    return true;
+}
+
+static void stop_pool(void) {
+    int i;
+    // Workers exit when their sockets are closed
+    for (i = 0; i < num_workers; i++) close(workers[i].fd);
+    for (i = 0; i < num_workers; i++) waitpid(workers[i].pid, NULL, 0);
+    num_workers = 0;
+    pool_vm = NULL;
+}
+
+static int pool_size(void) {
+    if (!max_workers) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_workers = cpus < 1 ? 1 : cpus > MAX_WORKERS ? MAX_WORKERS : cpus;
+    }
+    return max_workers;
+}
+
+// Make sure there are workers which have the vm's current globals
+static bool start_pool(void) {
+    if (num_workers && pool_vm == current_vm && pool_epoch == current_vm->def_epoch)
+        return true;
+    stop_pool();
+    int n = pool_size();
+    while (num_workers < n && spawn(num_workers)) num_workers++;
+    pool_vm = current_vm;
+    pool_epoch = current_vm->def_epoch;
+    return num_workers > 0;
+}
+
+// Replace a worker which has died, giving nil for each element of its chunk
+static void replace(int i, cell* results, size_t* bounds) {
+    int64_t chunk = workers[i].chunk;
+    close(workers[i].fd);
+    waitpid(workers[i].pid, NULL, 0);
+    crashes++;
+    size_t k;
+    results[chunk] = NIL;
+    for (k = bounds[chunk]; k < bounds[chunk + 1]; k++) results[chunk] = cons(NIL, results[chunk]);
+    if (!spawn(i)) {
+        // Without a replacement, move the last worker into this slot
+        workers[i] = workers[--num_workers];
+        workers[num_workers].chunk = -1;
+    }
+}
+
+static cell ppmap_list(cell fn, cell l) {
+    size_t n = 0, i;
+    cell c;
+    for (c = l; IS_PAIR(c); c = cdr(c)) n++;
+    if (!n) return NIL;
+    if (!start_pool()) {
+        // Without workers, map on this process
+        cell rv = NIL, *tail = &rv;
+        for (c = l; IS_PAIR(c); c = cdr(c)) {
+            *tail = cons(call(fn, LIST1(car(c))), NIL);
+            tail = &((pair*) PTR(*tail))->cdr;
+        }
+        return rv;
+    }
+
+    cell* items = malloc_or_die(n * sizeof(cell));
+    for (c = l, i = 0; IS_PAIR(c); c = cdr(c), i++) items[i] = car(c);
+    size_t chunks = n < (size_t) num_workers * CHUNKS_PER_WORKER ? n : (size_t) num_workers * CHUNKS_PER_WORKER;
+    size_t bounds[chunks + 1];
+    for (i = 0; i <= chunks; i++) bounds[i] = n * i / chunks;
+    cell* results = malloc_or_die(chunks * sizeof(cell));
+
+    // The function is encoded once, and copied into each request
+    buffer fn_buf = {0}, out = {0}, in = {0};
+    encode(&fn_buf, fn);
+    size_t next = 0, done = 0;
+    int w;
+    while (done < chunks) {
+        // Hand chunks to idle workers
+        for (w = 0; w < num_workers && next < chunks; w++) {
+            if (workers[w].chunk >= 0) continue;
+            out.len = 0;
+            put(&out, &out.len, sizeof(uint64_t));
+            put(&out, fn_buf.data, fn_buf.len);
+            for (i = bounds[next]; i < bounds[next + 1]; i++) {
+                put_byte(&out, TAG_PAIR);
+                encode(&out, items[i]);
+            }
+            put_byte(&out, TAG_NIL);
+            workers[w].chunk = next++;
+            if (!send_message(workers[w].fd, &out)) {
+                replace(w, results, bounds);
+                done++;
+            }
+        }
+        if (done == chunks) break;
+
+        // Wait for any busy worker to reply
+        struct pollfd fds[num_workers];
+        int busy = 0;
+        for (w = 0; w < num_workers; w++)
+            if (workers[w].chunk >= 0) fds[busy++] = (struct pollfd) {workers[w].fd, POLLIN, 0};
+        if (!busy) {
+            // Every worker died and couldn't be replaced
+            for (; next < chunks; next++) {
+                results[next] = NIL;
+                for (i = bounds[next]; i < bounds[next + 1]; i++) results[next] = cons(NIL, results[next]);
+                done++;
+            }
+            break;
+        }
+        if (poll(fds, busy, -1) < 0) continue;
+        int f;
+        for (f = 0; f < busy; f++) {
+            if (!fds[f].revents) continue;
+            // A replacement earlier in this loop may have closed the fd,
+            // or reused its number for an idle worker
+            for (w = 0; w < num_workers && workers[w].fd != fds[f].fd; w++);
+            if (w == num_workers || workers[w].chunk < 0) continue;
+            int64_t chunk = workers[w].chunk;
+            done++;
+            if (!receive_message(workers[w].fd, &in)) {
+                replace(w, results, bounds);
+                continue;
+            }
+            reader r = {in.data, in.len, 0, false};
+            results[chunk] = decode(&r);
+            workers[w].chunk = -1;
+            chunks_done++;
+        }
+    }
+    free(fn_buf.data);
+    free(out.data);
+    free(in.data);
+
+    // The result lists are new, so they can be joined in place
+    cell rv = NIL, *tail = &rv;
+    for (i = 0; i < chunks; i++) {
+        *tail = results[i];
+        while (IS_PAIR(*tail)) tail = &((pair*) PTR(*tail))->cdr;
+    }
+    GC_FREE(items);
+    GC_FREE(results);
+    return rv;
+}
+
+cell ppmap_fn(int argc, cell* argv) {
+    // ppmap (lambda x product x x) (1 2 3) -> (1 4 9), computed by workers
+    // ppmap f () -> ()
+    if (argc < 2 || !IS_CALLABLE(argv[0])) return NIL;
+    return ppmap_list(argv[0], argv[1]);
+}
+
+cell ppmap_workers(int argc, cell* argv) {
+    // ppmap.workers 4 -> 4, using 4 workers from the next call on
+    // ppmap.workers -> the pool size, by default the number of CPUs
+    if (argc && IS_INT(argv[0]) && INT_VAL(argv[0]) > 0) {
+        max_workers = INT_VAL(argv[0]) < MAX_WORKERS ? INT_VAL(argv[0]) : MAX_WORKERS;
+        if (num_workers != max_workers) stop_pool();
+    }
+    return make_int(pool_size());
+}
+
+cell ppmap_stop(int argc, cell* argv) {
+    // ppmap.stop () -> nil, after the workers have exited
+    // They're forked again by the next call
+    stop_pool();
+    return NIL;
+}
+
+cell ppmap_stats(int argc, cell* argv) {
+    // ppmap.stats () -> (workers chunks crashes), the live workers, and the
+    // chunks done and workers lost since the module was imported
+    return cons(make_int(num_workers), LIST2(make_int(chunks_done), make_int(crashes)));
+}
@@ -1,3 +1,389 @@
 #include <crisp.h>
 
-// Nothing here. This file exists to make the CMake template a little simpler
\ No newline at end of file
+// This is a type code which will be filled in when imported
+uint64_t DEQUE;
+
+// A persistent deque, implemented as a 2-3 finger tree annotated with sizes
+// (Hinze and Paterson, "Finger trees: a simple general-purpose data structure")
+
+// Pushing and popping at either end take amortized constant time, length is
+// constant time, and concatenation, splitting and indexing are logarithmic.
+// Trees are never modified once built, so every version remains valid.
+
+// The items of a tree at depth 0 are elements, and the items of a tree at
+// depth d > 0 are nodes of 2 or 3 items from depth d - 1
+
+typedef struct {
+    int64_t size;
+    int n;
+    cell items[3];
+} node;
+
+typedef enum {
+    EMPTY,
+    SINGLE,
+    DEEP,
+} tree_kind;
+
+typedef struct tree {
+    tree_kind kind;
+    int64_t size;
+    // For a SINGLE tree, the only item is pre[0]
+    int pn;
+    int sn;
+    cell pre[4];
+    cell suf[4];
+    struct tree* mid;
+} tree;
+
+static tree empty = {EMPTY, 0, 0, 0, {0}, {0}, NULL};
+
+static int64_t item_size(cell item, int depth) {
+    return depth ? ((node*) item)->size : 1;
+}
+
+static int64_t digit_size(cell* items, int n, int depth) {
+    int64_t size = 0;
+    int i;
+    for (i = 0; i < n; i++) size += item_size(items[i], depth);
+    return size;
+}
+
+static cell make_node(cell* items, int n, int depth) {
+    node* nd = malloc_or_die(sizeof(node));
+    nd->n = n;
+    memcpy(nd->items, items, n * sizeof(cell));
+    nd->size = digit_size(items, n, depth);
+    return (cell) nd;
+}
+
+static tree* single(cell item, int depth) {
+    tree* t = malloc_or_die(sizeof(tree));
+    t->kind = SINGLE;
+    t->size = item_size(item, depth);
+    t->pn = 1;
+    t->sn = 0;
+    t->pre[0] = item;
+    t->mid = NULL;
+    return t;
+}
+
+static tree* deep(cell* pre, int pn, tree* mid, cell* suf, int sn, int depth) {
+    tree* t = malloc_or_die(sizeof(tree));
+    t->kind = DEEP;
+    t->pn = pn;
+    t->sn = sn;
+    memcpy(t->pre, pre, pn * sizeof(cell));
+    memcpy(t->suf, suf, sn * sizeof(cell));
+    t->mid = mid;
+    t->size = digit_size(pre, pn, depth) + mid->size + digit_size(suf, sn, depth);
+    return t;
+}
+
+static tree* push_front(tree* t, cell item, int depth) {
+    if (t->kind == EMPTY) return single(item, depth);
+    if (t->kind == SINGLE) return deep(&item, 1, &empty, t->pre, 1, depth);
+    cell pre[4];
+    pre[0] = item;
+    if (t->pn < 4) {
+        memcpy(pre + 1, t->pre, t->pn * sizeof(cell));
+        return deep(pre, t->pn + 1, t->mid, t->suf, t->sn, depth);
+    }
+    // The prefix is full, so push three of its items down a level
+    pre[1] = t->pre[0];
+    tree* mid = push_front(t->mid, make_node(t->pre + 1, 3, depth), depth + 1);
+    return deep(pre, 2, mid, t->suf, t->sn, depth);
+}
+
+static tree* push_back(tree* t, cell item, int depth) {
+    if (t->kind == EMPTY) return single(item, depth);
+    if (t->kind == SINGLE) return deep(t->pre, 1, &empty, &item, 1, depth);
+    cell suf[4];
+    if (t->sn < 4) {
+        memcpy(suf, t->suf, t->sn * sizeof(cell));
+        suf[t->sn] = item;
+        return deep(t->pre, t->pn, t->mid, suf, t->sn + 1, depth);
+    }
+    tree* mid = push_back(t->mid, make_node(t->suf, 3, depth), depth + 1);
+    suf[0] = t->suf[3];
+    suf[1] = item;
+    return deep(t->pre, t->pn, mid, suf, 2, depth);
+}
+
+static tree* from_items(cell* items, int n, int depth) {
+    tree* t = &empty;
+    int i;
+    for (i = 0; i < n; i++) t = push_back(t, items[i], depth);
+    return t;
+}
+
+static tree* pop_front(tree* t, cell* item, int depth);
+static tree* pop_back(tree* t, cell* item, int depth);
+
+// Build a deep tree whose prefix may be empty, borrowing from the middle
+static tree* deep_left(cell* pre, int pn, tree* mid, cell* suf, int sn, int depth) {
+    if (pn) return deep(pre, pn, mid, suf, sn, depth);
+    if (mid->kind == EMPTY) return from_items(suf, sn, depth);
+    cell item;
+    mid = pop_front(mid, &item, depth + 1);
+    node* nd = (node*) item;
+    return deep(nd->items, nd->n, mid, suf, sn, depth);
+}
+
+// Build a deep tree whose suffix may be empty, borrowing from the middle
+static tree* deep_right(cell* pre, int pn, tree* mid, cell* suf, int sn, int depth) {
+    if (sn) return deep(pre, pn, mid, suf, sn, depth);
+    if (mid->kind == EMPTY) return from_items(pre, pn, depth);
+    cell item;
+    mid = pop_back(mid, &item, depth + 1);
+    node* nd = (node*) item;
+    return deep(pre, pn, mid, nd->items, nd->n, depth);
+}
+
+static tree* pop_front(tree* t, cell* item, int depth) {
+    *item = t->pre[0];
+    if (t->kind == SINGLE) return &empty;
+    return deep_left(t->pre + 1, t->pn - 1, t->mid, t->suf, t->sn, depth);
+}
+
+static tree* pop_back(tree* t, cell* item, int depth) {
+    if (t->kind == SINGLE) {
+        *item = t->pre[0];
+        return &empty;
+    }
+    *item = t->suf[t->sn - 1];
+    return deep_right(t->pre, t->pn, t->mid, t->suf, t->sn - 1, depth);
+}
+
+// Concatenate two trees with up to 12 loose items between them
+static tree* append(tree* l, cell* items, int n, tree* r, int depth) {
+    int i;
+    if (l->kind == EMPTY) {
+        for (i = n - 1; i >= 0; i--) r = push_front(r, items[i], depth);
+        return r;
+    }
+    if (r->kind == EMPTY) {
+        for (i = 0; i < n; i++) l = push_back(l, items[i], depth);
+        return l;
+    }
+    if (l->kind == SINGLE) return push_front(append(&empty, items, n, r, depth), l->pre[0], depth);
+    if (r->kind == SINGLE) return push_back(append(l, items, n, &empty, depth), r->pre[0], depth);
+
+    // Group the items between the two middles into nodes
+    cell loose[12];
+    int num_loose = 0;
+    memcpy(loose, l->suf, l->sn * sizeof(cell));
+    num_loose += l->sn;
+    memcpy(loose + num_loose, items, n * sizeof(cell));
+    num_loose += n;
+    memcpy(loose + num_loose, r->pre, r->pn * sizeof(cell));
+    num_loose += r->pn;
+
+    cell nodes[4];
+    int num_nodes = 0;
+    i = 0;
+    while (num_loose - i > 4) {
+        nodes[num_nodes++] = make_node(loose + i, 3, depth);
+        i += 3;
+    }
+    if (num_loose - i == 4) {
+        nodes[num_nodes++] = make_node(loose + i, 2, depth);
+        nodes[num_nodes++] = make_node(loose + i + 2, 2, depth);
+    }
+    else nodes[num_nodes++] = make_node(loose + i, num_loose - i, depth);
+
+    tree* mid = append(l->mid, nodes, num_nodes, r->mid, depth + 1);
+    return deep(l->pre, l->pn, mid, r->suf, r->sn, depth);
+}
+
+// Find the item of a digit or node containing the element at index i,
+// leaving i as the index within that item
+static int find_item(cell* items, int n, int64_t* i, int depth) {
+    int j;
+    for (j = 0; j < n - 1; j++) {
+        int64_t size = item_size(items[j], depth);
+        if (*i < size) break;
+        *i -= size;
+    }
+    return j;
+}
+
+// Split a non-empty tree around the item containing the element at index i,
+// leaving i as the index within that item
+static void split_tree(tree* t, int64_t* i, int depth, tree** l, cell* item, tree** r) {
+    if (t->kind == SINGLE) {
+        *l = *r = &empty;
+        *item = t->pre[0];
+        return;
+    }
+    int64_t pre_size = digit_size(t->pre, t->pn, depth);
+    if (*i < pre_size) {
+        int j = find_item(t->pre, t->pn, i, depth);
+        *l = from_items(t->pre, j, depth);
+        *item = t->pre[j];
+        *r = deep_left(t->pre + j + 1, t->pn - j - 1, t->mid, t->suf, t->sn, depth);
+        return;
+    }
+    *i -= pre_size;
+    if (*i < t->mid->size) {
+        tree* ml;
+        tree* mr;
+        cell mid_item;
+        split_tree(t->mid, i, depth + 1, &ml, &mid_item, &mr);
+        node* nd = (node*) mid_item;
+        int j = find_item(nd->items, nd->n, i, depth);
+        *l = deep_right(t->pre, t->pn, ml, nd->items, j, depth);
+        *item = nd->items[j];
+        *r = deep_left(nd->items + j + 1, nd->n - j - 1, mr, t->suf, t->sn, depth);
+        return;
+    }
+    *i -= t->mid->size;
+    int j = find_item(t->suf, t->sn, i, depth);
+    *l = deep_right(t->pre, t->pn, t->mid, t->suf, j, depth);
+    *item = t->suf[j];
+    *r = from_items(t->suf + j + 1, t->sn - j - 1, depth);
+}
+
+static cell nth(tree* t, int64_t i) {
+    // Find the item containing the element at index i
+    int depth = 0;
+    cell item;
+    while (1) {
+        if (t->kind == SINGLE) {
+            item = t->pre[0];
+            break;
+        }
+        int64_t pre_size = digit_size(t->pre, t->pn, depth);
+        if (i < pre_size) {
+            item = t->pre[find_item(t->pre, t->pn, &i, depth)];
+            break;
+        }
+        i -= pre_size;
+        if (i >= t->mid->size) {
+            i -= t->mid->size;
+            item = t->suf[find_item(t->suf, t->sn, &i, depth)];
+            break;
+        }
+        t = t->mid;
+        depth++;
+    }
+    // Then descend through nodes to the element itself
+    for (; depth; depth--) {
+        node* nd = (node*) item;
+        item = nd->items[find_item(nd->items, nd->n, &i, depth - 1)];
+    }
+    return item;
+}
+
+#define TREE(c) ((tree*) PTR(c))
+#define DEQUE_OF(t) CAST(t, DEQUE)
+#define IS_DEQUE(c) (TYPE(c) == DEQUE)
+
+cell deque_new(int argc, cell* argv) {
+    // deque.new () -> an empty deque
+    return DEQUE_OF(&empty);
+}
+
+cell deque_from_list(int argc, cell* argv) {
+    // deque.from-list (1 2 3) -> a deque of 1 2 3
+    tree* t = &empty;
+    cell l;
+    for (l = argc ? argv[0] : NIL; IS_PAIR(l); l = cdr(l)) t = push_back(t, car(l), 0);
+    return DEQUE_OF(t);
+}
+
+cell deque_to_list(int argc, cell* argv) {
+    // deque.to-list q -> 1 2 3
+    if (!argc || !IS_DEQUE(argv[0])) return NIL;
+    tree* t = TREE(argv[0]);
+    cell rv = NIL;
+    cell item;
+    while (t->kind != EMPTY) {
+        t = pop_back(t, &item, 0);
+        rv = cons(item, rv);
+    }
+    return rv;
+}
+
+cell deque_cons(int argc, cell* argv) {
+    // deque.cons x q -> q with x at the front
+    if (argc < 2 || !IS_DEQUE(argv[1])) return NIL;
+    return DEQUE_OF(push_front(TREE(argv[1]), argv[0], 0));
+}
+
+cell deque_snoc(int argc, cell* argv) {
+    // deque.snoc q x -> q with x at the back
+    if (argc < 2 || !IS_DEQUE(argv[0])) return NIL;
+    return DEQUE_OF(push_back(TREE(argv[0]), argv[1], 0));
+}
+
+cell deque_head(int argc, cell* argv) {
+    // deque.head q -> the first element, or nil if q is empty
+    if (!argc || !IS_DEQUE(argv[0]) || TREE(argv[0])->kind == EMPTY) return NIL;
+    return TREE(argv[0])->pre[0];
+}
+
+cell deque_last(int argc, cell* argv) {
+    // deque.last q -> the last element, or nil if q is empty
+    if (!argc || !IS_DEQUE(argv[0])) return NIL;
+    tree* t = TREE(argv[0]);
+    if (t->kind == EMPTY) return NIL;
+    return t->kind == SINGLE ? t->pre[0] : t->suf[t->sn - 1];
+}
+
+cell deque_tail(int argc, cell* argv) {
+    // deque.tail q -> q without its first element
+    if (!argc || !IS_DEQUE(argv[0])) return NIL;
+    tree* t = TREE(argv[0]);
+    cell item;
+    return t->kind == EMPTY ? argv[0] : DEQUE_OF(pop_front(t, &item, 0));
+}
+
+cell deque_init(int argc, cell* argv) {
+    // deque.init q -> q without its last element
+    if (!argc || !IS_DEQUE(argv[0])) return NIL;
+    tree* t = TREE(argv[0]);
+    cell item;
+    return t->kind == EMPTY ? argv[0] : DEQUE_OF(pop_back(t, &item, 0));
+}
+
+cell deque_len(int argc, cell* argv) {
+    // deque.len q -> the number of elements
+    if (!argc || !IS_DEQUE(argv[0])) return NIL;
+    return make_int(TREE(argv[0])->size);
+}
+
+cell deque_empty(int argc, cell* argv) {
+    // deque.empty q -> true if q has no elements
+    if (!argc || !IS_DEQUE(argv[0]) || TREE(argv[0])->kind != EMPTY) return NIL;
+    return sym("true");
+}
+
+cell deque_concat(int argc, cell* argv) {
+    // deque.concat a b -> the elements of a followed by those of b
+    if (argc < 2 || !IS_DEQUE(argv[0]) || !IS_DEQUE(argv[1])) return NIL;
+    return DEQUE_OF(append(TREE(argv[0]), NULL, 0, TREE(argv[1]), 0));
+}
+
+cell deque_split(int argc, cell* argv) {
+    // deque.split q 2 -> (first two elements) . (the rest)
+    if (argc < 2 || !IS_DEQUE(argv[0]) || !IS_INT(argv[1])) return NIL;
+    tree* t = TREE(argv[0]);
+    int64_t i = INT_VAL(argv[1]);
+    if (i <= 0) return cons(DEQUE_OF(&empty), argv[0]);
+    if (i >= t->size) return cons(argv[0], DEQUE_OF(&empty));
+    tree* l;
+    tree* r;
+    cell item;
+    split_tree(t, &i, 0, &l, &item, &r);
+    return cons(DEQUE_OF(l), DEQUE_OF(push_front(r, item, 0)));
+}
+
+cell deque_nth(int argc, cell* argv) {
+    // deque.nth q 0 -> the first element
+    if (argc < 2 || !IS_DEQUE(argv[0]) || !IS_INT(argv[1])) return NIL;
+    tree* t = TREE(argv[0]);
+    int64_t i = INT_VAL(argv[1]);
+    if (i < 0 || i >= t->size) return NIL;
+    return nth(t, i);
+}
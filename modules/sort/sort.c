@@ -0,0 +1,254 @@
+#include <crisp.h>
+#include <unistd.h>
+
+// Lists are sorted in arrays: their elements are copied into an array,
+// sorted there, and the result is built as a compact list. Sorts are
+// stable and order elements like compare does.
+//
+// Lists of fixnums are sorted with an LSD radix sort, which makes a pass
+// over the array for each byte of the keys, skipping bytes which are the
+// same in every key. Anything else is merge sorted. Large arrays of numbers
+// and symbols are split between threads, which sort their parts and then
+// merge them pairwise. compare doesn't allocate for those, so the threads
+// never touch the collector or the vm.
+
+// The fewest elements worth sorting on more than one thread
+#define PARALLEL_MIN (1 << 16)
+// Ranges at most this long are insertion sorted
+#define INSERTION_MAX 16
+
+typedef struct {
+    cell key;
+    cell value;
+} entry;
+
+static int max_threads;
+
+static cell call(cell fn, cell args) {
+    cell env = current_vm->global_env;
+    if (apply(fn, &args, &env)) return eval(args, env);
+    return args;
+}
+
+// Build a compact list from n values, either in an array of cells or in
+// the values of entries
+static cell build_list(cell* values, entry* entries, size_t n) {
+    cell rv = make_list(n, NIL), c = rv;
+    size_t i;
+    for (i = 0; i < n; i++, c = cdr(c)) SET_CAR(c, values ? values[i] : entries[i].value);
+    return rv;
+}
+
+// Sort n fixnum keys, moving values along with them if there are any. The
+// sorted keys and values end up in keys and values
+static void radix_sort(cell* keys, cell* values, size_t n) {
+    size_t counts[4][256] = {{0}};
+    size_t i;
+    int pass;
+    // Flip the sign bit, so negative numbers sort first as unsigned bytes
+    for (i = 0; i < n; i++) {
+        uint32_t k = (uint32_t) keys[i] ^ 0x80000000;
+        for (pass = 0; pass < 4; pass++) counts[pass][(k >> (8 * pass)) & 0xff]++;
+    }
+    // Fixnums aren't pointers, so the collector needn't scan the keys
+    cell* key_buf = GC_MALLOC_ATOMIC(n * sizeof(cell));
+    if (!key_buf) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    cell* value_buf = values ? malloc_or_die(n * sizeof(cell)) : NULL;
+    cell *from_keys = keys, *from_values = values;
+    cell *to_keys = key_buf, *to_values = value_buf;
+    for (pass = 0; pass < 4; pass++) {
+        size_t* count = counts[pass];
+        int shift = 8 * pass;
+        // A pass where every key has the same byte would change nothing
+        if (count[((uint32_t) from_keys[0] ^ 0x80000000) >> shift & 0xff] == n) continue;
+        size_t offset = 0;
+        int b;
+        for (b = 0; b < 256; b++) {
+            size_t c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        for (i = 0; i < n; i++) {
+            size_t at = count[((uint32_t) from_keys[i] ^ 0x80000000) >> shift & 0xff]++;
+            to_keys[at] = from_keys[i];
+            if (values) to_values[at] = from_values[i];
+        }
+        cell* t = from_keys;
+        from_keys = to_keys;
+        to_keys = t;
+        t = from_values;
+        from_values = to_values;
+        to_values = t;
+    }
+    if (from_keys != keys) {
+        memcpy(keys, from_keys, n * sizeof(cell));
+        if (values) memcpy(values, from_values, n * sizeof(cell));
+    }
+    GC_FREE(key_buf);
+    if (value_buf) GC_FREE(value_buf);
+}
+
+// Merge the sorted ranges src[lo, mid) and src[mid, hi) into dst[lo, hi),
+// preferring the left range when keys are equal to keep the sort stable
+static void merge(entry* src, entry* dst, size_t lo, size_t mid, size_t hi) {
+    size_t i = lo, j = mid, k = lo;
+    while (i < mid && j < hi)
+        dst[k++] = compare(src[j].key, src[i].key) < 0 ? src[j++] : src[i++];
+    while (i < mid) dst[k++] = src[i++];
+    while (j < hi) dst[k++] = src[j++];
+}
+
+// Sort a[lo, hi), using the same range of tmp as scratch space
+static void merge_sort(entry* a, entry* tmp, size_t lo, size_t hi) {
+    if (hi - lo <= INSERTION_MAX) {
+        size_t i, j;
+        for (i = lo + 1; i < hi; i++) {
+            entry e = a[i];
+            for (j = i; j > lo && compare(e.key, a[j - 1].key) < 0; j--) a[j] = a[j - 1];
+            a[j] = e;
+        }
+        return;
+    }
+    size_t mid = lo + (hi - lo) / 2;
+    merge_sort(a, tmp, lo, mid);
+    merge_sort(a, tmp, mid, hi);
+    // Sorted input needs no merging
+    if (compare(a[mid].key, a[mid - 1].key) >= 0) return;
+    memcpy(tmp + lo, a + lo, (hi - lo) * sizeof(entry));
+    merge(tmp, a, lo, mid, hi);
+}
+
+typedef struct {
+    entry* a;
+    entry* tmp;
+    size_t lo;
+    size_t mid;
+    size_t hi;
+    pthread_t thread;
+    bool started;
+} job;
+
+static void* sort_job(void* arg) {
+    job* j = arg;
+    merge_sort(j->a, j->tmp, j->lo, j->hi);
+    return NULL;
+}
+
+static void* merge_job(void* arg) {
+    job* j = arg;
+    memcpy(j->tmp + j->lo, j->a + j->lo, (j->hi - j->lo) * sizeof(entry));
+    merge(j->tmp, j->a, j->lo, j->mid, j->hi);
+    return NULL;
+}
+
+// Run jobs on their own threads, or on this one if a thread can't be made
+static void run_jobs(job* jobs, int n, void* (* fn)(void*)) {
+    int i;
+    for (i = 0; i < n; i++)
+        jobs[i].started = !pthread_create(&jobs[i].thread, NULL, fn, &jobs[i]);
+    for (i = 0; i < n; i++) {
+        if (jobs[i].started) pthread_join(jobs[i].thread, NULL);
+        else fn(&jobs[i]);
+    }
+}
+
+// Split the array into parts, sort them in parallel, then merge adjacent
+// parts in parallel until one is left
+static void parallel_sort(entry* a, entry* tmp, size_t n, int threads) {
+    int parts = 1;
+    while (parts * 2 <= threads && n / (parts * 2) >= PARALLEL_MIN / 2) parts *= 2;
+    size_t bounds[parts + 1];
+    job jobs[parts];
+    int i;
+    for (i = 0; i <= parts; i++) bounds[i] = n * i / parts;
+    for (i = 0; i < parts; i++)
+        jobs[i] = (job) {a, tmp, bounds[i], 0, bounds[i + 1]};
+    run_jobs(jobs, parts, sort_job);
+    int width;
+    for (width = 1; width < parts; width *= 2) {
+        int merges = 0;
+        for (i = 0; i + width < parts; i += 2 * width)
+            jobs[merges++] = (job) {a, tmp, bounds[i], bounds[i + width], bounds[i + 2 * width]};
+        run_jobs(jobs, merges, merge_job);
+    }
+}
+
+static int threads(void) {
+    if (!max_threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_threads = cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+    }
+    return max_threads;
+}
+
+// Sort a list by keys, which are the elements themselves if fn is nil
+static cell sort_list(cell l, cell fn) {
+    size_t n = 0;
+    cell c;
+    for (c = l; IS_PAIR(c); c = cdr(c)) n++;
+    if (!n) return NIL;
+
+    cell* keys = malloc_or_die(n * sizeof(cell));
+    bool fixnums = true, atoms = true;
+    size_t i = 0;
+    for (c = l; IS_PAIR(c); c = cdr(c), i++) {
+        keys[i] = fn ? call(fn, LIST1(car(c))) : car(c);
+        fixnums = fixnums && TYPE(keys[i]) == S32;
+        atoms = atoms && (IS_NUMBER(keys[i]) || TYPE(keys[i]) == SYMBOL);
+    }
+
+    cell rv;
+    if (fixnums) {
+        cell* values = NULL;
+        if (fn) {
+            values = malloc_or_die(n * sizeof(cell));
+            for (c = l, i = 0; IS_PAIR(c); c = cdr(c), i++) values[i] = car(c);
+        }
+        radix_sort(keys, values, n);
+        rv = build_list(values ? values : keys, NULL, n);
+        if (values) GC_FREE(values);
+    } else {
+        entry* entries = malloc_or_die(n * sizeof(entry));
+        entry* tmp = malloc_or_die(n * sizeof(entry));
+        for (c = l, i = 0; IS_PAIR(c); c = cdr(c), i++)
+            entries[i] = (entry) {keys[i], car(c)};
+        // Comparing pairs may allocate, so only atoms are sorted in parallel
+        if (atoms && n >= PARALLEL_MIN && threads() > 1)
+            parallel_sort(entries, tmp, n, threads());
+        else
+            merge_sort(entries, tmp, 0, n);
+        rv = build_list(NULL, entries, n);
+        GC_FREE(entries);
+        GC_FREE(tmp);
+    }
+    GC_FREE(keys);
+    return rv;
+}
+
+cell sort_fn(int argc, cell* argv) {
+    // sort (3 1 2) -> (1 2 3)
+    // sort (b 2 a 1) -> (1 2 a b)
+    // sort ((2 a) (1 b) (1 a)) -> ((1 a) (1 b) (2 a))
+    // sort () ->
+    if (!argc) return NIL;
+    return sort_list(argv[0], NIL);
+}
+
+cell sort_by(int argc, cell* argv) {
+    // sort-by car ((2 a) (1 b) (2 c) (1 d)) -> ((1 b) (1 d) (2 a) (2 c))
+    // sort-by neg (1 3 2) -> (3 2 1)
+    if (argc < 2 || !IS_CALLABLE(argv[0])) return NIL;
+    return sort_list(argv[1], argv[0]);
+}
+
+cell sort_threads(int argc, cell* argv) {
+    // sort.threads 4 -> 4, sorting large lists on at most 4 threads
+    // sort.threads 1 -> 1, sorting on the calling thread only
+    // sort.threads -> the current limit, by default the number of CPUs up to 8
+    if (argc && IS_INT(argv[0]) && INT_VAL(argv[0]) > 0)
+        max_threads = INT_VAL(argv[0]) < 64 ? INT_VAL(argv[0]) : 64;
+    return make_int(threads());
+}
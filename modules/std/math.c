@@ -1,61 +1,88 @@
 #include <crisp.h>
 
-cell sum(cell args, cell env) {
+// These functions use the NATIVE_FN_V interface, so arithmetic
+// never allocates an argument list or intermediate results
+
+cell sum(int argc, cell* argv) {
     // sum 1 2 -> 3
     // sum 1 () 2 -> 1
     // sum -> 0
-    if (!args || !IS_INT(car(args))) return make_int(0);
-    int64_t first = INT_VAL(car(args));
-    DPRINTF("doing math\n", 0);
-    if (!IS_PAIR(cdr(args))) return make_int(first);
-    return make_int(first + INT_VAL(sum(cdr(args), NIL)));
+    // sum 1 2.5 -> 3.5
+    int64_t total = 0;
+    int i;
+    for (i = 0; i < argc && IS_INT(argv[i]); i++)
+        total += INT_VAL(argv[i]);
+    if (i == argc || !IS_FLOAT(argv[i])) return make_int(total);
+    // Once there's a float, the rest of the sum is a float
+    double real = total;
+    for (; i < argc && IS_NUMBER(argv[i]); i++)
+        real += NUM_VAL(argv[i]);
+    return make_float(real);
 }
 
-cell product(cell args, cell env) {
+cell product(int argc, cell* argv) {
     // product 2 3 -> 6
     // product 4 () 2 -> 4
     // product -> 1
-    if (!args || !IS_INT(car(args))) return make_int(1);
-    return make_int(INT_VAL(car(args)) * INT_VAL(product(cdr(args), NIL)));
+    // product 2 0.25 -> 0.5
+    int64_t total = 1;
+    int i;
+    for (i = 0; i < argc && IS_INT(argv[i]); i++)
+        total *= INT_VAL(argv[i]);
+    if (i == argc || !IS_FLOAT(argv[i])) return make_int(total);
+    double real = total;
+    for (; i < argc && IS_NUMBER(argv[i]); i++)
+        real *= NUM_VAL(argv[i]);
+    return make_float(real);
 }
 
-cell quotient(cell args, cell env) {
+cell quotient(int argc, cell* argv) {
   // quotient 7 4 -> 1
   // quotient 7 2 -> 3
-  if (!args || !IS_PAIR(cdr(args))) return NIL;
-  cell a = car(args);
-  cell b = cdar(args);
-  if (!IS_INT(a) || !IS_INT(b)) return NIL;
+  // quotient 7 2.0 -> 3.5
+  if (argc < 2) return NIL;
+  cell a = argv[0];
+  cell b = argv[1];
+  if (!IS_NUMBER(a) || !IS_NUMBER(b)) return NIL;
+  if (IS_FLOAT(a) || IS_FLOAT(b)) {
+      if (NUM_VAL(b) == 0) return NIL;
+      return make_float(NUM_VAL(a) / NUM_VAL(b));
+  }
   if (INT_VAL(b) == 0) return NIL;
   return make_int(INT_VAL(a) / INT_VAL(b));
 }
 
-cell modulus(cell args, cell env) {
+cell modulus(int argc, cell* argv) {
     // modulus 7 3 -> 1
     // modulus 7 0 ->
     // modulus () 2 ->
     // modulus 2 () ->
     // modulus 2 ->
-    if (!args || !IS_PAIR(cdr(args))) return NIL;
-    cell a = car(args);
-    cell b = cdar(args);
+    if (argc < 2) return NIL;
+    cell a = argv[0];
+    cell b = argv[1];
     if (!IS_INT(a) || !IS_INT(b)) return NIL;
     if (INT_VAL(b) == 0) return NIL;
     return make_int(INT_VAL(a) % INT_VAL(b));
 }
 
 // Returns the first arg if args are strictly ascending
-cell asc(cell args, cell env) {
+cell asc(int argc, cell* argv) {
     // asc ->
     // asc 1 -> 1
     // asc 4 2 ->
     // asc 4 4 ->
     // asc 2 4 -> 2
-    if (!args || !IS_INT(car(args))) return NIL;
-    if (!cdr(args)) return car(args);
-    if (!IS_PAIR(cdr(args))) return NIL;
-    cell next = asc(cdr(args), NIL);
-    if (!next) return NIL;
-    if (INT_VAL(car(args)) < INT_VAL(next)) return car(args);
-    return NIL;
+    // asc 1 1.5 2 -> 1
+    if (!argc || !IS_NUMBER(argv[0])) return NIL;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (!IS_NUMBER(argv[i])) return NIL;
+        if (IS_INT(argv[i - 1]) && IS_INT(argv[i])) {
+            if (INT_VAL(argv[i - 1]) >= INT_VAL(argv[i])) return NIL;
+        } else if (!(NUM_VAL(argv[i - 1]) < NUM_VAL(argv[i]))) {
+            return NIL;
+        }
+    }
+    return argv[0];
 }
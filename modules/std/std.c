@@ -1,54 +1,94 @@
 #include <crisp.h>
 
-cell assoc_fn(cell args, cell env) {
-    if (!args || !IS_PAIR(cdr(args))) return NIL;
-    cell key = car(args), dict = cdar(args);
-    return assoc(key, dict);
+cell assoc_fn(int argc, cell* argv) {
+    if (argc < 2) return NIL;
+    return assoc(argv[0], argv[1]);
 }
 
 // Concatenate arguments
-cell concat_fn(cell args, cell env) {
+cell concat_fn(int argc, cell* argv) {
     // concat (a b) c (d e) -> a b c d e
     // concat ((a b) (c d)) e -> (a b) (c d) e
     // concat a -> a
     // concat a . b -> a b
-    if (!args) return NIL;
-    if (!IS_PAIR(args)) return LIST1(args);
-    cell first = car(args);
-    if (!IS_PAIR(first)) first = LIST1(first);
-    return concat(first, concat_fn(cdr(args), NIL));
+    // The elements are counted first, so they can be copied into one
+    // compact list
+    size_t n = 0;
+    int i;
+    cell l;
+    for (i = 0; i < argc; i++) {
+        for (l = argv[i]; IS_PAIR(l); l = cdr(l)) n++;
+        // Atoms and the terminal elements of improper lists
+        // become elements in their own right
+        if (l || !IS_PAIR(argv[i])) n++;
+    }
+    cell rv = make_list(n, NIL), c = rv;
+    for (i = 0; i < argc; i++) {
+        for (l = argv[i]; IS_PAIR(l); l = cdr(l), c = cdr(c)) SET_CAR(c, car(l));
+        if (l || !IS_PAIR(argv[i])) {
+            SET_CAR(c, l);
+            c = cdr(c);
+        }
+    }
+    return rv;
 }
 
-cell hash(cell args, cell env) {
-    if (!args) return make_int(0);
-    if (TYPE(car(args)) != SYMBOL) return make_int((uint64_t) car(args));
+cell hash(int argc, cell* argv) {
+    if (!argc) return make_int(0);
+    if (TYPE(argv[0]) != SYMBOL) return make_int((uint64_t) argv[0]);
 
     // djb2 best hash
     uint64_t hash = 5381;
-    char* s = SYM_STR(car(args));
+    char* s = SYM_STR(argv[0]);
     while (*s)
         hash = ((hash << 5) + hash) + *(s++);
 
     return make_int(hash);
 }
 
-cell ispair(cell args, cell env) {
+cell ispair(int argc, cell* argv) {
     // ispair 4 ->
     // ispair () -> ()
     // ispair (a b) -> (a b)
-    if (!args) return NIL;
-    return IS_PAIR(car(args)) ? car(args) : (cell) NIL;
+    if (!argc) return NIL;
+    return IS_PAIR(argv[0]) ? argv[0] : (cell) NIL;
 }
 
 // Pair up items from a left and right list into a
 // new list of cons pairs until one list runs out
-cell zip_fn(cell args, cell env) {
+cell zip_fn(int argc, cell* argv) {
     // zip (a b c) (d e) -> (a . d) (b . e)
     // zip () () ->
     // zip ->
     // zip a b ->
     // zip (a b) (c . d) -> (a . c)
-    if (!args || !IS_PAIR(cdr(args))) return NIL;
-    cell a = car(args), b = cdar(args);
-    return zip(a, b);
-}
\ No newline at end of file
+    if (argc < 2) return NIL;
+    return zip(argv[0], argv[1]);
+}
+
+// A list of the numbers from start, counting up by one, which are below end
+cell range_from(int argc, cell* argv) {
+    // range-from 2 5 -> 2 3 4
+    // range-from 5 2 ->
+    // range-from 0.5 3 -> 0.5 1.5 2.5
+    if (argc < 2 || !IS_NUMBER(argv[0]) || !IS_NUMBER(argv[1])) return NIL;
+    size_t n = 0, i;
+    if (IS_INT(argv[0]) && IS_INT(argv[1])) {
+        if (INT_VAL(argv[0]) < INT_VAL(argv[1])) n = INT_VAL(argv[1]) - INT_VAL(argv[0]);
+    } else {
+        double span = NUM_VAL(argv[1]) - NUM_VAL(argv[0]);
+        if (span > 0) n = (size_t) span + ((double) (size_t) span < span);
+    }
+    cell rv = make_list(n, NIL), c = rv;
+    for (i = 0; i < n; i++, c = cdr(c))
+        SET_CAR(c, IS_INT(argv[0]) ? make_int(INT_VAL(argv[0]) + i) : make_float(NUM_VAL(argv[0]) + i));
+    return rv;
+}
+
+cell range_fn(int argc, cell* argv) {
+    // range 3 -> 0 1 2
+    // range -1 ->
+    if (!argc) return NIL;
+    cell args[] = {make_int(0), argv[0]};
+    return range_from(2, args);
+}
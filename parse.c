@@ -3,114 +3,133 @@
 #include "crisp.h"
 #include <stdarg.h>
 
-// Returns the cell represented by the string starting at *s
-// The mechanics of this function are strange. *s advances
-// along the string while parse constructs the corresponding
-// lists
-
-static bool in_string = false;
-
+// Read the characters of a string up to its closing quote into a list
+// of their codes
 cell read_string(char** s) {
-    char c = *(*s)++;
-    if (c == '\\') {
-        c = *(*s)++;
-        switch (c) {
-        case 'n':
-            c = '\n';
-            break;
-        case 't':
-            c = '\t';
-            break;
-        case '"':
-            c = '"';
-            break;
-        case '\\':
-            c = '\\';
-            break;
-        case '0':
-            c = '\0';
-            break;
+    size_t n = 0, size = 16;
+    char* chars = malloc(size);
+    char c;
+    while ((c = *(*s)++) != '"' && c) {
+        if (c == '\\') {
+            c = *(*s)++;
+            switch (c) {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case '"':
+                c = '"';
+                break;
+            case '\\':
+                c = '\\';
+                break;
+            case '0':
+                c = '\0';
+                break;
+            }
         }
-    } else if (c == '"') {
-        (*s)++;
-        return NIL;
+        if (n == size) chars = realloc(chars, size *= 2);
+        chars[n++] = c;
     }
+    if (!c) (*s)--;
+    cell rv = make_list(n, NIL), l = rv;
+    size_t i;
+    for (i = 0; i < n; i++, l = cdr(l)) SET_CAR(l, make_int(chars[i]));
+    free(chars);
+    return rv;
+}
+
+// Parse one token: a number, or else a symbol
+static cell parse_token(char** s) {
+    char* i = *s;
+    while (*i && !isspace(*i) && *i != '(' && *i != ')')
+        i++;
+    size_t token_len = i - *s;
 
-    cell rest = read_string(s);
-    return cons(make_int(c), rest);
+    char* token = strncpy(malloc(token_len + 1), *s, token_len);
+    token[token_len] = '\0';
+    *s = i;
+    cell c;
+
+    // Try to turn the token into a number. A token which starts like
+    // a number may have trailing characters, as in 1, or 2.5,
+    char* endptr;
+    char* float_end;
+    long val = strtol(token, &endptr, 0);
+    char* digits = token + (*token == '-' || *token == '+');
+    if (*digits == '.') digits++;
+    double real = *endptr && isdigit(*digits) ? strtod(token, &float_end) : 0;
+    if (*endptr && isdigit(*digits) && float_end > endptr)
+        c = make_float(real);
+    else if (endptr != token)
+        c = make_int(val);
+    else
+        c = sym(token);
+    free(token);
+    return c;
 }
 
+// Returns the list of the cells represented by the string starting at *s,
+// up to a closing paren or the end of the string. *s advances along the
+// string as they're parsed. The elements are gathered first, then copied
+// into a compact list. A quote or a dot ends the gathering, since what
+// they make depends on the rest of the list after them, which is parsed
+// as a list of its own
 cell parse(char** s) {
-    // Skip whitespace
-    while (isspace(**s))
-        (*s)++;
-    if (!**s) return NIL;
-    switch (**s) {
-    case '"': {
-        *(*s)++;
-        cell str = read_string(s);
-        return cons(str, parse(s));
-    }
-    case ')':
-        (*s)++;
-        return NIL;
-    case '(': {
-        (*s)++;
-        cell first = parse(s);
-        return cons(first, parse(s));
-    }
-    case '\'': {
-        (*s)++;
-        cell rest = parse(s);
-        // ' -> ()
-        if (!rest) return NIL;
-
-        // '.a -> ()
-        // ' -> ()
-        if (!IS_PAIR(rest)) return NIL;
-
-        // 'a -> (quote a)
-        if (!IS_PAIR(car(rest)))
-            return cons(LIST2(sym("quote"), car(rest)), cdr(rest));
-
-        // '(a b c) -> (quote a b c)
-        return cons(cons(sym("quote"), rest), cdr(rest));
-    }
+    size_t n = 0, size = 16;
+    cell* items = malloc_or_die(size * sizeof(cell));
+    cell tail = NIL;
+    for (;;) {
+        // Skip whitespace
+        while (isspace(**s))
+            (*s)++;
+        if (!**s) break;
+        if (n == size) items = GC_REALLOC(items, (size *= 2) * sizeof(cell));
+        if (**s == ')') {
+            (*s)++;
+            break;
+        }
+        if (**s == '"') {
+            (*s)++;
+            items[n++] = read_string(s);
+        } else if (**s == '(') {
+            (*s)++;
+            items[n++] = parse(s);
+        } else if (**s == '\'') {
+            (*s)++;
+            cell rest = parse(s);
+            // ' -> ()
+            // '.a -> ()
+            if (!IS_PAIR(rest)) break;
 
-    case '.': {
-        (*s)++;
-        cell rest = parse(s);
-        if (!rest) return NIL;
-        if (TYPE(rest) != PAIR) return NIL;
-        return car(rest);
-    }
-    default: {
-        char* i = *s;
-        while (*i && !isspace(*i) && *i != '(' && *i != ')')
-            i++;
-        size_t token_len = i - *s;
-
-        char* token = strncpy(malloc(token_len + 1), *s, token_len);
-        token[token_len] = '\0';
-        *s = i;
-        cell c;
-
-        // Try to turn the token into a number
-        char* endptr;
-        long val = strtol(token, &endptr, 0);
-        if (endptr != token)
-            c = make_int(val);
-        else
-            c = sym(token);
-        free(token);
-        return cons(c, parse(s));
-    }
+            // 'a -> (quote a)
+            // '(a b c) -> (quote a b c)
+            if (!IS_PAIR(car(rest))) items[n++] = LIST2(sym("quote"), car(rest));
+            else items[n++] = cons(sym("quote"), rest);
+            tail = cdr(rest);
+            break;
+        } else if (**s == '.') {
+            (*s)++;
+            cell rest = parse(s);
+            if (IS_PAIR(rest)) tail = car(rest);
+            break;
+        } else {
+            items[n++] = parse_token(s);
+        }
     }
+    cell rv = make_list(n, tail), l = rv;
+    size_t i;
+    for (i = 0; i < n; i++, l = cdr(l)) SET_CAR(l, items[i]);
+    return rv;
 }
 
-static char* buf = NULL;
-static size_t buf_len = 0;
-static int buf_index = 0;
+// Each thread prints into its own buffer. It holds only characters, so it
+// comes from malloc rather than the collector, which can't see thread locals
+static __thread char* buf = NULL;
+static __thread size_t buf_len = 0;
+static __thread int buf_index = 0;
 
 // A combination of sprintf and strcat, catf safely appends formatted
 // strings to the end of the buffer, enlarging the buffer as needed
@@ -122,19 +141,32 @@ inline static int catf(char* fmt, ...) {
     va_end(args);
     size_t extra_len = strlen(new_part);
     if (buf_index + extra_len >= buf_len) {
-        buf = GC_REALLOC(buf, buf_len = (buf_index + extra_len) * 2);
+        buf = realloc(buf, buf_len = (buf_index + extra_len) * 2);
     }
     memcpy(buf + buf_index, new_part, extra_len + 1);
     free(new_part);
     return buf_index += extra_len;
 }
 
+// Print the shortest form which reads back as the same float, with a
+// decimal point so that it reads back as a float rather than an integer
+static int print_float(double x) {
+    char digits[32];
+    int precision;
+    for (precision = 15; precision <= 17; precision++) {
+        snprintf(digits, sizeof(digits), "%.*g", precision, x);
+        if (strtod(digits, NULL) == x) break;
+    }
+    if (strspn(digits, "-0123456789") == strlen(digits)) strcat(digits, ".0");
+    return catf("%s", digits);
+}
+
 // Recursive print function - updates buf_index as appropriate
 // during its traversal of c
 static int print(cell c) {
-    switch (TYPE(c)) {
-    case PAIR:
-        if (TYPE(car(c)) == PAIR) {
+    if (c & FLOAT_BIT) return print_float(FLOAT_VAL(c));
+    if (IS_PAIR(c)) {
+        if (IS_PAIR(car(c))) {
             catf("(");
             print(car(c));
             catf(")");
@@ -143,15 +175,20 @@ static int print(cell c) {
         if (!cdr(c)) return 0;
 
         catf(" ");
-        if (TYPE(cdr(c)) != PAIR) catf(". ");
+        if (!IS_PAIR(cdr(c))) catf(". ");
         return print(cdr(c));
+    }
+    switch (TYPE(c)) {
     case S64:
     case S32:
         return catf("%ld", INT_VAL(c));
+    case F64:
+        return print_float(FLOAT_VAL(c));
     case SYMBOL:
         return catf("%s", SYM_STR(c));
     case NATIVE_FN:
     case NATIVE_FN_TCO:
+    case NATIVE_FN_V:
     case NATIVE_MACRO:
         return catf("NATIVE_FUNCTION<%p>", PTR(c));
     case FFI_SYM:
@@ -163,6 +200,9 @@ static int print(cell c) {
     case MACRO:
         catf("(macro (");
         goto print_args_body;
+    case PURE_MACRO:
+        catf("(pure-macro (");
+        goto print_args_body;
     case FN:
         catf("(lambda (");
     print_args_body:
@@ -172,6 +212,8 @@ static int print(cell c) {
         return catf(")");
     case CONS:
         return catf("CONS");
+    case CHANNEL:
+        return catf("CHANNEL<%p>", PTR(c));
     case NIL:
         return catf("()");
     default:
@@ -181,7 +223,7 @@ static int print(cell c) {
 
 char* print_cell(cell c) {
     if (!buf) {
-        buf = GC_MALLOC(64);
+        buf = malloc(64);
         buf_len = 64;
     }
     buf_index = 0;
@@ -192,7 +234,7 @@ char* print_cell(cell c) {
 // Handy for pretty-printing local variables in an env
 char* print_env(cell c) {
     if (!buf) {
-        buf = GC_MALLOC(64);
+        buf = malloc(64);
         buf_len = 64;
     }
     buf_index = 0;
@@ -0,0 +1,162 @@
+#include "crisp.h"
+#include <pthread.h>
+#include <time.h>
+
+// This file records fixed-size binary trace events, which are much cheaper
+// than the text printed in debug mode. Each thread writes to its own ring
+// buffer, keeping its most recent TRACE_RING_SIZE events, so nothing is
+// shared on the hot path. When tracing is off, TRACE costs one predictable
+// branch on a global flag.
+//
+// trace-dump writes every ring to a file, which tracing/trace_decode.c
+// turns into text or Chrome trace JSON. The dump is:
+//   trace_header
+//   count trace_event records, oldest first within each thread
+//   the names of symbols appearing in those events, each as a
+//   trace_symbol record followed by its characters
+
+bool tracing = false;
+
+#define TRACE_RING_SIZE (1 << 16)
+
+typedef struct trace_ring {
+    trace_event events[TRACE_RING_SIZE];
+    // Total events ever written; the ring holds the last TRACE_RING_SIZE
+    uint64_t written;
+    uint32_t thread;
+    struct trace_ring* next;
+} trace_ring;
+
+static __thread trace_ring* ring;
+static trace_ring* rings;
+static uint32_t num_threads;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t start_time;
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static trace_ring* new_ring(void) {
+    // Rings hold no references the collector needs to see, and must not
+    // move or be collected while the thread lives, so they come from malloc
+    trace_ring* r = calloc(1, sizeof(trace_ring));
+    if (!r) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    pthread_mutex_lock(&rings_lock);
+    r->thread = num_threads++;
+    r->next = rings;
+    rings = r;
+    pthread_mutex_unlock(&rings_lock);
+    return r;
+}
+
+void trace_record(trace_kind kind, cell c) {
+    if (!ring) ring = new_ring();
+    trace_event* e = &ring->events[ring->written++ % TRACE_RING_SIZE];
+    e->time = now() - start_time;
+#ifndef FUZZ
+    // Text isn't interned, so it may be collected before the ring is dumped,
+    // and the collector doesn't scan rings. Only its type is kept
+    if (TYPE(c) == SYMBOL && GC_base(SYM_STR(c))) c = SYMBOL;
+#endif
+    e->c = c;
+    e->kind = kind;
+    e->thread = ring->thread;
+}
+
+#ifndef FUZZ
+// Called by the collector with its lock held, so this mustn't allocate
+static void gc_started(void) {
+    TRACE(TRACE_GC, make_int(GC_get_gc_no()));
+}
+#endif
+
+void trace_start(void) {
+    if (!start_time) start_time = now();
+#ifndef FUZZ
+    GC_set_start_callback(gc_started);
+#endif
+    tracing = true;
+}
+
+cell trace_start_fn(int argc, cell* argv) {
+    // trace-start () -> true, recording events from now on
+    trace_start();
+    return sym("true");
+}
+
+cell trace_stop_fn(int argc, cell* argv) {
+    // trace-stop () -> the number of events recorded so far, across threads
+    tracing = false;
+    uint64_t total = 0;
+    trace_ring* r;
+    pthread_mutex_lock(&rings_lock);
+    for (r = rings; r; r = r->next) total += r->written;
+    pthread_mutex_unlock(&rings_lock);
+    return make_int(total);
+}
+
+static int compare_cells(const void* a, const void* b) {
+    cell x = *(const cell*) a, y = *(const cell*) b;
+    return x < y ? -1 : x > y;
+}
+
+bool trace_dump(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    bool was_tracing = tracing;
+    tracing = false;
+    pthread_mutex_lock(&rings_lock);
+
+    trace_header h = {TRACE_MAGIC, TRACE_VERSION, 0, 0};
+    trace_ring* r;
+    for (r = rings; r; r = r->next)
+        h.count += r->written < TRACE_RING_SIZE ? r->written : TRACE_RING_SIZE;
+    // Collect the symbols in events, then sort them to drop duplicates
+    cell* symbols = malloc((h.count ? h.count : 1) * sizeof(cell));
+    for (r = rings; symbols && r; r = r->next) {
+        uint64_t n = r->written < TRACE_RING_SIZE ? r->written : TRACE_RING_SIZE;
+        uint64_t i;
+        for (i = r->written - n; i < r->written; i++) {
+            cell c = r->events[i % TRACE_RING_SIZE].c;
+            if (TYPE(c) == SYMBOL && PTR(c)) symbols[h.symbols++] = c;
+        }
+    }
+    uint64_t i, unique = 0;
+    if (symbols) {
+        qsort(symbols, h.symbols, sizeof(cell), compare_cells);
+        for (i = 0; i < h.symbols; i++)
+            if (!unique || symbols[unique - 1] != symbols[i]) symbols[unique++] = symbols[i];
+    }
+    h.symbols = unique;
+
+    bool ok = symbols && fwrite(&h, sizeof(h), 1, f) == 1;
+    for (r = rings; ok && r; r = r->next) {
+        uint64_t n = r->written < TRACE_RING_SIZE ? r->written : TRACE_RING_SIZE;
+        uint64_t first = (r->written - n) % TRACE_RING_SIZE;
+        // The ring may wrap, in which case its oldest events are at the end
+        uint64_t tail = n < TRACE_RING_SIZE - first ? n : TRACE_RING_SIZE - first;
+        ok = fwrite(r->events + first, sizeof(trace_event), tail, f) == tail &&
+             fwrite(r->events, sizeof(trace_event), n - tail, f) == n - tail;
+    }
+    for (i = 0; ok && i < unique; i++) {
+        trace_symbol ts = {symbols[i], strlen(SYM_STR(symbols[i]))};
+        ok = fwrite(&ts, sizeof(ts), 1, f) == 1 && fwrite(SYM_STR(symbols[i]), 1, ts.len, f) == ts.len;
+    }
+    free(symbols);
+
+    pthread_mutex_unlock(&rings_lock);
+    tracing = was_tracing;
+    return fclose(f) == 0 && ok;
+}
+
+cell trace_dump_fn(int argc, cell* argv) {
+    // trace-dump crisp.trace -> crisp.trace, once the events are written
+    if (!argc || TYPE(argv[0]) != SYMBOL || !trace_dump(SYM_STR(argv[0]))) return NIL;
+    return argv[0];
+}
@@ -0,0 +1,127 @@
+#include "crisp.h"
+
+// This program reads a file written by trace-dump and prints its events,
+// either as text or as JSON for chrome://tracing and similar viewers:
+//     crisp_trace_decode crisp.trace
+//     crisp_trace_decode --json crisp.trace > trace.json
+// Cells in events are only meaningful within the traced process, so
+// symbols are named from the table at the end of the dump, small integers
+// and floats are shown by value, and anything else by its type and address.
+
+static const char* kind_names[] = {"eval", "apply", "slide", "def", "gc", "ffi"};
+
+static const char* type_names[] = {
+    "NIL", "PAIR", "SYMBOL", "FN", "FFI_SYM", "FFI_LIBRARY", "FFI_FN", "S64",
+    "S32", "NATIVE_FN", "NATIVE_MACRO", "NATIVE_FN_TCO", "MACRO", "CONS",
+    "NATIVE_FN_V", "PURE_MACRO", "CHANNEL", "F64"
+};
+
+static trace_symbol* symbols;
+static char** names;
+static uint64_t num_symbols;
+
+static const char* symbol_name(cell c) {
+    // Symbols are written sorted by cell
+    uint64_t lo = 0, hi = num_symbols;
+    while (lo < hi) {
+        uint64_t mid = (lo + hi) / 2;
+        if (symbols[mid].c < c) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < num_symbols && symbols[lo].c == c ? names[lo] : NULL;
+}
+
+// Like float_val in crisp.c, which isn't linked in here
+static double float_in_cell(cell c) {
+    uint64_t r = c & ~FLOAT_BIT;
+    if (r >> 53) r += 512ULL << 53;
+    uint64_t bits = r >> 1 | r << 63;
+    double x;
+    memcpy(&x, &bits, 8);
+    return x;
+}
+
+// Format c into buf, escaping quotes and backslashes for JSON if asked
+static void format_cell(cell c, char* buf, size_t size, bool json) {
+    uint64_t type = TYPE(c) >> 48;
+    const char* name;
+    if (!c) {
+        snprintf(buf, size, "()");
+    } else if (TYPE(c) == S32) {
+        snprintf(buf, size, "%d", (int32_t) c);
+    } else if (c & FLOAT_BIT) {
+        snprintf(buf, size, "%g", float_in_cell(c));
+    } else if (TYPE(c) == SYMBOL && (name = symbol_name(c))) {
+        size_t i = 0;
+        for (; *name && i + 2 < size; name++) {
+            if (json && (*name == '"' || *name == '\\')) buf[i++] = '\\';
+            buf[i++] = *name < ' ' && json ? '?' : *name;
+        }
+        buf[i] = 0;
+    } else if (IS_COMPACT(c)) {
+        snprintf(buf, size, "PAIR<%p>", (void*) PTR(c));
+    } else if (type < BUILTIN_TYPE_COUNT) {
+        snprintf(buf, size, "%s<%p>", type_names[type], (void*) PTR(c));
+    } else {
+        snprintf(buf, size, "TYPE%lu<%p>", (unsigned long) type, (void*) PTR(c));
+    }
+}
+
+static const char* kind_name(uint32_t kind) {
+    return kind < sizeof(kind_names) / sizeof(char*) ? kind_names[kind] : "unknown";
+}
+
+int main(int argc, char** argv) {
+    bool json = argc > 2 && !strcmp(argv[1], "--json");
+    if (argc != 2 + json) {
+        fprintf(stderr, "usage: %s [--json] crisp.trace\n", argv[0]);
+        return 1;
+    }
+    FILE* f = fopen(argv[1 + json], "rb");
+    if (!f) {
+        perror(argv[1 + json]);
+        return 1;
+    }
+
+    trace_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a crisp trace\n", argv[1 + json]);
+        return 1;
+    }
+    trace_event* events = malloc((h.count ? h.count : 1) * sizeof(trace_event));
+    symbols = malloc((h.symbols ? h.symbols : 1) * sizeof(trace_symbol));
+    names = malloc((h.symbols ? h.symbols : 1) * sizeof(char*));
+    if (!events || !symbols || !names || fread(events, sizeof(trace_event), h.count, f) != h.count) {
+        fprintf(stderr, "%s is truncated\n", argv[1 + json]);
+        return 1;
+    }
+    for (num_symbols = 0; num_symbols < h.symbols; num_symbols++) {
+        trace_symbol* s = &symbols[num_symbols];
+        if (fread(s, sizeof(*s), 1, f) != 1 || !(names[num_symbols] = malloc(s->len + 1)) ||
+            fread(names[num_symbols], 1, s->len, f) != s->len) {
+            fprintf(stderr, "%s is truncated\n", argv[1 + json]);
+            return 1;
+        }
+        names[num_symbols][s->len] = 0;
+    }
+    fclose(f);
+
+    char buf[256];
+    uint64_t i;
+    if (json) puts("{\"traceEvents\": [");
+    for (i = 0; i < h.count; i++) {
+        trace_event* e = &events[i];
+        format_cell(e->c, buf, sizeof(buf), json);
+        if (json) {
+            // Instant events, with timestamps in microseconds
+            printf("  {\"name\": \"%s %s\", \"cat\": \"%s\", \"ph\": \"i\", \"s\": \"t\", "
+                   "\"ts\": %.3f, \"pid\": 0, \"tid\": %u, \"args\": {\"cell\": \"%s\"}}%s\n",
+                   kind_name(e->kind), buf, kind_name(e->kind), e->time / 1000.0, e->thread, buf,
+                   i + 1 < h.count ? "," : "");
+        } else {
+            printf("%12.3f %3u %-5s %s\n", e->time / 1000.0, e->thread, kind_name(e->kind), buf);
+        }
+    }
+    if (json) puts("]}");
+    return 0;
+}
@@ -0,0 +1,274 @@
+#include "crisp.h"
+
+// This file creates, runs and frees interpreters. Each crisp_vm has its own
+// global environment, imports and caches, so one process can host many of
+// them. A thread evaluates in one vm at a time, its current_vm, and a vm
+// must only be used by one thread at a time.
+//
+// Functions can also be looked up once with crisp_prepare and called
+// repeatedly with crisp_call, which is much cheaper than evaluating an
+// expression each time.
+//
+// Threads which weren't created through the collector's pthread_create are
+// registered with it on their first crisp_vm_eval. Such a thread should
+// call GC_unregister_my_thread before it exits. The first vm should be
+// created by the main thread, before any others start.
+
+crisp_vm* crisp_vm_new(void) {
+#ifdef FUZZ
+    crisp_vm* vm = calloc(1, sizeof(crisp_vm));
+#else
+    GC_INIT();
+    GC_allow_register_threads();
+    // The vm holds the roots of everything it evaluates, and is freed
+    // explicitly by crisp_vm_free
+    crisp_vm* vm = GC_MALLOC_UNCOLLECTABLE(sizeof(crisp_vm));
+#endif
+    if (!vm) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    vm->def_epoch = 1;
+
+    crisp_vm* outer = current_vm;
+    current_vm = vm;
+
+    cell global_env = NIL;
+    global_env = cons(cons(sym("eval"), CAST(eval, NATIVE_FN)), global_env);
+    global_env = cons(cons(sym("quote"), CAST(quote, NATIVE_MACRO)), global_env);
+    global_env = cons(cons(sym("lambda"), CAST(lambda, NATIVE_MACRO)), global_env);
+    global_env = cons(cons(sym("car"), CAST(car_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("cdr"), CAST(cdr_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("list"), CAST(quote, NATIVE_FN)), global_env);
+    global_env = cons(cons(sym("equal"), CAST(equal_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("same"), CAST(same, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("deep-equal"), CAST(deep_equal_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("deep-hash"), CAST(deep_hash_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("compare"), CAST(compare_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("hashcons"), CAST(hashcons_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("hashcons-count"), CAST(hashcons_count, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("trace-start"), CAST(trace_start_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("trace-stop"), CAST(trace_stop_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("trace-dump"), CAST(trace_dump_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("go"), CAST(go_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("yield"), CAST(yield_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("chan"), CAST(chan_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("send"), CAST(send_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("recv"), CAST(recv_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("join"), CAST(join_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("run-threads"), CAST(run_threads_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("thread-priority"), CAST(thread_priority_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("thread-stats"), CAST(thread_stats_fn, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("jit-stats"), CAST(jit_stats, NATIVE_FN_V)), global_env);
+    global_env = cons(cons(sym("def"), CAST(def, NATIVE_MACRO)), global_env);
+    global_env = cons(cons(sym("macro"), CAST(macro, NATIVE_MACRO)), global_env);
+    global_env = cons(cons(sym("pure-macro"), CAST(pure_macro, NATIVE_MACRO)), global_env);
+    global_env = cons(cons(sym("macroexpand"), CAST(macroexpand, NATIVE_FN)), global_env);
+    global_env = cons(cons(sym("typeof"), CAST(typeof_fn, NATIVE_FN)), global_env);
+
+#ifndef DISABLE_FFI
+    global_env = cons(cons(sym("dlopen"), CAST(dlopen_fn, NATIVE_FN)), global_env);
+    global_env = cons(cons(sym("dlsym"), CAST(dlsym_fn, NATIVE_FN)), global_env);
+    global_env = cons(cons(sym("import"), CAST(import, NATIVE_FN)), global_env);
+#endif
+
+    global_env = cons(cons(sym("apply"), CAST(apply_fn, NATIVE_FN_TCO)), global_env);
+    global_env = cons(cons(sym("if"), CAST(if_fn, NATIVE_FN_TCO)), global_env);
+    global_env = cons(cons(sym("with"), CAST(with, NATIVE_FN_TCO)), global_env);
+    global_env = cons(cons(sym("cons"), CAST(NIL, CONS)), global_env);
+
+    global_env = cons(cons(sym("GLOBALS"), NIL), global_env);
+
+    // The global env looks like this:
+    //     (y . 5) (z . 5) ..       (GLOBALS) (foo . 5) (identity . FN(x)<x>) .. (hash . NATIVE_FUNCTION<...>) (asc . NATIVE_FUNCTION<...>) ...
+    // local variables-^  just a marker-^       ^-global var  ^-builtins
+
+    // Lookups proceed left to right so local variables occlude global variables,
+    // global variables occlude builtins, and more recent global var definitions
+    // occlude older definitions
+
+    // global_env always points at the GLOBALS marker and new definitions
+    // are inserted just under it by the def function
+    vm->global_env = global_env;
+
+    current_vm = outer;
+    return vm;
+}
+
+// The thread's previous vm, restored when a call into a vm returns
+typedef struct {
+    crisp_vm* vm;
+    void* stack_base;
+} outer_vm;
+
+static __thread bool thread_registered;
+
+static void enter(crisp_vm* vm, outer_vm* outer) {
+#ifndef FUZZ
+    if (!thread_registered) {
+        if (!GC_thread_is_registered()) {
+            struct GC_stack_base sb;
+            GC_get_stack_base(&sb);
+            GC_register_my_thread(&sb);
+        }
+        thread_registered = true;
+    }
+#endif
+    outer->vm = current_vm;
+    outer->stack_base = vm->stack_base;
+    // Recursion is limited from the outermost evaluation on this thread
+    vm->stack_base = current_vm ? current_vm->stack_base : (void*) outer;
+    current_vm = vm;
+}
+
+static void leave(crisp_vm* vm, outer_vm* outer) {
+    vm->stack_base = outer->stack_base;
+    current_vm = outer->vm;
+}
+
+// Evaluate each expression in src in vm, returning the value of the last
+cell crisp_vm_eval(crisp_vm* vm, const char* src) {
+    outer_vm outer;
+    enter(vm, &outer);
+
+    logical_line ll;
+    reset_logical_line(&ll);
+    cell evalled = NIL;
+    while (1) {
+        char c = *src;
+        if (c) src++;
+        if (logical_line_ingest(&ll, c)) {
+            cell expr = parse(&ll.str);
+            if (expr) {
+                DPRINTF("Parsed %s\n", print_cell(expr));
+                evalled = eval(expr, vm->global_env);
+            }
+            reset_logical_line(&ll);
+        }
+        if (!c) break;
+    }
+
+    leave(vm, &outer);
+    return evalled;
+}
+
+// Look up a handle's callable again if anything has been defined since
+static bool resolve(crisp_handle* h) {
+    if (h->epoch == h->vm->def_epoch) return IS_CALLABLE(h->fn);
+    h->fn = eval(h->name, h->vm->global_env);
+    h->epoch = h->vm->def_epoch;
+    return IS_CALLABLE(h->fn);
+}
+
+// Look up name once, for calling with crisp_call. Returns NULL if name
+// isn't bound to something callable
+crisp_handle* crisp_prepare(crisp_vm* vm, const char* name) {
+#ifdef FUZZ
+    crisp_handle* h = calloc(1, sizeof(crisp_handle));
+#else
+    crisp_handle* h = GC_MALLOC_UNCOLLECTABLE(sizeof(crisp_handle));
+#endif
+    if (!h) {
+        puts("malloc failed");
+        exit(-1);
+    }
+    outer_vm outer;
+    enter(vm, &outer);
+    h->vm = vm;
+    h->name = sym((char*) name);
+    bool callable = resolve(h);
+    leave(vm, &outer);
+    if (callable) return h;
+    crisp_release(h);
+    return NULL;
+}
+
+// Bind a lambda's parameters to a vector of arguments, as bind_args does
+// for a list, in front of its closure's environment
+static cell bind_argv(fn_t* l, int argc, cell* argv) {
+    cell params = l->args;
+    // () . rest binds rest to every argument
+    if (!car(params) && TYPE(cdr(params)) == SYMBOL) params = cdr(params);
+    cell env = NIL;
+    cell* tail = &env;
+    int i;
+    for (i = 0; IS_PAIR(params) && i < argc; params = cdr(params), i++) {
+        *tail = LIST1(cons(car(params), argv[i]));
+        tail = &((pair*) PTR(*tail))->cdr;
+    }
+    if (params && !IS_PAIR(params)) {
+        cell rest = make_list(argc - i, NIL), c = rest;
+        for (; i < argc; i++, c = cdr(c)) SET_CAR(c, argv[i]);
+        *tail = LIST1(cons(params, rest));
+        tail = &((pair*) PTR(*tail))->cdr;
+    }
+    *tail = l->env;
+    return env;
+}
+
+// Apply a callable to a vector of arguments. Lambdas have them bound
+// without building an argument list
+static cell call(cell fn, int argc, cell* args) {
+    cell env = current_vm->global_env;
+    cell rv = NIL;
+    TRACE(TRACE_APPLY, fn);
+    if (TYPE(fn) == NATIVE_FN_V) return FN_V_PTR(fn)(argc, args);
+    if (TYPE(fn) == FN && current_vm->jit_enabled && jit_ready_v(fn, argc)) {
+        if (jit_apply_v(fn, args, &rv, &env)) return eval(rv, env);
+        return rv;
+    }
+    if (TYPE(fn) == FN) {
+        fn_t* l = (fn_t*) PTR(fn);
+        return eval(l->body, bind_argv(l, argc, args));
+    }
+    // Anything else takes its arguments as a list, as from eval
+    cell l = rv = make_list(argc, NIL);
+    int i;
+    for (i = 0; i < argc; i++, l = cdr(l)) SET_CAR(l, args[i]);
+    if (apply(fn, &rv, &env)) return eval(rv, env);
+    return rv;
+}
+
+// Call a prepared callable, converting arguments straight into a vector
+cell crisp_call(crisp_handle* h, int argc, crisp_arg* argv) {
+    outer_vm outer;
+    enter(h->vm, &outer);
+    cell rv = NIL;
+    if (resolve(h)) {
+        cell args[argc ? argc : 1];
+        int i;
+        for (i = 0; i < argc; i++) {
+            switch (argv[i].type) {
+                case CRISP_INT:
+                    args[i] = make_int(argv[i].i);
+                    break;
+                case CRISP_STR:
+                    args[i] = text(argv[i].s, strlen(argv[i].s));
+                    break;
+                default:
+                    args[i] = argv[i].c;
+            }
+        }
+        rv = call(h->fn, argc, args);
+    }
+    leave(h->vm, &outer);
+    return rv;
+}
+
+void crisp_release(crisp_handle* h) {
+#ifdef FUZZ
+    free(h);
+#else
+    GC_FREE(h);
+#endif
+}
+
+void crisp_vm_free(crisp_vm* vm) {
+    if (current_vm == vm) current_vm = NULL;
+    jit_free(vm);
+#ifdef FUZZ
+    free(vm);
+#else
+    GC_FREE(vm);
+#endif
+}